@@ -55,3 +55,120 @@ lookup <- function(object)
 {
   .Call("Rxmem_lookup", object, PACKAGE="xmem")
 }
+
+#' Apply a function to successive chunks of an xmem-backed vector.
+#'
+#' The data are read from the backing file with direct I/O, bypassing the
+#' page cache, so a one-pass scan of a huge vector doesn't evict other data.
+#' Each chunk is an ordinary vector of the same type as x.
+#'
+#' @param x an xmem-backed logical, integer, numeric, complex or raw vector
+#' @param FUN the function to apply to each chunk
+#' @param ... additional arguments to FUN
+#' @return a list of the results of FUN
+#' @export
+#' @examples
+#' \dontrun{
+#' threshold(1e6)
+#' x <- rnorm(1e7)
+#' sum(unlist(chunk_apply(x, sum)))
+#' }
+chunk_apply <- function(x, FUN, ...)
+{
+  s <- .Call("Rxmem_stream_open", x, PACKAGE="xmem")
+  if(is.null(s)) stop("x is not an xmem-backed vector")
+  on.exit(.Call("Rxmem_stream_close", s, PACKAGE="xmem"))
+  ans <- list()
+  while(!is.null(chunk <- .Call("Rxmem_stream_next", s, PACKAGE="xmem")))
+    ans[[length(ans)+1]] <- FUN(chunk, ...)
+  ans
+}
+
+#' Create or attach a named, persistent xmem-backed vector.
+#'
+#' The vector lives in a named backing file in the xmem path that outlives
+#' the R session, so a later session attaches the same data right away
+#' instead of rebuilding them. Changes to the vector go to the file.
+#'
+#' @param name the vector's name, a file name in the xmem path or a path
+#' @param length the vector length, omit to attach an existing vector
+#' @param type the vector type, omit to attach an existing vector of any type
+#' @return the vector
+#' @seealso \code{\link{remove_named}}
+#' @export
+#' @examples
+#' \dontrun{
+#' x <- named_vector("x", 1e8)
+#' x[] <- rnorm(1e8)
+#' # In a later session:
+#' x <- named_vector("x")
+#' }
+named_vector <- function(name, length,
+                         type=c("double","integer","logical","complex","raw"))
+{
+  types <- list(logical=10L, integer=13L, double=14L, complex=15L, raw=24L)
+  t <- NA_integer_
+  if(!missing(type)) t <- types[[match.arg(type)]]
+  else if(!missing(length)) t <- types$double
+  n <- NA_real_
+  if(!missing(length)) n <- as.numeric(length)
+  .Call("Rxmem_named", as.character(name), t, n, PACKAGE="xmem")
+}
+
+#' Remove a named vector created with named_vector.
+#'
+#' Vectors already attached stay usable until they are garbage collected.
+#'
+#' @param name the vector's name
+#' @return 0 on success, -1 otherwise
+#' @export
+remove_named <- function(name)
+{
+  .Call("Rxmem_unlink_named", as.character(name), PACKAGE="xmem")
+}
+
+#' Label the session's out-of-core data with a tag.
+#'
+#' File-backed vectors allocated from now on are charged to the tag, whose
+#' budgets are set with quota. Sessions sharing a server can each use their
+#' own tag, or several sessions one tag between them. NULL removes the label.
+#'
+#' @param name the tag, at most 63 characters
+#' @return 0 on success, -1 otherwise
+#' @seealso \code{\link{quota}}
+#' @export
+session_tag <- function(name=NULL)
+{
+  if(!is.null(name)) name <- as.character(name)
+  .Call("Rxmem_set_tag", name, PACKAGE="xmem")
+}
+
+#' Limit the out-of-core and resident bytes of a tag or the whole session.
+#'
+#' When a new file-backed vector would take the tag over its out-of-core
+#' budget, the allocation fails, blocks until other vectors are freed (for
+#' at most timeout milliseconds, 0 for no limit), or goes to the compressed
+#' tier, depending on action. Over the resident budget, the least recently
+#' used data are paged out to their files.
+#'
+#' @param tag a tag set with session_tag, or NULL for the whole session
+#' @param disk the out-of-core budget in bytes, 0 for none
+#' @param resident the resident budget in bytes, 0 for none (for the whole
+#' session 0 keeps the budget as it is)
+#' @param action "fail", "block" or "spill"
+#' @param timeout how long "block" waits, in milliseconds
+#' @return 0 on success, -1 otherwise
+#' @export
+#' @examples
+#' \dontrun{
+#' session_tag("alice")
+#' quota("alice", disk=50e9, resident=4e9, action="block", timeout=60000)
+#' }
+quota <- function(tag=NULL, disk=0, resident=0,
+                  action=c("fail","block","spill"), timeout=0)
+{
+  actions <- list(fail=0L, block=1L, spill=2L)
+  if(!is.null(tag)) tag <- as.character(tag)
+  .Call("Rxmem_set_quota", tag, as.numeric(disk), as.numeric(resident),
+        actions[[match.arg(action)]], as.integer(timeout), PACKAGE="xmem")
+}
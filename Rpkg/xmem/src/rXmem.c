@@ -1,8 +1,11 @@
 #include <dlfcn.h>
+#include <string.h>
+#include <sys/types.h>
 
 #include <R.h>
 #define USE_RINTERNALS
 #include <Rinternals.h>
+#include <R_ext/Rallocators.h>
 
 /* Measure the size of R's SEXP header */
 SEXP
@@ -239,3 +242,244 @@ Rxmem_lookup (SEXP OBJECT)
   free(s);
   return (VAL);
 }
+
+/* Resolve an xmem library function, raising an R error if it's missing. */
+static void *
+Rxmem_sym (const char *name)
+{
+  void *handle, *f;
+  char *derror;
+
+  handle = dlopen (NULL, RTLD_LAZY);
+  if (!handle) error ("%s\n", dlerror ());
+  dlerror ();
+  f = dlsym (handle, name);
+  if ((derror = dlerror ()) != NULL) error ("%s\n", derror);
+  dlclose (handle);
+  return f;
+}
+
+/* Chunked iteration over the data of an xmem-backed R vector through an
+ * O_DIRECT stream, see stream.c in libxmem. The stream state lives in an
+ * external pointer with a finalizer that closes the stream.
+ */
+struct Rxmem_stream
+{
+  void *s;                      /* struct xmem_stream */
+  SEXPTYPE type;
+  size_t esize;                 /* Element size */
+  size_t left;                  /* Data bytes left */
+};
+
+static void
+Rxmem_stream_finalize (SEXP PTR)
+{
+  struct Rxmem_stream *r = (struct Rxmem_stream *) R_ExternalPtrAddr (PTR);
+  void (*sclose)(void *);
+  if (!r) return;
+  sclose = (void (*)(void *)) Rxmem_sym ("xmem_stream_close");
+  sclose (r->s);
+  free (r);
+  R_ClearExternalPtr (PTR);
+}
+
+SEXP
+Rxmem_stream_open (SEXP OBJECT)
+{
+  SEXP PTR;
+  struct Rxmem_stream *r;
+  void *(*sopen)(void *);
+  off_t (*sseek)(void *, off_t);
+  void *s;
+  size_t esize;
+
+  switch (TYPEOF (OBJECT))
+    {
+    case LGLSXP: case INTSXP: esize = sizeof (int); break;
+    case REALSXP: esize = sizeof (double); break;
+    case CPLXSXP: esize = sizeof (Rcomplex); break;
+    case RAWSXP: esize = 1; break;
+    default: error ("unsupported vector type\n"); return R_NilValue;
+    }
+  sopen = (void *(*)(void *)) Rxmem_sym ("xmem_stream_open");
+  sseek = (off_t (*)(void *, off_t)) Rxmem_sym ("xmem_stream_seek");
+  s = sopen ((void *) OBJECT);
+  if (!s) return R_NilValue;
+  r = (struct Rxmem_stream *) malloc (sizeof (struct Rxmem_stream));
+  r->s = s;
+  r->type = TYPEOF (OBJECT);
+  r->esize = esize;
+  r->left = (size_t) XLENGTH (OBJECT) * esize;
+  sseek (s, (off_t) ((char *) DATAPTR (OBJECT) - (char *) OBJECT));
+  PROTECT (PTR = R_MakeExternalPtr (r, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx (PTR, Rxmem_stream_finalize, TRUE);
+  UNPROTECT (1);
+  return PTR;
+}
+
+/* Return the next chunk of the vector as a new vector of the same type, or
+ * NULL at the end.
+ */
+SEXP
+Rxmem_stream_next (SEXP PTR)
+{
+  SEXP VAL;
+  struct Rxmem_stream *r = (struct Rxmem_stream *) R_ExternalPtrAddr (PTR);
+  const void *(*snext)(void *, size_t *);
+  const void *p;
+  size_t n;
+
+  if (!r || r->left == 0) return R_NilValue;
+  snext = (const void *(*)(void *, size_t *)) Rxmem_sym ("xmem_stream_next");
+  p = snext (r->s, &n);
+  if (!p) return R_NilValue;
+  if (n > r->left) n = r->left;
+  r->left -= n;
+  PROTECT (VAL = allocVector (r->type, (R_xlen_t) (n / r->esize)));
+  memcpy (DATAPTR (VAL), p, n);
+  UNPROTECT (1);
+  return VAL;
+}
+
+SEXP
+Rxmem_stream_close (SEXP PTR)
+{
+  Rxmem_stream_finalize (PTR);
+  return R_NilValue;
+}
+
+/* Named vectors live in named regions of libxmem (xmem_map_named), whose
+ * backing files outlive the R session. R allocates them through a custom
+ * allocator, which puts its own bookkeeping and the vector header in front of
+ * the data; both are rewritten on every attach, the data stay as they are.
+ * The region's type tag holds the SEXPTYPE in its low 5 bits and above them
+ * the number of elements R added to round the data up to 8 bytes, so that
+ * the length can be recovered from the region size.
+ */
+static void *
+Rxmem_named_alloc (R_allocator_t *allocator, size_t size)
+{
+  void *(*map_named)(const char *, size_t, int);
+  map_named = (void *(*)(const char *, size_t, int))
+    Rxmem_sym ("xmem_map_named");
+/* XMEM_NAMED_CREATE | XMEM_NAMED_TAG(tag), see xmem_api.h */
+  return map_named ((const char *) allocator->data, size,
+                    0x40 | (((int) (size_t) allocator->res & 0x7ff) << 20));
+}
+
+static void
+Rxmem_named_free (R_allocator_t *allocator, void *mem)
+{
+  void (*free_ex)(void *);
+  free_ex = (void (*)(void *)) Rxmem_sym ("xmem_free_ex");
+  free_ex (mem);
+}
+
+/*
+ * Rxmem_named
+ * INPUT NAME SEXP    Region name
+ *       TYPE SEXP    SEXPTYPE of the vector, or NA to use the stored one
+ *       LENGTH SEXP  Vector length, or NA to attach an existing vector
+ * OUTPUT The vector
+ */
+SEXP
+Rxmem_named (SEXP NAME, SEXP TYPE, SEXP LENGTH)
+{
+  SEXP VAL;
+  R_allocator_t allocator;
+  int (*info)(const char *, size_t *, int *);
+  const char *name = CHAR (STRING_ELT (NAME, 0));
+  size_t size, esize, header;
+  R_xlen_t n;
+  int tag, type = INTEGER (TYPE)[0];
+
+  info = (int (*)(const char *, size_t *, int *)) Rxmem_sym ("xmem_named_info");
+  if (info (name, &size, &tag) < 0)
+    {
+      if (ISNA (REAL (LENGTH)[0]) || type == NA_INTEGER)
+        error ("no named vector %s\n", name);
+      tag = -1;
+    }
+  else if (type == NA_INTEGER)
+    type = tag & 31;
+  else if (type != (tag & 31))
+    error ("%s is not a vector of that type\n", name);
+  switch (type)
+    {
+    case LGLSXP: case INTSXP: esize = sizeof (int); break;
+    case REALSXP: esize = sizeof (double); break;
+    case CPLXSXP: esize = sizeof (Rcomplex); break;
+    case RAWSXP: esize = 1; break;
+    default: error ("unsupported vector type\n"); return R_NilValue;
+    }
+  if (tag < 0 || !ISNA (REAL (LENGTH)[0]))
+    {
+      n = (R_xlen_t) REAL (LENGTH)[0];
+      tag = type | (int) ((((n * esize + 7) & ~7) - n * esize) / esize) << 5;
+    }
+  else
+    {
+/* The allocator's bookkeeping and the header come before the data, and
+ * long vectors have their length and true length in front of that. */
+      PROTECT (VAL = allocVector (type, 1));
+      header = sizeof (R_allocator_t)
+        + (size_t) ((char *) DATAPTR (VAL) - (char *) VAL);
+      UNPROTECT (1);
+      if (size < header)
+        error ("%s is not an R vector\n", name);
+      n = (R_xlen_t) ((size - header) / esize) - (tag >> 5);
+      if (n > R_SHORT_LEN_MAX)
+        n -= (R_xlen_t) (2 * sizeof (R_xlen_t) / esize);
+    }
+  allocator.mem_alloc = Rxmem_named_alloc;
+  allocator.mem_free = Rxmem_named_free;
+  allocator.res = (void *) (size_t) tag;
+  allocator.data = (void *) name;
+  return allocVector3 ((SEXPTYPE) type, n, &allocator);
+}
+
+SEXP
+Rxmem_unlink_named (SEXP NAME)
+{
+  SEXP VAL;
+  int (*unlink_named)(const char *);
+  unlink_named = (int (*)(const char *)) Rxmem_sym ("xmem_unlink_named");
+  PROTECT (VAL = allocVector (INTSXP, 1));
+  INTEGER (VAL)[0] = unlink_named (CHAR (STRING_ELT (NAME, 0)));
+  UNPROTECT (1);
+  return VAL;
+}
+
+/* Quotas, see quota.c. An R session is one process, so its tag is the
+ * process default rather than a thread tag.
+ */
+SEXP
+Rxmem_set_tag (SEXP NAME)
+{
+  SEXP VAL;
+  int (*set_tag)(const char *, int);
+  set_tag = (int (*)(const char *, int)) Rxmem_sym ("xmem_set_tag");
+  PROTECT (VAL = allocVector (INTSXP, 1));
+  INTEGER (VAL)[0] = set_tag (isNull (NAME) ? NULL
+                              : CHAR (STRING_ELT (NAME, 0)), 0);
+  UNPROTECT (1);
+  return VAL;
+}
+
+SEXP
+Rxmem_set_quota (SEXP TAG, SEXP DISK, SEXP RESIDENT, SEXP ACTION,
+                 SEXP TIMEOUT)
+{
+  SEXP VAL;
+  int (*set_quota)(const char *, size_t, size_t, int, int);
+  set_quota = (int (*)(const char *, size_t, size_t, int, int))
+    Rxmem_sym ("xmem_set_quota");
+  PROTECT (VAL = allocVector (INTSXP, 1));
+  INTEGER (VAL)[0] = set_quota (isNull (TAG) ? NULL
+                                : CHAR (STRING_ELT (TAG, 0)),
+                                (size_t) REAL (DISK)[0],
+                                (size_t) REAL (RESIDENT)[0],
+                                INTEGER (ACTION)[0], INTEGER (TIMEOUT)[0]);
+  UNPROTECT (1);
+  return VAL;
+}
@@ -16,6 +16,25 @@ size_t xmem_threshold = 2000000000;
 
 int xmem_advise = MADV_SEQUENTIAL;
 int xmem_offset = 0;
+int xmem_unlinked = 0;
+int xmem_fork_cow = 0;
+int xmem_prealloc = XMEM_PREALLOC_SPARSE;
+int xmem_enospc = XMEM_ENOSPC_FAIL;
+int xmem_populate = XMEM_POPULATE_OFF;
+size_t xmem_populate_max = 0;
+int xmem_io_threads = 4;
+size_t xmem_budget = 0;
+size_t xmem_resident_bytes = 0;
+size_t xmem_reap_limit = 0;
+size_t xmem_cache_bytes = 0;
+int xmem_reserve_factor = 0;
+size_t xmem_reserve_cap = 0;
+size_t xmem_stripe_chunk = 67108864;
+
+int xmem_profile_mode = XMEM_PROFILE_OFF;
+size_t xmem_profile_min = 1048576;
+char xmem_profile_path[XMEM_MAX_PATH_LEN];
+pid_t xmem_profile_pid;
 
 /* The next functions allow applications to inspect and change default
  * settings. The application must dynamically locate them with dlsym after
@@ -28,8 +47,28 @@ int xmem_offset = 0;
  * int xmem_set_path (char *path)
  * int xmem_madvise (int j)
  * int xmem_memcpy_offset (int j)
+ * int xmem_set_unlink (int j)
+ * int xmem_set_fork_cow (int j)
+ * int xmem_set_prealloc (int j)
+ * int xmem_set_enospc (int j)
+ * int xmem_set_populate (int j, size_t max)
+ * int xmem_set_tier (int j)
+ * int xmem_tier_period (int ms)
+ * size_t xmem_tier_evict ()
+ * int xmem_set_io_threads (int j)
+ * size_t xmem_set_budget (size_t j)
+ * size_t xmem_resident ()
+ * size_t xmem_set_reaper (size_t j)
+ * size_t xmem_set_cache (size_t j)
+ * int xmem_set_reserve (int factor, size_t cap)
+ * ssize_t xmem_compact (void *addr, int async)
+ * size_t xmem_compacted ()
+ * int xmem_prefetch (void *addr, size_t offset, size_t length)
+ * int xmem_flush (void *addr)
  * char * xmem_lookup(void *addr)
  * char * xmem_get_template()
+ * int xmem_profile (int mode, char *path)
+ * size_t xmem_profile_floor (size_t j)
  */
 
 /* Set and get threshold size.
@@ -76,6 +115,286 @@ xmem_memcpy_offset (int j)
   return xmem_offset;
 }
 
+/* Set the backing file naming option. When j is 1 new backing files are
+ * anonymous (O_TMPFILE, or unlinked right after creation) and are reclaimed
+ * automatically when their last mapping goes away, even after a crash. When
+ * j is 0 backing files are named after the file template and unlinked by
+ * free. Other values leave the option unchanged.
+ */
+int
+xmem_set_unlink (int j)
+{
+  if(j == 0 || j == 1)
+  {
+    omp_set_nest_lock (&lock);
+    xmem_unlinked = j;
+    omp_unset_nest_lock (&lock);
+  }
+  return xmem_unlinked;
+}
+
+/* Set what a forked child sees of the file-backed regions it inherits. When
+ * j is 0 (the default) they stay shared with the parent, whose data the
+ * child reads and writes; when j is 1 the child remaps them copy-on-write,
+ * so it keeps the data as of the fork and its writes are its own. Other
+ * values leave the option unchanged.
+ */
+int
+xmem_set_fork_cow (int j)
+{
+  if(j == 0 || j == 1)
+  {
+    omp_set_nest_lock (&lock);
+    xmem_fork_cow = j;
+    omp_unset_nest_lock (&lock);
+  }
+  return xmem_fork_cow;
+}
+
+/* Select how backing files are preallocated: XMEM_PREALLOC_SPARSE (the
+ * default), XMEM_PREALLOC_FULL or XMEM_PREALLOC_CHUNK. calloc regions stay
+ * sparse. Returns the mode on exit.
+ */
+int
+xmem_set_prealloc (int j)
+{
+  if (j >= XMEM_PREALLOC_SPARSE && j <= XMEM_PREALLOC_CHUNK)
+  {
+    omp_set_nest_lock (&lock);
+    xmem_prealloc = j;
+    omp_unset_nest_lock (&lock);
+  }
+  return xmem_prealloc;
+}
+
+/* Select what malloc does when a backing file can't be preallocated for
+ * lack of space: XMEM_ENOSPC_FAIL (return NULL, the default),
+ * XMEM_ENOSPC_HEAP or XMEM_ENOSPC_TIER. Returns the policy on exit.
+ */
+int
+xmem_set_enospc (int j)
+{
+  if (j >= XMEM_ENOSPC_FAIL && j <= XMEM_ENOSPC_TIER)
+  {
+    omp_set_nest_lock (&lock);
+    xmem_enospc = j;
+    omp_unset_nest_lock (&lock);
+  }
+  return xmem_enospc;
+}
+
+/* Select how new regions of at most max bytes (0 for any size) are
+ * pre-faulted: XMEM_POPULATE_OFF (the default), XMEM_POPULATE_SYNC,
+ * XMEM_POPULATE_PARALLEL or XMEM_POPULATE_ASYNC. Returns the mode on exit.
+ */
+int
+xmem_set_populate (int j, size_t max)
+{
+  if (j >= XMEM_POPULATE_OFF && j <= XMEM_POPULATE_ASYNC)
+  {
+    omp_set_nest_lock (&lock);
+    xmem_populate = j;
+    xmem_populate_max = max;
+    omp_unset_nest_lock (&lock);
+  }
+  return xmem_populate;
+}
+
+/* Set the tier of new out of core allocations, XMEM_TIER_FILE or
+ * XMEM_TIER_COMPRESSED. Returns the tier on exit, which is unchanged if the
+ * requested tier is not available.
+ */
+int
+xmem_set_tier (int j)
+{
+  omp_set_nest_lock (&lock);
+  if (j == XMEM_TIER_FILE ||
+      (j == XMEM_TIER_COMPRESSED && xmem_tier_available ()))
+    xmem_tier = j;
+  omp_unset_nest_lock (&lock);
+  return xmem_tier;
+}
+
+/* Set the interval in milliseconds between automatic sweeps of the
+ * compressed tier for cold chunks. Zero disables automatic sweeps, negative
+ * values leave the setting unchanged. Takes effect after the next sweep or
+ * fault.
+ */
+int
+xmem_tier_period (int ms)
+{
+  if (ms > -1) xmem_tier_interval = ms;
+  return xmem_tier_interval;
+}
+
+/* Run one sweep of the compressed tier now. Chunks not referenced since the
+ * previous sweep are evicted. Returns the number of bytes evicted.
+ */
+size_t
+xmem_tier_evict ()
+{
+  return xmem_tier_sweep ();
+}
+
+/* Set the number of I/O thread pool workers used when io_uring is not
+ * available. Takes effect when the pool is first started.
+ */
+int
+xmem_set_io_threads (int j)
+{
+  if (j > 0) xmem_io_threads = j;
+  return xmem_io_threads;
+}
+
+/* Set the page cache residency budget of all file-backed regions together
+ * in bytes and start the governor. A budget of 0 turns it off. Returns the
+ * budget on exit.
+ */
+size_t
+xmem_set_budget (size_t j)
+{
+  omp_set_nest_lock (&lock);
+  xmem_budget = j;
+  omp_unset_nest_lock (&lock);
+  xmem_governor_start ();
+  return xmem_budget;
+}
+
+/* Return the resident bytes of all file-backed regions as of the last
+ * governor sample.
+ */
+size_t
+xmem_resident ()
+{
+  return xmem_resident_bytes;
+}
+
+/* Set the number of bytes of freed backing files that may wait for removal
+ * by the reaper thread. 0 (the default) removes them synchronously in free.
+ * Returns the limit on exit.
+ */
+size_t
+xmem_set_reaper (size_t j)
+{
+  omp_set_nest_lock (&lock);
+  xmem_reap_limit = j;
+  omp_unset_nest_lock (&lock);
+  if (j == 0)
+    xmem_reap_wait ();
+  return xmem_reap_limit;
+}
+
+/* Set the number of bytes of freed regions each thread, and the pool shared
+ * by all threads, may keep mapped for reuse by malloc. 0 (the default)
+ * releases regions in free. Lowering the budget trims the pool and the
+ * calling thread's cache right away, other threads' on their next free or
+ * exit. Returns the budget on exit.
+ */
+size_t
+xmem_set_cache (size_t j)
+{
+  omp_set_nest_lock (&lock);
+  xmem_cache_bytes = j;
+  xmem_cache_trim ();
+  omp_unset_nest_lock (&lock);
+  return xmem_cache_bytes;
+}
+
+/* Set the reservation mode. With factor 2 or more new file-backed regions
+ * reserve factor times their length of address space, but no more than cap
+ * bytes beyond it when cap is not 0, and realloc grows them in place within
+ * that. 0 or 1 (the default) turns the mode off. Other values leave it
+ * unchanged. Returns the factor on exit.
+ */
+int
+xmem_set_reserve (int factor, size_t cap)
+{
+  if (factor >= 0 && factor <= 64)
+  {
+    omp_set_nest_lock (&lock);
+    xmem_reserve_factor = factor;
+    xmem_reserve_cap = cap;
+    omp_unset_nest_lock (&lock);
+  }
+  return xmem_reserve_factor;
+}
+
+/* Punch the all-zero pages of the region at addr out of its backing file,
+ * giving their disk blocks and page cache back. With async set the work is
+ * queued on the I/O pool and 0 is returned, otherwise the bytes reclaimed.
+ * Returns -1 if addr is not the start of a file-backed region that may be
+ * compacted. Writers wait for the chunk being checked, and chunks the
+ * governor has seen in use are skipped. Freeing the region cancels it.
+ */
+ssize_t
+xmem_compact (void *addr, int async)
+{
+  if (async)
+    return xmem_compact_async (addr);
+  return xmem_compact_region (addr);
+}
+
+/* Return the bytes reclaimed by compaction so far. */
+size_t
+xmem_compacted ()
+{
+  return xmem_compacted_bytes;
+}
+
+/* Start reading length bytes at offset into the region at addr into the page
+ * cache in the background. A length of 0 means to the end of the region.
+ * Returns 0 if the prefetch was queued, a negative number otherwise.
+ */
+int
+xmem_prefetch (void *addr, size_t offset, size_t length)
+{
+  struct map *x;
+  int j = -1, fd;
+  omp_set_nest_lock (&lock);
+  HASH_FIND_PTR (flexmap, &addr, x);
+  if (x && offset < x->length && (fd = xmem_fd (x)) > -1)
+  {
+    if (length == 0 || length > x->length - offset)
+      length = x->length - offset;
+    j = xmem_io_prefetch (fd, offset, length);
+    close (fd);
+  }
+  omp_unset_nest_lock (&lock);
+  return j;
+}
+
+/* Write back the dirty pages of the region at addr to its backing file and
+ * wait for them. Returns 0 on success, a negative number otherwise.
+ */
+int
+xmem_flush (void *addr)
+{
+  struct map *x;
+  size_t length = 0;
+  int fd = -1;
+  omp_set_nest_lock (&lock);
+  HASH_FIND_PTR (flexmap, &addr, x);
+  if (x && XMEM_FILE (x) && x->pid == xmem_pid)
+  {
+    fd = xmem_fd (x);
+    length = x->length;
+  }
+/* Striped regions keep no descriptors, see stripe.c, and regions inherited
+ * from the parent get none, see xmem_fd in xmem.c.
+ */
+  else if (x && (x->striped || XMEM_FILE (x)))
+  {
+    length = msync (addr, x->length, MS_SYNC);
+    omp_unset_nest_lock (&lock);
+    return (int) length;
+  }
+  omp_unset_nest_lock (&lock);
+  if (fd < 0) return -1;
+  length = xmem_io_flush (fd, 0, length);
+  close (fd);
+  return (int) length;
+}
+
 /* Set the file template character string
  * INPUT name, a proposed new xmem_fname_template string
  * Returns 0 on sucess, a negative number otherwise.
@@ -149,7 +468,9 @@ xmem_get_template()
   return s;
 }
 /* Lookup an address, returning NULL if the address is not found or a strdup
- * locally-allocated copy of the backing file path for the address. No guarantee
+ * locally-allocated copy of the backing file path for the address. Unlinked
+ * backing files are reported as their /proc/self/fd path; compressed tier
+ * regions have no backing file and are reported as NULL. No guarantee
  * is made that the address or backing file will be valid after this call, so
  * it's really up to the caller to make sure free is not called on the address
  * simultaneously with this call. CALLER'S RESPONSIBILITY TO FREE RESULT!
@@ -158,11 +479,64 @@ char *
 xmem_lookup(void *addr)
 {
   char *f = NULL;
+  char fdpath[64];
   struct map *x;
   omp_set_nest_lock (&lock);
   HASH_FIND_PTR (flexmap, &addr, x);
-  if(x) f = strndup(x->path,XMEM_MAX_PATH_LEN);
+  if(x && x->path) f = strndup(x->path,XMEM_MAX_PATH_LEN);
+  else if(x && x->fd > -1)
+  {
+    snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", x->fd);
+    f = strdup(fdpath);
+  }
   omp_unset_nest_lock (&lock);
   return f;
 }
+
+/* Set the call site profiling mode.
+ * INPUT
+ * mode: XMEM_PROFILE_OFF, XMEM_PROFILE_RECORD or XMEM_PROFILE_APPLY
+ * path: the profile file to write (RECORD) or read (APPLY)
+ * OUTPUT
+ * (return value): 0 on success, a negative number otherwise.
+ *
+ * A recorded profile is written when recording is switched off or the
+ * library is finalized. Applying a profile overrides xmem_threshold for the
+ * call sites it has an opinion about.
+ */
+int
+xmem_profile (int mode, char *path)
+{
+  int j = 0;
+  if (mode < XMEM_PROFILE_OFF || mode > XMEM_PROFILE_APPLY) return -1;
+  if (mode != XMEM_PROFILE_OFF && (!path || strlen(path) < 1)) return -2;
+  omp_set_nest_lock (&lock);
+  if (xmem_profile_mode == XMEM_PROFILE_RECORD && xmem_profile_pid == getpid())
+    xmem_profile_save (xmem_profile_path);
+  xmem_profile_mode = XMEM_PROFILE_OFF;
+  xmem_profile_clear ();
+  if (mode != XMEM_PROFILE_OFF)
+  {
+    memset(xmem_profile_path, 0, XMEM_MAX_PATH_LEN);
+    strncpy(xmem_profile_path, path, XMEM_MAX_PATH_LEN - 1);
+  }
+  if (mode == XMEM_PROFILE_APPLY && xmem_profile_load (path) < 0) j = -3;
+  else xmem_profile_mode = mode;
+  xmem_profile_pid = getpid();
+  omp_unset_nest_lock (&lock);
+  return j;
+}
+
+/* Set and get the smallest allocation size that is profiled. */
+size_t
+xmem_profile_floor (size_t j)
+{
+  if (j > 0)
+  {
+    omp_set_nest_lock (&lock);
+    xmem_profile_min = j;
+    omp_unset_nest_lock (&lock);
+  }
+  return xmem_profile_min;
+}
 // XXX Also add a list all mappings function??
@@ -0,0 +1,275 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Short-lived regions just above the threshold pay for a file, an mmap, a
+ * hash insert and a cold page cache on malloc, and for an munmap and an
+ * unlink on free. With a cache budget set (xmem_set_cache in api.c) free
+ * keeps plain file-backed regions mapped, file and all, on a free list of
+ * the freeing thread, and malloc of the same size class in that thread
+ * hands one back without the lock or a system call, pages still resident.
+ *
+ * A cached region's file is unlinked, so that it goes away with the process
+ * however that ends; a reused region is anonymous like those of
+ * xmem_set_unlink.
+ *
+ * Cached regions stay in flexmap, marked by m->cached, so taking one off a
+ * free list changes nothing anyone else can see. free still takes the lock
+ * to look its pointer up, but does nothing else there. Regions are rounded
+ * up to one of four size classes per power of two so that they can be
+ * reused for any request of their class; what a region has past the size
+ * asked for is only address space, its file is sparse. m->length is the
+ * rounded length and m->size the size asked for, which memcpy goes by.
+ *
+ * Each thread caches at most xmem_cache_bytes. What doesn't fit, what a
+ * thread hasn't reused within XMEM_CACHE_PERIOD frees and what a thread
+ * leaves behind when it exits goes to a global pool of the same budget,
+ * which other threads take from under the lock. What doesn't fit there is
+ * released for real.
+ *
+ * Free lists are per process: after fork a child ignores its parent's, and
+ * the regions on them are the parent's anyway.
+ */
+
+struct tcache
+{
+  struct map *bin[XMEM_CACHE_CLASSES];
+  size_t bytes;
+  unsigned int epoch;           /* Stamp of entries cached now */
+  unsigned int frees;
+  pid_t pid;
+};
+
+static __thread struct tcache tc;
+static struct map *pool[XMEM_CACHE_CLASSES];
+static size_t pool_bytes;
+static pid_t pool_pid;
+static pthread_key_t key;
+static pthread_once_t konce = PTHREAD_ONCE_INIT;
+
+/* The size class of n bytes, or -1 if n isn't cached, and its size in s. */
+static int
+class (size_t n, size_t *s)
+{
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  size_t q;
+  int k;
+  if (n < 4 * pg)
+    return -1;
+  k = 63 - __builtin_clzl (n - 1);
+  q = (size_t) 1 << (k - 2);
+  *s = ((n + q - 1) / q) * q;
+  return 4 * k + (int) (*s >> (k - 2)) - 4 - 1;
+}
+
+/* Forget the free lists of another process. */
+static void
+check ()
+{
+  if (tc.pid != xmem_pid)
+    {
+      memset (&tc, 0, sizeof (tc));
+      tc.pid = xmem_pid;
+    }
+  if (pool_pid != xmem_pid)
+    {
+      memset (pool, 0, sizeof (pool));
+      pool_bytes = 0;
+      pool_pid = xmem_pid;
+    }
+}
+
+/* Put the cached region m on the pool of class c, or release it if the pool
+ * is full. Called with the lock held.
+ */
+static void
+to_pool (struct map *m, int c)
+{
+  if (pool_bytes + m->length > xmem_cache_bytes)
+    {
+      m->cached = 0;
+      xmem_release (m);
+      return;
+    }
+  m->next = pool[c];
+  pool[c] = m;
+  pool_bytes += m->length;
+}
+
+/* Move the entries of the calling thread's free lists stamped before epoch
+ * (all of them with ~0), those not reused for a whole period when epoch is
+ * the new one, to the pool. Called with the lock held.
+ */
+static void
+retire (unsigned int epoch)
+{
+  struct map **p, *m, *next;
+  int c;
+  for (c = 0; c < XMEM_CACHE_CLASSES; ++c)
+    {
+/* Lists are in stamp order, most recent first. */
+      for (p = &tc.bin[c]; *p && (*p)->cached >= epoch; p = &(*p)->next);
+      for (m = *p, *p = NULL; m; m = next)
+        {
+          next = m->next;
+          tc.bytes -= m->length;
+          to_pool (m, c);
+        }
+    }
+}
+
+/* Hand the free lists of an exiting thread to the pool. With caching off,
+ * after xmem_finalize in particular, they are left to xmem_finalize.
+ */
+static void
+exiting (void *arg)
+{
+  (void) arg;
+  omp_set_nest_lock (&lock);
+  if (xmem_cache_bytes && tc.pid == xmem_pid)
+    retire (~0U);
+  omp_unset_nest_lock (&lock);
+}
+
+static void
+once ()
+{
+  pthread_key_create (&key, exiting);
+}
+
+/* The length to map for a region of n bytes that may be cached later. */
+size_t
+xmem_cache_size (size_t n)
+{
+  size_t s;
+  return xmem_cache_bytes && class (n, &s) >= 0 && s <= xmem_cache_bytes
+    ? s : n;
+}
+
+/* Take a cached region for a request of n bytes, from the calling thread's
+ * free list without the lock if it has one. Returns its address or NULL.
+ * A region may go to a smaller request of its class than the one it was
+ * made for, so xmem_min_mapped, which xmem_free_sized trusts, may have to
+ * go down.
+ */
+void *
+xmem_cache_get (size_t n)
+{
+  struct map *m;
+  size_t s;
+  int c = class (n, &s);
+  if (c < 0 || !xmem_cache_bytes)
+    return NULL;
+  if (tc.pid == xmem_pid && tc.bin[c] && n >= xmem_min_mapped)
+    {
+      m = tc.bin[c];
+      tc.bin[c] = m->next;
+      tc.bytes -= m->length;
+      m->cached = 0;
+      m->size = n;
+      return m->addr;
+    }
+  omp_set_nest_lock (&lock);
+  check ();
+  if (tc.pid == xmem_pid && tc.bin[c])
+    {
+      m = tc.bin[c];
+      tc.bin[c] = m->next;
+      tc.bytes -= m->length;
+    }
+  else if ((m = pool[c]))
+    {
+      pool[c] = m->next;
+      pool_bytes -= m->length;
+    }
+  if (m)
+    {
+      m->cached = 0;
+      m->size = n;
+      if (n < xmem_min_mapped)
+        xmem_min_mapped = n;
+    }
+  omp_unset_nest_lock (&lock);
+  return m ? m->addr : NULL;
+}
+
+/* Cache the region of m, which free found, instead of releasing it. Returns
+ * 0 if it was cached, -1 if the caller must release it. Called with the
+ * lock held.
+ */
+int
+xmem_cache_put (struct map *m)
+{
+  size_t s;
+  int c;
+  if (!xmem_cache_bytes || !XMEM_FILE (m) || m->tier || m->lazy || m->named
+      || m->shared || m->pid != xmem_pid
+      || (c = class (m->length, &s)) < 0 || s != m->length
+      || s > xmem_cache_bytes)
+    return -1;
+/* The file loses its path below, so its descriptor must stay open. */
+  if (xmem_keepfd (m) < 0)
+    return -1;
+  pthread_once (&konce, once);
+  check ();
+/* Nothing should be left behind if the process never frees it again. */
+  if (m->path)
+    {
+      unlink (m->path);
+      uthash_free_ (m->path);
+      m->path = NULL;
+    }
+  if (!pthread_getspecific (key))
+    pthread_setspecific (key, &tc);
+  if (++tc.frees % XMEM_CACHE_PERIOD == 0)
+    retire (++tc.epoch);
+  m->cached = tc.epoch + 1;
+  if (tc.bytes + m->length > xmem_cache_bytes)
+    {
+      to_pool (m, c);
+      return 0;
+    }
+  m->next = tc.bin[c];
+  tc.bin[c] = m;
+  tc.bytes += m->length;
+  return 0;
+}
+
+/* Release pooled regions over the budget, and the calling thread's cached
+ * regions if caching is off. Called with the lock held.
+ */
+void
+xmem_cache_trim ()
+{
+  struct map *m;
+  int c;
+  check ();
+  if (!xmem_cache_bytes)
+    retire (~0U);
+  for (c = XMEM_CACHE_CLASSES - 1; c >= 0 && pool_bytes > xmem_cache_bytes;
+       --c)
+    while ((m = pool[c]) && pool_bytes > xmem_cache_bytes)
+      {
+        pool[c] = m->next;
+        pool_bytes -= m->length;
+        m->cached = 0;
+        xmem_release (m);
+      }
+}
@@ -0,0 +1,558 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+#include <linux/fs.h>
+
+#define uthash_malloc(sz) uthash_malloc_(sz)
+#define uthash_free(ptr, sz) uthash_free_(ptr)
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * xmem_checkpoint writes the data of every live region of the process to a
+ * directory, one file per region named after its address, and a manifest
+ * listing the regions. xmem_restore maps them back, in a new process, at
+ * their original addresses (MAP_FIXED_NOREPLACE) on new backing files.
+ *
+ * The first checkpoint into a directory copies everything: it clones the
+ * backing file with FICLONE where the file system has reflinks (btrfs, xfs),
+ * which shares the blocks and costs next to nothing, and copies it with the
+ * I/O engine otherwise. Later checkpoints into the same directory only write
+ * the pages dirtied since the previous one, found through the soft-dirty
+ * bits of /proc/self/pagemap, which every checkpoint clears. Without
+ * soft-dirty support in the kernel (CONFIG_MEM_SOFT_DIRTY) every checkpoint
+ * is a full one.
+ *
+ * A dirty page loses its soft-dirty bit when it is paged out, so the
+ * governor reports the chunks it evicts (xmem_checkpoint_evict) and they are
+ * copied whole. Pages the kernel reclaims on its own under memory pressure
+ * are not seen; pass XMEM_CHECKPOINT_FULL when that may have happened.
+ * Compressed tier regions are always copied whole, through memory.
+ *
+ * Writes that go to a backing file instead of the mapping (the memcpy fast
+ * path, realloc, streams) leave no soft-dirty bits behind. They mark their
+ * region m->fdirty, and such regions are copied whole, as are named and
+ * shared regions, which other processes may write to.
+ *
+ * The list of regions is taken under the lock and the data are copied
+ * without it. The governor holds off meanwhile (xmem_checkpoint_busy), so
+ * no page loses its soft-dirty bit halfway through. Other threads must not
+ * write to or free regions while a checkpoint runs. The manifest is removed
+ * first and written last, so an interrupted checkpoint can't be restored
+ * from. Named and shared regions come back as ordinary regions holding the
+ * data they had.
+ */
+
+#define XMEM_CHECKPOINT_MANIFEST "manifest"
+#define XMEM_PAGEMAP_SOFT_DIRTY (1ULL << 55)
+
+/* A region of the last checkpoint */
+struct ckpt
+{
+  void *addr;                   /* Region address, hash key */
+  size_t length;
+  unsigned char *lost;          /* Governor chunks paged out while dirty */
+  int seen;                     /* Still live at this checkpoint */
+  UT_hash_handle hh;
+};
+
+/* A region to write, taken from flexmap under the lock */
+struct job
+{
+  void *addr;
+  size_t length;
+  struct ckpt *c;               /* Its entry in last, NULL if never touched */
+  int fd;                       /* Duplicate of its backing file, or -1 */
+  int full;                     /* Write all of it */
+};
+
+static struct ckpt *last;
+static char last_dir[XMEM_MAX_PATH_LEN];
+static int softdirty = -1;
+int xmem_checkpoint_busy;
+
+/* Check once whether the kernel keeps soft-dirty bits: a page written to
+ * in a new mapping has one.
+ */
+static int
+probe ()
+{
+  uint64_t e = 0;
+  char *p;
+  int fd;
+  if (softdirty > -1)
+    return softdirty;
+  softdirty = 0;
+  p = (char *) mmap (NULL, 4096, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return 0;
+  *(volatile char *) p = 1;
+  fd = open ("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (fd > -1
+      && pread (fd, &e, sizeof (e),
+                (uintptr_t) p / sysconf (_SC_PAGESIZE) * sizeof (e)) ==
+      sizeof (e))
+    softdirty = (e & XMEM_PAGEMAP_SOFT_DIRTY) != 0;
+  if (fd > -1)
+    close (fd);
+  munmap (p, 4096);
+  return softdirty;
+}
+
+/* Clear the soft-dirty bits of the whole process. */
+static void
+clear ()
+{
+  int fd = open ("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (write (fd, "4", 1) < 0)
+    softdirty = 0;
+  close (fd);
+}
+
+/* Whether any page in [addr, addr + n) is soft-dirty. */
+static int
+dirty (int pm, char *addr, size_t n)
+{
+  uint64_t e[512];
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  size_t first = (uintptr_t) addr / pg, count = (n + pg - 1) / pg, i, j, k;
+  for (j = 0; j < count; j += k)
+    {
+      k = count - j < 512 ? count - j : 512;
+      if (pread (pm, e, k * sizeof (uint64_t), (first + j) * sizeof (uint64_t))
+          < (ssize_t) (k * sizeof (uint64_t)))
+        return 1;
+      for (i = 0; i < k; ++i)
+        if (e[i] & XMEM_PAGEMAP_SOFT_DIRTY)
+          return 1;
+    }
+  return 0;
+}
+
+/* Record that the governor is about to page out [off, off + n) of the
+ * region of m. Must be called with the lock held.
+ */
+void
+xmem_checkpoint_evict (struct map *m, size_t off, size_t n)
+{
+  struct ckpt *c;
+  size_t chunks;
+  int pm;
+  if (!last || softdirty < 1)
+    return;
+  HASH_FIND_PTR (last, &m->addr, c);
+  if (!c || c->length != m->length)
+    return;
+  chunks = (c->length + XMEM_GOVERNOR_CHUNK - 1) / XMEM_GOVERNOR_CHUNK;
+  if (!c->lost)
+    {
+      c->lost = (unsigned char *) uthash_malloc_ (chunks);
+      if (!c->lost)
+        return;
+      memset (c->lost, 0, chunks);
+    }
+  pm = open ("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (pm < 0 || dirty (pm, (char *) m->addr + off, n))
+    c->lost[off / XMEM_GOVERNOR_CHUNK] = 1;
+  if (pm > -1)
+    close (pm);
+}
+
+/* Remove c from last and deallocate it. */
+static void
+unckpt (struct ckpt *c)
+{
+  HASH_DEL (last, c);
+  if (c->lost)
+    uthash_free_ (c->lost);
+  uthash_free_ (c);
+}
+
+/* Write [off, off + n) of the region of c to fd, from memory. */
+static int
+put (int fd, struct ckpt *c, size_t off, size_t n)
+{
+  ssize_t s;
+  while (n > 0)
+    {
+      s = pwrite (fd, (char *) c->addr + off, n, off);
+      if (s <= 0)
+        return -1;
+      off += s;
+      n -= s;
+    }
+  return 0;
+}
+
+/* Write the soft-dirty pages and lost chunks of the region of c to fd, in
+ * runs of consecutive pages.
+ */
+static int
+put_dirty (int fd, int pm, struct ckpt *c)
+{
+  uint64_t e[512];
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  size_t first = (uintptr_t) c->addr / pg;
+  size_t count = (c->length + pg - 1) / pg;
+  size_t per = XMEM_GOVERNOR_CHUNK / pg;
+  size_t j, k, i, run = 0, start = 0;
+  int d;
+
+  for (j = 0; j < count; j += k)
+    {
+      k = count - j < 512 ? count - j : 512;
+      if (pread (pm, e, k * sizeof (uint64_t), (first + j) * sizeof (uint64_t))
+          < (ssize_t) (k * sizeof (uint64_t)))
+        return -1;
+      for (i = 0; i < k; ++i)
+        {
+          d = (e[i] & XMEM_PAGEMAP_SOFT_DIRTY)
+            || (c->lost && c->lost[(j + i) / per]);
+          if (d && !run++)
+            start = j + i;
+          if (!d && run)
+            {
+              if (put (fd, c, start * pg, run * pg) < 0)
+                return -1;
+              run = 0;
+            }
+        }
+    }
+  if (run && put (fd, c, start * pg, c->length - start * pg) < 0)
+    return -1;
+  return 0;
+}
+
+/* Write all of the region of c to fd, from its backing file src, or from
+ * memory if src is -1.
+ */
+static int
+put_all (int fd, int src, struct ckpt *c)
+{
+  if (ftruncate (fd, 0) < 0)
+    return -1;
+  if (src > -1)
+    {
+      if (ioctl (fd, FICLONE, src) == 0)
+        return ftruncate (fd, c->length);
+      if (ftruncate (fd, c->length) < 0)
+        return -1;
+      return xmem_io_copy (src, 0, fd, 0, c->length);
+    }
+  if (ftruncate (fd, c->length) < 0)
+    return -1;
+  return put (fd, c, 0, c->length);
+}
+
+/* Checkpoint the live regions of this process into the directory dir, see
+ * the notes above. flags is 0 or XMEM_CHECKPOINT_FULL. Returns the number
+ * of regions written, or -1 with errno set (EBUSY while another checkpoint
+ * runs).
+ */
+int
+xmem_checkpoint (const char *dir, int flags)
+{
+  char path[XMEM_MAX_PATH_LEN], final[XMEM_MAX_PATH_LEN];
+  struct map *m, *tmp;
+  struct ckpt *c, *ctmp;
+  struct job *jobs = NULL;
+  FILE *f = NULL;
+  int fd, pm = -1, n = 0, i, j = 0, same;
+
+  if (!dir || strlen (dir) > XMEM_MAX_PATH_LEN - 64)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  if (mkdir (dir, 0700) < 0 && errno != EEXIST)
+    return -1;
+  omp_set_nest_lock (&lock);
+  if (xmem_checkpoint_busy)
+    {
+      omp_unset_nest_lock (&lock);
+      errno = EBUSY;
+      return -1;
+    }
+  xmem_checkpoint_busy = 1;
+  probe ();
+  same = softdirty && !(flags & XMEM_CHECKPOINT_FULL)
+    && strcmp (dir, last_dir) == 0;
+  if (!same)
+    HASH_ITER (hh, last, c, ctmp) unckpt (c);
+  HASH_ITER (hh, last, c, ctmp) c->seen = 0;
+  if (softdirty)
+    pm = open ("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  jobs = (struct job *) uthash_malloc_ ((HASH_COUNT (flexmap) + 1)
+                                        * sizeof (struct job));
+  if (!jobs)
+    {
+      omp_unset_nest_lock (&lock);
+      errno = ENOMEM;
+      goto fail;
+    }
+/* Take down what to write. Only this checkpoint changes last until
+ * xmem_checkpoint_busy is cleared, so it is used without the lock below.
+ */
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    if (m->pid != xmem_pid || m->cached)
+      continue;
+    jobs[n].addr = m->addr;
+    jobs[n].length = m->length;
+    jobs[n].c = NULL;
+    jobs[n].fd = -1;
+    if (m->lazy)
+      {
+        n++;
+        continue;
+      }
+    HASH_FIND_PTR (last, &m->addr, c);
+    if (c && c->length != m->length)
+      {
+        unckpt (c);
+        c = NULL;
+      }
+    jobs[n].full = !c || pm < 0 || m->tier || m->fdirty || m->named
+      || m->shared;
+    if (!c)
+      {
+        c = (struct ckpt *) uthash_malloc_ (sizeof (struct ckpt));
+        if (!c)
+          {
+            omp_unset_nest_lock (&lock);
+            errno = ENOMEM;
+            goto fail;
+          }
+        memset (c, 0, sizeof (struct ckpt));
+        c->addr = m->addr;
+        c->length = m->length;
+        HASH_ADD_PTR (last, addr, c);
+      }
+    c->seen = 1;
+    jobs[n].c = c;
+    if (!m->tier)
+      jobs[n].fd = xmem_fd (m);
+    m->fdirty = 0;
+    n++;
+  }
+  omp_unset_nest_lock (&lock);
+
+  snprintf (path, sizeof (path), "%s/" XMEM_CHECKPOINT_MANIFEST, dir);
+  unlink (path);
+  snprintf (path, sizeof (path), "%s/" XMEM_CHECKPOINT_MANIFEST ".tmp", dir);
+  f = fopen (path, "w");
+  if (!f)
+    goto fail;
+  fprintf (f, "# xmem checkpoint: address length data\n");
+  for (i = 0; i < n; ++i)
+    {
+      c = jobs[i].c;
+      if (!c)
+        {
+/* Never touched, so all zeros. */
+          fprintf (f, "%016lx %lu z\n", (unsigned long) jobs[i].addr,
+                   (unsigned long) jobs[i].length);
+          continue;
+        }
+      snprintf (path, sizeof (path), "%s/%016lx", dir, (unsigned long) c->addr);
+      fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+      if (fd < 0)
+        goto fail;
+      if (jobs[i].full)
+        j = put_all (fd, jobs[i].fd, c);
+      else
+        j = put_dirty (fd, pm, c);
+      close (fd);
+      if (jobs[i].fd > -1)
+        close (jobs[i].fd);
+      jobs[i].fd = -1;
+      if (j < 0)
+        goto fail;
+      if (c->lost)
+        memset (c->lost, 0, (c->length + XMEM_GOVERNOR_CHUNK - 1)
+                / XMEM_GOVERNOR_CHUNK);
+      fprintf (f, "%016lx %lu f\n", (unsigned long) c->addr,
+               (unsigned long) c->length);
+    }
+/* Files of regions freed since the last checkpoint */
+  HASH_ITER (hh, last, c, ctmp)
+  {
+    if (c->seen)
+      continue;
+    snprintf (path, sizeof (path), "%s/%016lx", dir, (unsigned long) c->addr);
+    unlink (path);
+    unckpt (c);
+  }
+  if (fflush (f) != 0 || fsync (fileno (f)) < 0)
+    goto fail;
+  fclose (f);
+  f = NULL;
+  snprintf (path, sizeof (path), "%s/" XMEM_CHECKPOINT_MANIFEST ".tmp", dir);
+  snprintf (final, sizeof (final), "%s/" XMEM_CHECKPOINT_MANIFEST, dir);
+  if (rename (path, final) < 0)
+    goto fail;
+  if (softdirty)
+    clear ();
+  strcpy (last_dir, dir);
+  if (pm > -1)
+    close (pm);
+  uthash_free_ (jobs);
+  omp_set_nest_lock (&lock);
+  xmem_checkpoint_busy = 0;
+  omp_unset_nest_lock (&lock);
+  return n;
+
+fail:
+  j = errno;
+  for (i = 0; jobs && i < n; ++i)
+    if (jobs[i].fd > -1)
+      close (jobs[i].fd);
+  if (jobs)
+    uthash_free_ (jobs);
+  if (f)
+    fclose (f);
+  if (pm > -1)
+    close (pm);
+/* The next checkpoint into dir starts over. */
+  last_dir[0] = 0;
+  omp_set_nest_lock (&lock);
+  xmem_checkpoint_busy = 0;
+  omp_unset_nest_lock (&lock);
+  errno = j;
+  return -1;
+}
+
+/* A region of a checkpoint being restored */
+struct restore
+{
+  const char *dir;
+  void *addr;
+  size_t length;
+  char data;                    /* 'f' data file, 'z' zeros */
+};
+
+/* Put the region r of a checkpoint back for m: a new backing file with the
+ * checkpointed data, mapped at its old address. Called through
+ * xmem_attach_with with the lock held.
+ */
+static int
+restore (struct map *m, void *arg)
+{
+  struct restore *r = (struct restore *) arg;
+  char path[XMEM_MAX_PATH_LEN];
+  struct stat st;
+  void *p;
+  int fd = -1, j;
+
+  m->length = r->length;
+  if (xmem_mkfile (m) < 0)
+    return -1;
+  if (r->data == 'f')
+    {
+      snprintf (path, sizeof (path), "%s/%016lx", r->dir,
+                (unsigned long) r->addr);
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        goto fail;
+      if (fstat (fd, &st) < 0 || (size_t) st.st_size != r->length)
+        {
+          errno = EINVAL;
+          goto fail;
+        }
+      if (ioctl (m->fd, FICLONE, fd) < 0
+          && (ftruncate (m->fd, r->length) < 0
+              || xmem_io_copy (fd, 0, m->fd, 0, r->length) < 0))
+        goto fail;
+      close (fd);
+      fd = -1;
+    }
+  if (ftruncate (m->fd, r->length) < 0)
+    goto fail;
+  p = mmap (r->addr, r->length, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED_NOREPLACE, m->fd, 0);
+  if (p == MAP_FAILED)
+    goto fail;
+  if (p != r->addr)
+    {
+/* A kernel without MAP_FIXED_NOREPLACE took the address as a hint. */
+      munmap (p, r->length);
+      errno = EEXIST;
+      goto fail;
+    }
+  m->addr = p;
+  xmem_dropfd (m);
+  return 0;
+
+fail:
+  j = errno;
+  if (fd > -1)
+    close (fd);
+  xmem_rmfile (m);
+  errno = j;
+  return -1;
+}
+
+/* Map the regions of the checkpoint in dir back at their addresses, see the
+ * notes above. Returns the number of regions restored, or -1 with errno set
+ * if the checkpoint can't be read or a region can't be put back (the others
+ * stay restored).
+ */
+int
+xmem_restore (const char *dir)
+{
+  char path[XMEM_MAX_PATH_LEN], line[256];
+  struct restore r;
+  unsigned long addr, length;
+  FILE *f;
+  int n = 0, err = 0;
+
+  if (!dir || strlen (dir) > XMEM_MAX_PATH_LEN - 64)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  snprintf (path, sizeof (path), "%s/" XMEM_CHECKPOINT_MANIFEST, dir);
+  f = fopen (path, "r");
+  if (!f)
+    return -1;
+  r.dir = dir;
+  while (fgets (line, sizeof (line), f))
+    {
+      if (sscanf (line, "%lx %lu %c", &addr, &length, &r.data) != 3)
+        continue;
+      r.addr = (void *) addr;
+      r.length = length;
+      if (xmem_attach_with (restore, &r, 0))
+        n++;
+      else if (!err)
+        err = errno;
+    }
+  fclose (f);
+  if (err)
+    {
+      errno = err;
+      return -1;
+    }
+  return n;
+}
@@ -0,0 +1,424 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <omp.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Regions are often allocated huge and filled sparsely, or zeroed again
+ * later. A zero page that has been written takes a block on disk and a page
+ * in the page cache for as long as the region lives. Compaction finds runs
+ * of zero pages in the backing file of a region and punches them out with
+ * FALLOC_FL_PUNCH_HOLE. Reading them again yields zeros from the hole.
+ *
+ * The file is read with pread through a duplicate of its descriptor, one
+ * XMEM_COMPACT_CHUNK at a time, skipping holes with SEEK_DATA. A page written
+ * between the zero check and the punch would lose that write, so each chunk
+ * is write-protected with mprotect while it is checked and punched. A thread
+ * that writes to it takes a SIGSEGV, which our handler answers by waiting
+ * for the chunk to be unprotected and retrying the write. Other faults go to
+ * the handler installed before ours, after one retry if they are in the
+ * region compacted last. System calls that write to a protected chunk (read
+ * into it, say) fail with EFAULT instead of waiting, so where the governor
+ * runs (see governor.c) only chunks it has not seen referenced since its
+ * last sweep are compacted.
+ *
+ * Writes that go to the file past the mapping (the memcpy fast path in xmem.c
+ * and streams, see stream.c) hold xmem_compact_enter, a read lock of which
+ * each chunk takes the write lock.
+ *
+ * Compactions run one at a time. m->compact is set while one is queued or
+ * running for the region of m. free and realloc clear it with
+ * xmem_compact_cancel, which also waits for a chunk in flight, and the
+ * compaction stops at its next chunk. A region reused from the cache (see
+ * cache.c) is therefore never compacted on behalf of its previous owner.
+ *
+ * Shared and named regions may be written by other processes, and after a
+ * fork (without xmem_set_fork_cow) by the children, so they are not
+ * compacted, and nor is anything while a checkpoint runs.
+ */
+
+size_t xmem_compacted_bytes = 0;
+
+/* Return 1 if the n bytes at p (a multiple of 64) are all zero. */
+static int
+zero (const char *p, size_t n)
+{
+#ifdef __SSE2__
+  __m128i a = _mm_setzero_si128 ();
+  size_t j;
+  for (j = 0; j < n; j += 64)
+    {
+      a = _mm_or_si128 (a, _mm_loadu_si128 ((const __m128i *) (p + j)));
+      a = _mm_or_si128 (a, _mm_loadu_si128 ((const __m128i *) (p + j + 16)));
+      a = _mm_or_si128 (a, _mm_loadu_si128 ((const __m128i *) (p + j + 32)));
+      a = _mm_or_si128 (a, _mm_loadu_si128 ((const __m128i *) (p + j + 48)));
+    }
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (a, _mm_setzero_si128 ()))
+    == 0xFFFF;
+#else
+  uint64_t a = 0, w;
+  size_t j;
+  for (j = 0; j < n; j += sizeof (w))
+    {
+      memcpy (&w, p + j, sizeof (w));
+      a |= w;
+    }
+  return a == 0;
+#endif
+}
+
+/* The chunk being checked, write-protected, and its region; the bounds of
+ * the region compacted last.
+ */
+static char *volatile wp_lo, *volatile wp_hi;
+static struct map *volatile inflight;
+static char *volatile reg_lo, *volatile reg_hi;
+static __thread char *retried;
+
+static pthread_rwlock_t rw = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t crun = PTHREAD_MUTEX_INITIALIZER;   /* One at a time */
+static pthread_once_t conce = PTHREAD_ONCE_INIT;
+static struct sigaction old;
+
+/* SIGSEGV handler: wait out the protection of the chunk being checked, pass
+ * anything else on. A thread may fault on a chunk and get here after it was
+ * unprotected, so a fault in the region compacted last is retried once.
+ */
+static void
+fault (int sig, siginfo_t *si, void *ctx)
+{
+  char *a = (char *) si->si_addr;
+  if (si->si_code == SEGV_ACCERR && a >= wp_lo && a < wp_hi)
+    {
+      while (inflight && a >= wp_lo && a < wp_hi)
+        sched_yield ();
+      retried = NULL;
+      return;
+    }
+  if (si->si_code == SEGV_ACCERR && a >= reg_lo && a < reg_hi && a != retried)
+    {
+      retried = a;
+      return;
+    }
+  retried = NULL;
+  if (old.sa_flags & SA_SIGINFO)
+    old.sa_sigaction (sig, si, ctx);
+  else if (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN)
+    old.sa_handler (sig);
+  else
+/* The faulting instruction runs again and the default action is taken. */
+    signal (SIGSEGV, SIG_DFL);
+}
+
+/* No chunk may be protected across fork. */
+static void
+prepare ()
+{
+  pthread_rwlock_wrlock (&rw);
+}
+
+static void
+parent ()
+{
+  pthread_rwlock_unlock (&rw);
+}
+
+static void
+child ()
+{
+  pthread_rwlock_init (&rw, NULL);
+  pthread_mutex_init (&crun, NULL);
+}
+
+static void
+once ()
+{
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_sigaction = fault;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGSEGV, &sa, &old);
+  pthread_atfork (prepare, parent, child);
+}
+
+/* Write-protect [off, end) of the region at addr, unless it is hot. Returns
+ * 1 if it was protected, 0 to skip it, -1 if the compaction was cancelled.
+ * On 1 the chunk is in flight until unprotect.
+ */
+static int
+protect (char *addr, size_t off, size_t end)
+{
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  struct map *m;
+  int r = -1;
+  pthread_rwlock_wrlock (&rw);
+  omp_set_nest_lock (&lock);
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (m && m->compact && !xmem_checkpoint_busy)
+    {
+      r = 0;
+      if (!m->clock
+          || !(m->clock[off / XMEM_GOVERNOR_CHUNK] & XMEM_GOVERNOR_REF))
+        {
+          wp_lo = addr + off;
+          wp_hi = addr + ((end + pg - 1) & ~(pg - 1));
+          if (mprotect (wp_lo, wp_hi - wp_lo, PROT_READ) == 0)
+            {
+              inflight = m;
+              r = 1;
+            }
+        }
+    }
+  omp_unset_nest_lock (&lock);
+  if (r < 1)
+    pthread_rwlock_unlock (&rw);
+  return r;
+}
+
+static void
+unprotect ()
+{
+  mprotect (wp_lo, wp_hi - wp_lo, PROT_READ | PROT_WRITE);
+  __sync_synchronize ();
+  inflight = NULL;
+  pthread_rwlock_unlock (&rw);
+}
+
+/* Punch out the zero pages of the n bytes at off of fd, read into buf.
+ * Returns the bytes punched.
+ */
+static ssize_t
+punch (int fd, const char *buf, off_t off, size_t n)
+{
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  off_t run = -1;
+  ssize_t done = 0;
+  size_t j;
+/* A partial last page is left alone. */
+  for (j = 0; j + pg <= n; j += pg)
+    {
+      if (zero (buf + j, pg))
+        {
+          if (run < 0)
+            run = off + j;
+          continue;
+        }
+      if (run > -1
+          && fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, run,
+                        off + j - run) == 0)
+        done += off + j - run;
+      run = -1;
+    }
+  if (run > -1
+      && fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, run,
+                    off + j - run) == 0)
+    done += off + j - run;
+  return done;
+}
+
+/* Punch out the zero pages of the region at addr, backed by fd, of the given
+ * length, chunk by chunk. Returns the bytes punched or -1.
+ */
+static ssize_t
+compact (char *addr, int fd, size_t length)
+{
+  off_t off, end;
+  ssize_t got, done = 0;
+  char *buf;
+  int r;
+
+  buf = (char *) uthash_malloc_ (XMEM_COMPACT_CHUNK);
+  if (!buf)
+    return -1;
+  pthread_mutex_lock (&crun);
+  reg_lo = addr;
+  reg_hi = addr + length;
+  for (off = 0; (size_t) off < length; off = end)
+    {
+      off = lseek (fd, off, SEEK_DATA);
+      if (off < 0 || (size_t) off >= length)
+        break;
+      off &= ~((off_t) XMEM_COMPACT_CHUNK - 1);
+      end = off + XMEM_COMPACT_CHUNK;
+      if ((size_t) end > length)
+        end = length;
+      r = protect (addr, off, end);
+      if (r < 0)
+        break;
+      if (r == 0)
+        continue;
+      got = pread (fd, buf, end - off, off);
+      if (got > 0)
+        done += punch (fd, buf, off, got);
+      unprotect ();
+      if (got < end - off)
+        break;
+    }
+  wp_lo = wp_hi = NULL;
+  pthread_mutex_unlock (&crun);
+  uthash_free_ (buf);
+  return done;
+}
+
+/* Return a descriptor for the backing file of the region at addr, which may
+ * be compacted, and mark it queued, or -1. *length is set to the region
+ * length.
+ */
+static int
+region_fd (void *addr, size_t *length)
+{
+  struct map *m;
+  int fd = -1;
+  pthread_once (&conce, once);
+  omp_set_nest_lock (&lock);
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (m && m->pid == xmem_pid && !m->cached && !m->shared && !m->named
+      && (!xmem_forked || xmem_fork_cow))
+    {
+      fd = xmem_fd (m);
+      *length = m->length;
+      if (fd > -1)
+        m->compact = 1;
+    }
+  omp_unset_nest_lock (&lock);
+  return fd;
+}
+
+/* Clear the queued mark of the region at addr. */
+static void
+finish (void *addr)
+{
+  struct map *m;
+  omp_set_nest_lock (&lock);
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (m)
+    m->compact = 0;
+  omp_unset_nest_lock (&lock);
+}
+
+/* Cancel compaction of the region of m, which is about to be freed or
+ * remapped, waiting for a chunk of it in flight. Called with the lock held.
+ */
+void
+xmem_compact_cancel (struct map *m)
+{
+  if (!m->compact)
+    return;
+  m->compact = 0;
+  while (inflight == m)
+    sched_yield ();
+}
+
+/* Bracket writes to a backing file that bypass the mapping. */
+void
+xmem_compact_enter ()
+{
+  pthread_rwlock_rdlock (&rw);
+}
+
+void
+xmem_compact_leave ()
+{
+  pthread_rwlock_unlock (&rw);
+}
+
+/* Punch out the zero pages of the region at addr. Returns the bytes
+ * reclaimed, or -1 if addr is not the start of a file-backed region that
+ * may be compacted.
+ */
+ssize_t
+xmem_compact_region (void *addr)
+{
+  size_t length;
+  ssize_t n;
+  int fd = region_fd (addr, &length);
+  if (fd < 0)
+    return -1;
+  n = compact ((char *) addr, fd, length);
+  close (fd);
+  finish (addr);
+  if (n > 0)
+    __sync_fetch_and_add (&xmem_compacted_bytes, (size_t) n);
+  return n;
+}
+
+struct compact
+{
+  void *addr;
+  int fd;
+  size_t length;
+};
+
+static void
+compact_task (void *arg, size_t i)
+{
+  struct compact *c = (struct compact *) arg;
+  ssize_t n;
+  (void) i;
+  n = compact ((char *) c->addr, c->fd, c->length);
+  if (n > 0)
+    __sync_fetch_and_add (&xmem_compacted_bytes, (size_t) n);
+}
+
+static void
+compact_done (void *arg)
+{
+  struct compact *c = (struct compact *) arg;
+  close (c->fd);
+  finish (c->addr);
+  uthash_free_ (c);
+}
+
+/* Queue compaction of the region at addr on the I/O pool. Returns 0 if it
+ * was queued.
+ */
+int
+xmem_compact_async (void *addr)
+{
+  struct compact *c;
+  size_t length;
+  int fd = region_fd (addr, &length);
+  if (fd < 0)
+    return -1;
+  c = (struct compact *) uthash_malloc_ (sizeof (struct compact));
+  if (!c)
+    {
+      close (fd);
+      finish (addr);
+      return -1;
+    }
+  c->addr = addr;
+  c->fd = fd;
+  c->length = length;
+  if (xmem_pool_async (compact_task, c, 1, compact_done) < 0)
+    {
+      compact_done (c);
+      return -1;
+    }
+  return 0;
+}
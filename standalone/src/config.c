@@ -0,0 +1,466 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <omp.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Settings made through the API only take effect once the program gets to
+ * them, too late for what it allocates at startup, and a program run by the
+ * xmem wrapper script can't make them at all. The library constructor
+ * (xmem_init) therefore applies the settings of the config file named by
+ * XMEM_CONFIG, if any, and then those of XMEM_* environment variables,
+ * which win. xmem_configure applies them again, as does SIGHUP when the
+ * reload setting asks for it, so a long-running server can be retuned in
+ * place.
+ *
+ * A config file has one "key = value" per line; # starts a comment. Keys
+ * are the names below, the environment variable of a key is XMEM_ and the
+ * key in upper case (XMEM_THRESHOLD, XMEM_FORK_COW, ...). Sizes take k, m,
+ * g and t suffixes (powers of 1024). Every setting goes through the API
+ * function that sets it, which validates it; bad lines are reported on
+ * stderr and skipped.
+ *
+ * class rules place allocations by size, before the threshold and call
+ * site profiles are considered: "class = 1m-64m ram; 64m-1t lazy" keeps
+ * allocations from 1 MiB up to 64 MiB on the heap and makes larger ones
+ * lazily created files. Each class setting replaces all rules. In a config
+ * file quota.NAME sets the quota of tag NAME, quota that of the process.
+ *
+ * The SIGHUP handler only posts a semaphore; a thread started with the
+ * handler does the reload, outside of signal context. A forked child keeps
+ * its configuration but reloads only through xmem_configure.
+ */
+
+#define XMEM_CONFIG_CLASSES 16
+
+struct class
+{
+  size_t lo, hi;                /* Sizes from lo up to hi bytes */
+  int flags;                    /* XMEM_F_* placement */
+};
+
+/* A table of class rules. There are two: rules fills the one not in use and
+ * publishes it in live, see xmem_size_class.
+ */
+struct classes
+{
+  int n;
+  int readers;                  /* xmem_size_class calls reading it */
+  struct class c[XMEM_CONFIG_CLASSES];
+};
+
+static const char *keys[] = {
+  "threshold", "path", "pattern", "template", "madvise", "unlink",
+  "fork_cow", "prealloc", "enospc", "populate", "populate_max", "tier",
+  "tier_period", "io_threads", "budget", "reaper", "cache", "reserve",
+  "reserve_cap", "stripe", "stripe_chunk", "tag", "quota", "profile",
+  "profile_floor", "class", "reload", NULL
+};
+
+static const char *advices[] = { "normal", "random", "sequential",
+  "willneed", "dontneed", NULL };
+static const char *preallocs[] = { "sparse", "full", "chunk", NULL };
+static const char *enospcs[] = { "fail", "heap", "tier", NULL };
+static const char *populates[] = { "off", "sync", "parallel", "async", NULL };
+static const char *tiers[] = { "file", "compressed", NULL };
+static const char *actions[] = { "fail", "block", "spill", NULL };
+static const char *profiles[] = { "off", "record", "apply", NULL };
+static const char *bools[] = { "0", "1", "no", "yes", "false", "true", "off",
+  "on", NULL };
+
+static struct classes tables[2];
+static struct classes *live = tables;
+int xmem_nclasses;
+static sem_t hup;
+static int reloading;
+
+/* Parse a size with an optional k, m, g or t suffix. Returns 0 on success,
+ * -1 otherwise.
+ */
+static int
+size (const char *s, size_t *n)
+{
+  char *e;
+  unsigned long long j;
+  errno = 0;
+  j = strtoull (s, &e, 10);
+  if (e == s || errno || *s == '-')
+    return -1;
+  switch (tolower (*e))
+    {
+    case 't': j <<= 10;
+    case 'g': j <<= 10;
+    case 'm': j <<= 10;
+    case 'k': j <<= 10; ++e;
+    }
+  if (*e == 'b' || *e == 'B')
+    ++e;
+  *n = (size_t) j;
+  return *e ? -1 : 0;
+}
+
+static int
+integer (const char *s, int *n)
+{
+  char *e;
+  long j;
+  errno = 0;
+  j = strtol (s, &e, 10);
+  if (e == s || *e || errno || j != (int) j)
+    return -1;
+  *n = (int) j;
+  return 0;
+}
+
+/* The index of s in the NULL terminated list of names, or s as a number.
+ * Returns -1 if it is neither.
+ */
+static int
+word (const char *s, const char **names)
+{
+  int j;
+  for (j = 0; names[j]; ++j)
+    if (!strcasecmp (s, names[j]))
+      return j;
+  return integer (s, &j) < 0 || j < 0 ? -1 : j;
+}
+
+static int
+boolean (const char *s)
+{
+  int j;
+  for (j = 0; bools[j]; ++j)
+    if (!strcasecmp (s, bools[j]))
+      return j & 1;
+  return -1;
+}
+
+/* Parse "DISK RESIDENT [ACTION [TIMEOUT]]" and set the quota of tag name,
+ * or the process for NULL.
+ */
+static int
+quota (const char *name, const char *s)
+{
+  char d[64], r[64], a[64] = "fail";
+  size_t disk, resident;
+  int timeout = 0, j, n;
+  n = sscanf (s, "%63s %63s %63s %d", d, r, a, &timeout);
+  if (n < 2 || size (d, &disk) < 0 || size (r, &resident) < 0
+      || (j = word (a, actions)) < 0)
+    return -1;
+  return xmem_set_quota (name, disk, resident, j, timeout);
+}
+
+/* Parse class rules "LO-HI PLACEMENT; ..." and replace the table. */
+static int
+rules (const char *s)
+{
+  struct class c[XMEM_CONFIG_CLASSES];
+  struct classes *t;
+  char lo[64], hi[64], p[64];
+  const char *e;
+  int n = 0;
+  for (; *s; s = *e ? e + 1 : e)
+    {
+      e = strchrnul (s, ';');
+      while (isspace (*s))
+        ++s;
+      if (s == e)
+        continue;
+      if (n == XMEM_CONFIG_CLASSES
+          || sscanf (s, "%63[^- \t]-%63s %63[a-z]", lo, hi, p) != 3
+          || size (lo, &c[n].lo) < 0 || size (hi, &c[n].hi) < 0
+          || c[n].lo > c[n].hi)
+        return -1;
+      if (!strcmp (p, "file"))
+        c[n].flags = XMEM_F_FILE;
+      else if (!strcmp (p, "ram"))
+        c[n].flags = XMEM_F_RAM;
+      else if (!strcmp (p, "compressed"))
+        c[n].flags = XMEM_F_COMPRESSED;
+      else if (!strcmp (p, "lazy"))
+        c[n].flags = XMEM_F_LAZY;
+      else
+        return -1;
+      ++n;
+    }
+  omp_set_nest_lock (&lock);
+  t = live == tables ? tables + 1 : tables;
+/* Readers that took the spare table before the last swap are done soon. */
+  while (__atomic_load_n (&t->readers, __ATOMIC_SEQ_CST))
+    sched_yield ();
+  t->n = n;
+  memcpy (t->c, c, n * sizeof (struct class));
+  __atomic_store_n (&live, t, __ATOMIC_SEQ_CST);
+  __atomic_store_n (&xmem_nclasses, n, __ATOMIC_RELEASE);
+  omp_unset_nest_lock (&lock);
+  return 0;
+}
+
+static void
+handler (int sig)
+{
+  (void) sig;
+  sem_post (&hup);
+}
+
+static void *
+reloader (void *arg)
+{
+  (void) arg;
+  for (;;)
+    if (sem_wait (&hup) == 0)
+      xmem_configure (NULL);
+  return NULL;
+}
+
+/* Reload on SIGHUP from now on. */
+static int
+sighup ()
+{
+  struct sigaction sa;
+  pthread_t t;
+  int j = 0;
+  omp_set_nest_lock (&lock);
+  if (!reloading)
+    {
+      j = -1;
+      if (sem_init (&hup, 0, 0) == 0
+          && pthread_create (&t, NULL, reloader, NULL) == 0)
+        {
+          pthread_detach (t);
+          memset (&sa, 0, sizeof (sa));
+          sa.sa_handler = handler;
+          sa.sa_flags = SA_RESTART;
+          sigemptyset (&sa.sa_mask);
+          sigaction (SIGHUP, &sa, NULL);
+          reloading = 1;
+          j = 0;
+        }
+    }
+  omp_unset_nest_lock (&lock);
+  return j;
+}
+
+/* Apply the setting key = s. Returns 0 on success, -1 for a bad value and
+ * -2 for an unknown key.
+ */
+static int
+set (const char *key, const char *s)
+{
+  size_t n;
+  int j;
+  char w[16], p[XMEM_MAX_PATH_LEN];
+
+  if (strlen (s) >= XMEM_MAX_PATH_LEN)
+    return -1;
+  strcpy (p, s);
+  if (!strcmp (key, "threshold"))
+    return size (s, &n) < 0 || !n ? -1 : (xmem_set_threshold (n), 0);
+  if (!strcmp (key, "path"))
+    return xmem_set_path (p) < 0 ? -1 : 0;
+  if (!strcmp (key, "pattern"))
+    return xmem_set_pattern (p) < 0 ? -1 : 0;
+  if (!strcmp (key, "template"))
+    return xmem_set_template (p) < 0 ? -1 : 0;
+  if (!strcmp (key, "madvise"))
+    return (j = word (s, advices)) < 0 ? -1 : (xmem_madvise (j), 0);
+  if (!strcmp (key, "unlink"))
+    return (j = boolean (s)) < 0 ? -1 : (xmem_set_unlink (j), 0);
+  if (!strcmp (key, "fork_cow"))
+    return (j = boolean (s)) < 0 ? -1 : (xmem_set_fork_cow (j), 0);
+  if (!strcmp (key, "prealloc"))
+    return (j = word (s, preallocs)) < 0 || xmem_set_prealloc (j) != j
+      ? -1 : 0;
+  if (!strcmp (key, "enospc"))
+    return (j = word (s, enospcs)) < 0 || xmem_set_enospc (j) != j ? -1 : 0;
+  if (!strcmp (key, "populate"))
+    return (j = word (s, populates)) < 0
+      || xmem_set_populate (j, xmem_populate_max) != j ? -1 : 0;
+  if (!strcmp (key, "populate_max"))
+    return size (s, &n) < 0 ? -1 : (xmem_set_populate (xmem_populate, n), 0);
+  if (!strcmp (key, "tier"))
+    return (j = word (s, tiers)) < 0 || xmem_set_tier (j) != j ? -1 : 0;
+  if (!strcmp (key, "tier_period"))
+    return integer (s, &j) < 0 || j < 0 ? -1 : (xmem_tier_period (j), 0);
+  if (!strcmp (key, "io_threads"))
+    return integer (s, &j) < 0 || j < 1 ? -1 : (xmem_set_io_threads (j), 0);
+  if (!strcmp (key, "budget"))
+    return size (s, &n) < 0 ? -1 : (xmem_set_budget (n), 0);
+  if (!strcmp (key, "reaper"))
+    return size (s, &n) < 0 ? -1 : (xmem_set_reaper (n), 0);
+  if (!strcmp (key, "cache"))
+    return size (s, &n) < 0 ? -1 : (xmem_set_cache (n), 0);
+  if (!strcmp (key, "reserve"))
+    return integer (s, &j) < 0
+      || xmem_set_reserve (j, xmem_reserve_cap) != j ? -1 : 0;
+  if (!strcmp (key, "reserve_cap"))
+    return size (s, &n) < 0 ? -1
+      : (xmem_set_reserve (xmem_reserve_factor, n), 0);
+  if (!strcmp (key, "stripe"))
+    return xmem_set_stripe (s, 0) < 0 ? -1 : 0;
+  if (!strcmp (key, "stripe_chunk"))
+    return size (s, &n) < 0 || !n || xmem_set_stripe (NULL, n) < 0 ? -1 : 0;
+  if (!strcmp (key, "tag"))
+    return xmem_set_tag (*s ? s : NULL, 0) < 0 ? -1 : 0;
+  if (!strcmp (key, "quota"))
+    return quota (NULL, s) < 0 ? -1 : 0;
+  if (!strncmp (key, "quota.", 6))
+    return quota (key + 6, s) < 0 ? -1 : 0;
+  if (!strcmp (key, "profile"))
+    return sscanf (s, "%15s %4095s", w, p) < 1 || (j = word (w, profiles)) < 0
+      || xmem_profile (j, j ? p : NULL) < 0 ? -1 : 0;
+  if (!strcmp (key, "profile_floor"))
+    return size (s, &n) < 0 || !n ? -1 : (xmem_profile_floor (n), 0);
+  if (!strcmp (key, "class"))
+    return rules (s);
+  if (!strcmp (key, "reload"))
+    return !strcasecmp (s, "sighup") ? sighup () : strcasecmp (s, "off") ? -1
+      : 0;
+  return -2;
+}
+
+/* Apply a config file. Returns the number of settings applied, or -1 with
+ * errno set if the file can't be read.
+ */
+static int
+file (const char *path)
+{
+  char line[XMEM_MAX_PATH_LEN + 128], *k, *v, *e;
+  FILE *f;
+  int n = 0, no = 0, j;
+
+  f = fopen (path, "re");
+  if (!f)
+    return -1;
+  while (fgets (line, sizeof (line), f))
+    {
+      ++no;
+      if ((e = strchr (line, '#')))
+        *e = 0;
+      for (k = line; isspace (*k); ++k);
+      if (!*k)
+        continue;
+      for (e = k + strlen (k); e > k && isspace (e[-1]); --e);
+      *e = 0;
+      v = strchr (k, '=');
+      if (!v)
+        {
+          fprintf (stderr, "xmem: %s:%d: expected key = value\n", path, no);
+          continue;
+        }
+      for (e = v++; e > k && isspace (e[-1]); --e);
+      *e = 0;
+      while (isspace (*v))
+        ++v;
+      j = set (k, v);
+      if (j < 0)
+        fprintf (stderr, "xmem: %s:%d: %s %s\n", path, no,
+                 j == -2 ? "unknown setting" : "bad value for", k);
+      else
+        ++n;
+    }
+  fclose (f);
+  return n;
+}
+
+/* Apply the XMEM_* environment variables. Returns the number applied. */
+static int
+environment ()
+{
+  char name[64];
+  const char *s;
+  int n = 0, j, k;
+  for (j = 0; keys[j]; ++j)
+    {
+      strcpy (name, "XMEM_");
+      for (k = 0; keys[j][k]; ++k)
+        name[5 + k] = toupper (keys[j][k]);
+      name[5 + k] = 0;
+      s = getenv (name);
+      if (!s)
+        continue;
+      if (set (keys[j], s) < 0)
+        fprintf (stderr, "xmem: bad value for %s\n", name);
+      else
+        ++n;
+    }
+  return n;
+}
+
+/* Apply the settings of the config file path, or of the file named by
+ * XMEM_CONFIG if path is NULL, and then those of the XMEM_* environment
+ * variables. Returns the number of settings applied, or -1 with errno set if
+ * the config file can't be read, in which case nothing is applied.
+ */
+int
+xmem_configure (const char *path)
+{
+  int n = 0;
+  if (!path)
+    path = getenv ("XMEM_CONFIG");
+  if (path && *path && (n = file (path)) < 0)
+    return -1;
+  return n + environment ();
+}
+
+/* Called once by xmem_init. */
+void
+xmem_config_init ()
+{
+  const char *path = getenv ("XMEM_CONFIG");
+  if (xmem_configure (NULL) < 0)
+    fprintf (stderr, "xmem: can't read %s: %s\n", path, strerror (errno));
+}
+
+/* The XMEM_F_* placement of an allocation of n bytes by the class rules, 0
+ * if no rule applies. This runs for allocations of any size, and the lock
+ * may allocate the first time a thread takes it, so the rules are read
+ * without it. The table in live is never written while it is live: rules
+ * fills the other one and swaps them, after waiting for the readers of the
+ * other one to leave. A reader counts itself in and checks that the table
+ * it counted itself in on is still live, else rules may be filling it.
+ */
+int
+xmem_size_class (size_t n)
+{
+  struct classes *t;
+  int j, flags = 0;
+  for (;;)
+    {
+      t = __atomic_load_n (&live, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch (&t->readers, 1, __ATOMIC_SEQ_CST);
+      if (t == __atomic_load_n (&live, __ATOMIC_SEQ_CST))
+        break;
+      __atomic_sub_fetch (&t->readers, 1, __ATOMIC_SEQ_CST);
+    }
+  for (j = 0; j < t->n; ++j)
+    if (n >= t->c[j].lo && n <= t->c[j].hi)
+      {
+        flags = t->c[j].flags;
+        break;
+      }
+  __atomic_sub_fetch (&t->readers, 1, __ATOMIC_SEQ_CST);
+  return flags;
+}
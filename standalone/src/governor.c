@@ -0,0 +1,408 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <omp.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Every file-backed region is MAP_SHARED, so its pages live in the page
+ * cache and the kernel decides when to drop them. In a container they count
+ * against the memory cgroup all the same. The governor keeps the resident
+ * size of all regions together under xmem_budget bytes.
+ *
+ * Every XMEM_GOVERNOR_INTERVAL milliseconds a background thread samples the
+ * residency of each region in XMEM_GOVERNOR_CHUNK sized chunks with mincore.
+ * A chunk whose resident page count went up since the last sample is marked
+ * referenced. When the total is over budget, a CLOCK hand sweeps the chunks
+ * of all regions: referenced chunks get their mark cleared, unreferenced
+ * resident chunks are paged out with MADV_PAGEOUT (or MADV_COLD on older
+ * kernels) and dropped from the page cache with POSIX_FADV_DONTNEED, which
+ * also starts writeback of their dirty pages. The sweep stops once the total
+ * is below XMEM_GOVERNOR_LOW percent of the budget.
+ *
+ * Neither mincore nor paging out holds the lock. The regions are taken down
+ * under it, sampled without it, and looked up again under it before their
+ * chunk state is updated and the sweep chooses what to page out. Each chosen
+ * chunk's region is looked up once more just before it is paged out.
+ *
+ * Thread tags with a resident budget of their own (xmem_set_quota, see
+ * quota.c) are sampled along with the rest, and a tag over its budget gets
+ * a sweep of the same hand over its own regions only.
+ *
+ * Per chunk state is one unsigned short in m->clock: the resident page count
+ * and the reference bit XMEM_GOVERNOR_REF.
+ *
+ * Compressed tier regions manage their own residency and regions inherited
+ * from a parent process are left alone. Nothing is paged out while a
+ * checkpoint runs, see checkpoint.c.
+ */
+
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+/* A region to sample, taken down under the lock, and the resident page
+ * count of each of its chunks, filled in without it.
+ */
+struct probe
+{
+  void *addr;
+  size_t length;
+  unsigned short *count;        /* UNSAMPLED where mincore failed */
+};
+
+/* A chunk to page out, chosen under the lock */
+struct victim
+{
+  void *addr;                   /* Region address and length */
+  size_t length;
+  size_t off;                   /* Chunk offset and length */
+  size_t len;
+  int fd;                       /* Duplicate of the backing file, or -1 */
+};
+
+#define UNSAMPLED ((unsigned short) -1)
+
+static pthread_mutex_t glock = PTHREAD_MUTEX_INITIALIZER;
+static int running;
+static void *hand_addr;         /* CLOCK hand: region and chunk */
+static size_t hand_chunk;
+
+/* Used by the governor thread only, and kept from one round to the next */
+static struct probe *probes;
+static size_t nprobes, probecap;
+static unsigned short *counts;
+static size_t countcap;
+static struct victim *victims;
+static size_t nvictims, victimcap;
+
+static size_t
+nchunks (struct map *m)
+{
+  return (m->length + XMEM_GOVERNOR_CHUNK - 1) / XMEM_GOVERNOR_CHUNK;
+}
+
+static int
+governed (struct map *m)
+{
+  return XMEM_FILE (m) && !m->tier && m->pid == xmem_pid;
+}
+
+/* Make room for n items of the given size in *p, which holds *cap. The old
+ * items are not kept. Returns 0 on success, -1 otherwise.
+ */
+static int
+room (void **p, size_t *cap, size_t n, size_t size)
+{
+  if (n <= *cap)
+    return 0;
+  if (*p)
+    uthash_free_ (*p);
+  *cap = 0;
+  *p = uthash_malloc_ (2 * n * size);
+  if (!*p)
+    return -1;
+  *cap = 2 * n;
+  return 0;
+}
+
+/* Take down the regions to sample, and make room for as many victims as
+ * they have chunks. Called with the lock held. Returns 0 on success, -1
+ * otherwise.
+ */
+static int
+take ()
+{
+  struct map *m, *tmp;
+  size_t n = 0, chunks = 0;
+
+  HASH_ITER (hh, flexmap, m, tmp)
+    if (governed (m))
+      {
+        n++;
+        chunks += nchunks (m);
+      }
+  if (room ((void **) &probes, &probecap, n, sizeof (struct probe)) < 0
+      || room ((void **) &counts, &countcap, chunks, sizeof (unsigned short))
+      < 0
+      || room ((void **) &victims, &victimcap, chunks, sizeof (struct victim))
+      < 0)
+    return -1;
+  nprobes = 0;
+  chunks = 0;
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    if (!governed (m))
+      continue;
+    probes[nprobes].addr = m->addr;
+    probes[nprobes].length = m->length;
+    probes[nprobes].count = counts + chunks;
+    chunks += nchunks (m);
+    nprobes++;
+  }
+  return 0;
+}
+
+/* Count the resident pages of each chunk of the regions taken down, with
+ * mincore. Runs without the lock: a region freed meanwhile fails mincore
+ * or, if its address was reused, is told apart by sample.
+ */
+static void
+measure ()
+{
+  unsigned char vec[XMEM_GOVERNOR_CHUNK / 4096];
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  size_t i, c, n, len, j, k;
+  struct probe *p;
+
+  for (i = 0; i < nprobes; ++i)
+    {
+      p = &probes[i];
+      n = (p->length + XMEM_GOVERNOR_CHUNK - 1) / XMEM_GOVERNOR_CHUNK;
+      for (c = 0; c < n; ++c)
+        {
+          len = p->length - c * XMEM_GOVERNOR_CHUNK;
+          if (len > XMEM_GOVERNOR_CHUNK)
+            len = XMEM_GOVERNOR_CHUNK;
+          p->count[c] = UNSAMPLED;
+          if (mincore ((char *) p->addr + c * XMEM_GOVERNOR_CHUNK, len, vec)
+              < 0)
+            continue;
+          for (k = 0, j = 0; j < (len + pg - 1) / pg; ++j)
+            k += vec[j] & 1;
+          p->count[c] = (unsigned short) k;
+        }
+    }
+}
+
+/* Update the chunk state of the regions measured that are still there,
+ * looking each one up again. Called with the lock held. Returns the
+ * resident bytes.
+ */
+static size_t
+sample ()
+{
+  struct map *m;
+  struct probe *p;
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  size_t i, c, n, total = 0;
+  unsigned short old, k;
+
+  xmem_quota_sample (NULL, 0, 1);
+  for (i = 0; i < nprobes; ++i)
+    {
+      p = &probes[i];
+      HASH_FIND_PTR (flexmap, &p->addr, m);
+      if (!m || m->length != p->length || !governed (m))
+        continue;
+      n = nchunks (m);
+      if (!m->clock)
+        {
+          m->clock = (unsigned short *) uthash_malloc_ (n * sizeof (unsigned short));
+          if (!m->clock)
+            continue;
+          memset (m->clock, 0, n * sizeof (unsigned short));
+        }
+      for (c = 0; c < n; ++c)
+        {
+          k = p->count[c];
+          if (k == UNSAMPLED)
+            continue;
+          old = m->clock[c];
+          m->clock[c] = k;
+          if (k > (old & ~XMEM_GOVERNOR_REF) || (old & XMEM_GOVERNOR_REF))
+            m->clock[c] |= XMEM_GOVERNOR_REF;
+          total += k * pg;
+          xmem_quota_sample (m, k * pg, 0);
+        }
+    }
+  return total;
+}
+
+/* Choose one chunk to page out after the lock is released, see evict.
+ * Returns the bytes it holds.
+ */
+static size_t
+drop (struct map *m, size_t c)
+{
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  size_t k = m->clock[c] & ~XMEM_GOVERNOR_REF;
+  struct victim *v;
+  if (nvictims == victimcap)
+    return 0;
+  v = &victims[nvictims++];
+  v->addr = m->addr;
+  v->length = m->length;
+  v->off = c * XMEM_GOVERNOR_CHUNK;
+  v->len = m->length - v->off;
+  if (v->len > XMEM_GOVERNOR_CHUNK)
+    v->len = XMEM_GOVERNOR_CHUNK;
+/* The chunks of a region come in a row; only the first opens the file. */
+  if (nvictims > 1 && v[-1].addr == m->addr && v[-1].fd > -1)
+    v->fd = fcntl (v[-1].fd, F_DUPFD_CLOEXEC, 0);
+  else
+    v->fd = xmem_fd (m);
+  xmem_checkpoint_evict (m, v->off, v->len);
+  m->clock[c] = 0;
+  return k * pg;
+}
+
+/* Page out the chunks chosen by drop, without the lock. A chunk whose
+ * region was freed in the meantime is skipped.
+ */
+static void
+evict ()
+{
+  struct victim *v;
+  struct map *m;
+  size_t i;
+  int live;
+
+  for (i = 0; i < nvictims; ++i)
+    {
+      v = &victims[i];
+      omp_set_nest_lock (&lock);
+      HASH_FIND_PTR (flexmap, &v->addr, m);
+      live = m && m->length == v->length && governed (m);
+      omp_unset_nest_lock (&lock);
+      if (live && madvise ((char *) v->addr + v->off, v->len, MADV_PAGEOUT) < 0)
+        madvise ((char *) v->addr + v->off, v->len, MADV_COLD);
+      if (v->fd > -1)
+        {
+          if (live)
+            posix_fadvise (v->fd, v->off, v->len, POSIX_FADV_DONTNEED);
+          close (v->fd);
+        }
+    }
+  nvictims = 0;
+}
+
+/* Advance the CLOCK hand until total is below the low watermark or the hand
+ * went all the way around twice, over the regions charged to the tag q only
+ * unless q is NULL. Called with the lock held. Returns the resident bytes
+ * left.
+ */
+static size_t
+sweep (size_t total, size_t budget, struct quota *q)
+{
+  size_t low = budget / 100 * XMEM_GOVERNOR_LOW;
+  size_t steps = 0, all = 0, c;
+  struct map *m, *tmp;
+
+  HASH_ITER (hh, flexmap, m, tmp)
+    if (governed (m) && m->clock && (!q || m->quota == q))
+      all += nchunks (m);
+  HASH_FIND_PTR (flexmap, &hand_addr, m);
+  if (!m)
+    {
+      m = flexmap;
+      hand_chunk = 0;
+    }
+  while (m && total > low && steps < 2 * all)
+    {
+      if (governed (m) && m->clock && (!q || m->quota == q))
+        for (c = hand_chunk; c < nchunks (m) && total > low; ++c, ++steps)
+          {
+            if (m->clock[c] & XMEM_GOVERNOR_REF)
+              m->clock[c] &= ~XMEM_GOVERNOR_REF;
+            else if (m->clock[c])
+              total -= drop (m, c);
+            hand_chunk = c + 1;
+          }
+      if (total <= low)
+        break;
+      m = (struct map *) m->hh.next;
+      if (!m)
+        m = flexmap;
+      hand_chunk = 0;
+    }
+  hand_addr = m ? m->addr : NULL;
+  return total;
+}
+
+static void *
+governor (void *arg)
+{
+  struct timespec t;
+  size_t total, budget, rss;
+  struct quota *q;
+  int ok;
+  (void) arg;
+  t.tv_sec = XMEM_GOVERNOR_INTERVAL / 1000;
+  t.tv_nsec = (XMEM_GOVERNOR_INTERVAL % 1000) * 1000000L;
+  for (;;)
+    {
+      nanosleep (&t, NULL);
+      budget = xmem_budget;
+      if (!budget && !xmem_quota_governed)
+        continue;
+      omp_set_nest_lock (&lock);
+      ok = take () == 0;
+      omp_unset_nest_lock (&lock);
+      if (!ok)
+        continue;
+      measure ();
+      omp_set_nest_lock (&lock);
+      total = sample ();
+      if (budget && total > budget && !xmem_checkpoint_busy)
+        total = sweep (total, budget, NULL);
+      for (q = NULL; !xmem_checkpoint_busy
+           && (q = xmem_quota_over (q, &rss, &budget));)
+        sweep (rss, budget, q);
+      xmem_resident_bytes = total;
+      omp_unset_nest_lock (&lock);
+      evict ();
+    }
+  return NULL;
+}
+
+static void
+child ()
+{
+  pthread_mutex_init (&glock, NULL);
+  running = 0;
+}
+
+/* Start the governor thread if there is a budget, the process's or a tag's,
+ * and it isn't running yet, for instance in a child process after fork.
+ */
+void
+xmem_governor_start ()
+{
+  pthread_t t;
+  static int registered;
+  if ((!xmem_budget && !xmem_quota_governed) || running)
+    return;
+  pthread_mutex_lock (&glock);
+  if (!registered)
+    {
+      pthread_atfork (NULL, NULL, child);
+      registered = 1;
+    }
+  if (!running && pthread_create (&t, NULL, governor, NULL) == 0)
+    {
+      pthread_detach (t);
+      running = 1;
+    }
+  pthread_mutex_unlock (&glock);
+}
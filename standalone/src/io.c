@@ -0,0 +1,683 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <omp.h>
+#include <linux/io_uring.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * The bulk I/O engine moves data between backing files in XMEM_IO_BLOCK
+ * sized requests, keeping up to XMEM_IO_DEPTH requests in flight. It serves
+ * the memcpy fast path, xmem_prefetch, xmem_flush and file preallocation.
+ *
+ * When the kernel allows it, requests go through a single io_uring shared by
+ * the whole library, using registered buffers and a registered (fixed) file
+ * table. A copy is a READ_FIXED linked to a WRITE_FIXED of the same buffer,
+ * so the data never visit user space between the two. Blocks whose requests
+ * fail or come up short are redone synchronously with pread/pwrite.
+ *
+ * Without io_uring (old kernels, seccomp filters in containers) the same
+ * operations are split into blocks that run on a small persistent thread
+ * pool, which later code reuses for other parallel work through
+ * xmem_pool_run and xmem_pool_async.
+ *
+ * The io_uring is driven under its own mutex by whichever thread calls into
+ * the engine. None of this code takes the global lock.
+ */
+
+#define OP_COPY 0
+#define OP_READ 1
+#define OP_SYNC 2
+
+/* Thread pool jobs. A job runs fn(arg, i) for i in [0, n). */
+struct job
+{
+  void (*fn) (void *, size_t);
+  void *arg;
+  void (*fin) (void *);         /* Called with arg when an async job is done */
+  size_t n, next, done;
+  int async;
+  struct job *link;
+};
+
+static pthread_mutex_t plock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pdone = PTHREAD_COND_INITIALIZER;
+static struct job *jobs, *jobs_tail;
+static int nworkers;
+static __thread char *tbuf;     /* Per-thread XMEM_IO_BLOCK bounce buffer */
+
+/* io_uring state */
+struct ring
+{
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  char *bufs;                   /* XMEM_IO_DEPTH registered buffers */
+};
+
+/* One in-flight block */
+struct slot
+{
+  off_t soff, doff;
+  size_t len;
+  int pending;                  /* Completions still expected */
+  int failed;
+};
+
+static pthread_mutex_t rlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ionce = PTHREAD_ONCE_INIT;
+static struct ring ring = { -1 };
+static int ring_state;          /* 0 untried, 1 up, -1 unavailable */
+
+/* A child must neither share the parent's ring nor wait for pool workers
+ * that only exist in the parent. Both are started afresh on first use.
+ */
+static void
+child ()
+{
+  pthread_mutex_init (&plock, NULL);
+  pthread_mutex_init (&rlock, NULL);
+  pthread_cond_init (&pwork, NULL);
+  pthread_cond_init (&pdone, NULL);
+  jobs = jobs_tail = NULL;
+  nworkers = 0;
+  if (ring.fd > -1)
+    close (ring.fd);
+  ring.fd = -1;
+  ring_state = 0;
+}
+
+static void
+once ()
+{
+  pthread_atfork (NULL, NULL, child);
+}
+
+static char *
+bounce ()
+{
+  if (!tbuf)
+    {
+      tbuf = mmap (NULL, XMEM_IO_BLOCK, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (tbuf == MAP_FAILED)
+        tbuf = NULL;
+    }
+  return tbuf;
+}
+
+/* Synchronous block copy, used by the thread pool and to redo failed ring
+ * requests. Returns 0 on success.
+ */
+static int
+copy_block (int src, off_t soff, int dst, off_t doff, size_t n, char *buf)
+{
+  ssize_t s;
+  while (n > 0)
+    {
+      s = pread (src, buf, n < XMEM_IO_BLOCK ? n : XMEM_IO_BLOCK, soff);
+      if (s <= 0 || pwrite (dst, buf, s, doff) != s)
+        return -1;
+      soff += s;
+      doff += s;
+      n -= s;
+    }
+  return 0;
+}
+
+
+/* The thread pool */
+
+static void
+finish (struct job *j)
+{
+  j->done++;
+  if (j->done < j->n)
+    return;
+  if (j->async)
+    {
+      if (j->fin)
+        j->fin (j->arg);
+      uthash_free_ (j);
+    }
+  else
+    pthread_cond_broadcast (&pdone);
+}
+
+/* Take the next task off the queue. Called with plock held. */
+static struct job *
+take (size_t *i)
+{
+  struct job *j = jobs;
+  if (!j)
+    return NULL;
+  *i = j->next++;
+  if (j->next == j->n)
+    {
+      jobs = j->link;
+      if (!jobs)
+        jobs_tail = NULL;
+    }
+  return j;
+}
+
+static void *
+worker (void *arg)
+{
+  struct job *j;
+  size_t i;
+  (void) arg;
+  pthread_mutex_lock (&plock);
+  for (;;)
+    {
+      while (!(j = take (&i)))
+        pthread_cond_wait (&pwork, &plock);
+      pthread_mutex_unlock (&plock);
+      j->fn (j->arg, i);
+      pthread_mutex_lock (&plock);
+      finish (j);
+    }
+  return NULL;
+}
+
+/* Start the pool workers. Called with plock held. */
+static void
+pool_start ()
+{
+  pthread_t t;
+  int n;
+  pthread_once (&ionce, once);
+  if (nworkers)
+    return;
+  n = xmem_io_threads;
+  if (n < 1)
+    n = 1;
+  while (nworkers < n && pthread_create (&t, NULL, worker, NULL) == 0)
+    {
+      pthread_detach (t);
+      nworkers++;
+    }
+}
+
+static void
+enqueue (struct job *j)
+{
+  j->link = NULL;
+  if (jobs_tail)
+    jobs_tail->link = j;
+  else
+    jobs = j;
+  jobs_tail = j;
+  pthread_cond_broadcast (&pwork);
+}
+
+/* Run fn(arg, i) for i in [0, n) on the pool and wait for all of them. The
+ * calling thread takes part, so this is safe to call from a pool task.
+ */
+void
+xmem_pool_run (void (*fn) (void *, size_t), void *arg, size_t n)
+{
+  struct job job, *j;
+  size_t i;
+  if (n == 0)
+    return;
+  memset (&job, 0, sizeof (job));
+  job.fn = fn;
+  job.arg = arg;
+  job.n = n;
+  pthread_mutex_lock (&plock);
+  pool_start ();
+  enqueue (&job);
+/* Help with our own job (and whatever is queued ahead of it) until every
+ * task of ours has been handed out.
+ */
+  while (job.next < job.n && (j = take (&i)))
+    {
+      pthread_mutex_unlock (&plock);
+      j->fn (j->arg, i);
+      pthread_mutex_lock (&plock);
+      finish (j);
+    }
+  while (job.done < job.n)
+    pthread_cond_wait (&pdone, &plock);
+  pthread_mutex_unlock (&plock);
+}
+
+/* Queue fn(arg, i) for i in [0, n) on the pool without waiting. fin(arg), if
+ * not NULL, is called once all tasks are done. Returns 0 on success.
+ */
+int
+xmem_pool_async (void (*fn) (void *, size_t), void *arg, size_t n,
+                 void (*fin) (void *))
+{
+  struct job *j;
+  if (n == 0)
+    return 0;
+  j = (struct job *) uthash_malloc_ (sizeof (struct job));
+  if (!j)
+    return -1;
+  memset (j, 0, sizeof (struct job));
+  j->fn = fn;
+  j->arg = arg;
+  j->fin = fin;
+  j->n = n;
+  j->async = 1;
+  pthread_mutex_lock (&plock);
+  pool_start ();
+  enqueue (j);
+  pthread_mutex_unlock (&plock);
+  return 0;
+}
+
+
+/* The io_uring */
+
+/* Set up the ring, its registered buffers and a two-entry fixed file table.
+ * Called with rlock held. Returns 0 on success.
+ */
+static int
+ring_start ()
+{
+  struct io_uring_params p;
+  struct iovec iov[XMEM_IO_DEPTH];
+  int fds[2] = { -1, -1 };
+  char *sq, *cq;
+  int j;
+
+  pthread_once (&ionce, once);
+  if (ring_state)
+    return ring_state > 0 ? 0 : -1;
+  ring_state = -1;
+  memset (&p, 0, sizeof (p));
+  ring.fd = syscall (__NR_io_uring_setup, XMEM_IO_DEPTH, &p);
+  if (ring.fd < 0)
+    return -1;
+  sq = mmap (NULL, p.sq_off.array + p.sq_entries * sizeof (unsigned),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+             IORING_OFF_SQ_RING);
+  cq = mmap (NULL, p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+             IORING_OFF_CQ_RING);
+  ring.sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                    IORING_OFF_SQES);
+  ring.bufs = mmap (NULL, (size_t) XMEM_IO_DEPTH * XMEM_IO_BLOCK,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED
+      || ring.bufs == MAP_FAILED)
+    goto fail;
+  ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  for (j = 0; j < XMEM_IO_DEPTH; ++j)
+    {
+      iov[j].iov_base = ring.bufs + (size_t) j * XMEM_IO_BLOCK;
+      iov[j].iov_len = XMEM_IO_BLOCK;
+    }
+  if (syscall (__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+               iov, XMEM_IO_DEPTH) < 0)
+    goto fail;
+  if (syscall (__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES,
+               fds, 2) < 0)
+    goto fail;
+  ring_state = 1;
+  return 0;
+fail:
+  close (ring.fd);
+  ring.fd = -1;
+  return -1;
+}
+
+static struct io_uring_sqe *
+sqe_get ()
+{
+  unsigned tail = *ring.sq_tail;
+  unsigned i = tail & *ring.sq_mask;
+  struct io_uring_sqe *e = &ring.sqes[i];
+  memset (e, 0, sizeof (*e));
+  ring.sq_array[i] = i;
+  __atomic_store_n (ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return e;
+}
+
+/* Take back the requests the kernel hasn't consumed from the submission
+ * queue after io_uring_enter failed, which consumes none. Returns the number
+ * of slots that are left with nothing in flight.
+ */
+static int
+unsubmit (struct slot *slots)
+{
+  unsigned head = __atomic_load_n (ring.sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring.sq_tail;
+  int n = 0;
+  for (; tail != head; --tail)
+    if (--slots[ring.sqes[(tail - 1) & *ring.sq_mask].user_data].pending == 0)
+      n++;
+  __atomic_store_n (ring.sq_tail, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* Give up on the ring when it can't even be waited on. Closing it cancels
+ * what is still in flight; the buffers stay mapped for requests the kernel
+ * finishes anyway. The engine falls back to the pool from then on. Called
+ * with rlock held.
+ */
+static void
+ring_stop ()
+{
+  close (ring.fd);
+  ring.fd = -1;
+  ring_state = -1;
+}
+
+/* Run one engine operation on the ring over n bytes in XMEM_IO_BLOCK
+ * requests. Fixed file 0 is the source (or the only file), fixed file 1 the
+ * destination of a copy. Called with rlock held. Returns 0 on success.
+ */
+static int
+ring_run (int op, int src, off_t soff, int dst, off_t doff, size_t n)
+{
+  struct slot slots[XMEM_IO_DEPTH];
+  struct io_uring_sqe *e;
+  struct io_uring_cqe *c;
+  int fds[2];
+  unsigned head, tail;
+  int nslots, busy = 0, err = 0, broken = 0, j, k;
+  size_t done = 0, len;
+
+  fds[0] = src;
+  fds[1] = op == OP_COPY ? dst : -1;
+  {
+    struct io_uring_files_update up;
+    memset (&up, 0, sizeof (up));
+    up.offset = 0;
+    up.fds = (unsigned long) fds;
+    if (syscall (__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES_UPDATE,
+                 &up, 2) < 0)
+      return -1;
+  }
+  nslots = op == OP_COPY ? XMEM_IO_DEPTH / 2 : XMEM_IO_DEPTH;
+  for (j = 0; j < nslots; ++j)
+    slots[j].pending = 0;
+
+  while ((done < n && !broken) || busy)
+    {
+/* Fill free slots */
+      for (j = 0; j < nslots && done < n && !broken; ++j)
+        {
+          if (slots[j].pending)
+            continue;
+          len = n - done < XMEM_IO_BLOCK ? n - done : XMEM_IO_BLOCK;
+          slots[j].soff = soff + done;
+          slots[j].doff = doff + done;
+          slots[j].len = len;
+          slots[j].failed = 0;
+          e = sqe_get ();
+          e->fd = 0;
+          e->flags = IOSQE_FIXED_FILE;
+          e->off = slots[j].soff;
+          e->len = len;
+          e->user_data = j;
+          if (op == OP_SYNC)
+            {
+              e->opcode = IORING_OP_SYNC_FILE_RANGE;
+              e->sync_range_flags = SYNC_FILE_RANGE_WAIT_BEFORE
+                | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+            }
+          else
+            {
+              e->opcode = IORING_OP_READ_FIXED;
+              e->addr = (unsigned long) (ring.bufs + (size_t) j * XMEM_IO_BLOCK);
+              e->buf_index = j;
+            }
+          slots[j].pending = 1;
+          if (op == OP_COPY)
+            {
+              e->flags |= IOSQE_IO_LINK;
+              e = sqe_get ();
+              e->opcode = IORING_OP_WRITE_FIXED;
+              e->fd = 1;
+              e->flags = IOSQE_FIXED_FILE;
+              e->off = slots[j].doff;
+              e->len = len;
+              e->addr = (unsigned long) (ring.bufs + (size_t) j * XMEM_IO_BLOCK);
+              e->buf_index = j;
+              e->user_data = j;
+              slots[j].pending = 2;
+            }
+          busy++;
+          done += len;
+        }
+/* Requests a transient failure left in the queue go in with the new ones. */
+      if (syscall (__NR_io_uring_enter, ring.fd,
+                   *ring.sq_tail - __atomic_load_n (ring.sq_head,
+                                                    __ATOMIC_ACQUIRE), 1,
+                   IORING_ENTER_GETEVENTS, NULL, 0) < 0
+          && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+/* No new requests after a failure, but the ones in flight use our buffers
+ * and fixed files, so they are waited for before returning.
+ */
+          if (broken)
+            {
+              ring_stop ();
+              return -1;
+            }
+          broken = 1;
+          busy -= unsubmit (slots);
+        }
+/* Reap completions */
+      head = *ring.cq_head;
+      tail = __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head)
+        {
+          c = &ring.cqes[head & *ring.cq_mask];
+          k = (int) c->user_data;
+          if (c->res < 0 || (op != OP_SYNC && (size_t) c->res != slots[k].len))
+            slots[k].failed = 1;
+          if (--slots[k].pending > 0)
+            continue;
+          busy--;
+          if (!slots[k].failed)
+            continue;
+          if (op == OP_COPY)
+            err |= copy_block (src, slots[k].soff, dst, slots[k].doff,
+                               slots[k].len,
+                               ring.bufs + (size_t) k * XMEM_IO_BLOCK);
+          else if (op == OP_SYNC)
+            err |= sync_file_range (src, slots[k].soff, slots[k].len,
+                                    SYNC_FILE_RANGE_WAIT_BEFORE
+                                    | SYNC_FILE_RANGE_WRITE
+                                    | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+      __atomic_store_n (ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+  return err || broken ? -1 : 0;
+}
+
+
+/* Thread pool fallbacks */
+
+struct op
+{
+  int op, src, dst;
+  off_t soff, doff;
+  size_t n;
+  int err;
+};
+
+static void
+op_block (void *arg, size_t i)
+{
+  struct op *o = (struct op *) arg;
+  off_t off = (off_t) i * XMEM_IO_BLOCK;
+  size_t len = o->n - off < XMEM_IO_BLOCK ? o->n - off : XMEM_IO_BLOCK;
+  char *buf;
+  int j = 0;
+
+  if (o->op == OP_COPY)
+    j = (buf = bounce ()) ? copy_block (o->src, o->soff + off, o->dst,
+                                        o->doff + off, len, buf) : -1;
+  else if (o->op == OP_READ)
+    j = readahead (o->src, o->soff + off, len);
+  else
+    j = sync_file_range (o->src, o->soff + off, len,
+                         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                         | SYNC_FILE_RANGE_WAIT_AFTER);
+  if (j < 0)
+    o->err = 1;
+}
+
+static int
+run (int op, int src, off_t soff, int dst, off_t doff, size_t n)
+{
+  struct op o;
+  int j;
+  pthread_mutex_lock (&rlock);
+  if (ring_start () == 0)
+    {
+      j = ring_run (op, src, soff, dst, doff, n);
+      pthread_mutex_unlock (&rlock);
+      return j;
+    }
+  pthread_mutex_unlock (&rlock);
+  o.op = op;
+  o.src = src;
+  o.dst = dst;
+  o.soff = soff;
+  o.doff = doff;
+  o.n = n;
+  o.err = 0;
+  xmem_pool_run (op_block, &o, (n + XMEM_IO_BLOCK - 1) / XMEM_IO_BLOCK);
+  return o.err ? -1 : 0;
+}
+
+/* Copy n bytes from src at soff to dst at doff. Returns 0 on success. */
+int
+xmem_io_copy (int src, off_t soff, int dst, off_t doff, size_t n)
+{
+  return run (OP_COPY, src, soff, dst, doff, n);
+}
+
+/* Write back dirty pages of fd in [off, off + n) and wait for them. */
+int
+xmem_io_flush (int fd, off_t off, size_t n)
+{
+  return run (OP_SYNC, fd, off, -1, 0, n);
+}
+
+static void
+prefetch (void *arg, size_t i)
+{
+  struct op *o = (struct op *) arg;
+  (void) i;
+  run (OP_READ, o->src, o->soff, -1, 0, o->n);
+}
+
+static void
+op_done (void *arg)
+{
+  struct op *o = (struct op *) arg;
+  close (o->src);
+  uthash_free_ (o);
+}
+
+/* Read [off, off + n) of fd into the page cache in the background. The
+ * descriptor is duplicated, so the caller may close fd right away. Returns 0
+ * if the prefetch was queued.
+ */
+int
+xmem_io_prefetch (int fd, off_t off, size_t n)
+{
+  struct op *o = (struct op *) uthash_malloc_ (sizeof (struct op));
+  if (!o)
+    return -1;
+  memset (o, 0, sizeof (struct op));
+  o->src = dup (fd);
+  o->soff = off;
+  o->n = n;
+  if (o->src < 0 || xmem_pool_async (prefetch, o, 1, op_done) < 0)
+    {
+      if (o->src > -1)
+        close (o->src);
+      uthash_free_ (o);
+      return -1;
+    }
+  return 0;
+}
+
+static void
+reserve (void *arg, size_t i)
+{
+  struct op *o = (struct op *) arg;
+  off_t off;
+  size_t len;
+  (void) i;
+  for (off = 0; (size_t) off < o->n; off += XMEM_PREALLOC_CHUNK_SIZE)
+    {
+      len = o->n - off < XMEM_PREALLOC_CHUNK_SIZE ? o->n - off
+        : XMEM_PREALLOC_CHUNK_SIZE;
+      if (fallocate (o->src, FALLOC_FL_KEEP_SIZE, o->soff + off, len) < 0)
+        break;
+    }
+}
+
+/* Allocate the blocks of [off, off + n) of fd: the first sync bytes right
+ * away, the rest in the background on the pool, XMEM_PREALLOC_CHUNK_SIZE
+ * bytes at a time and in order so that the extents stay contiguous. The file
+ * size is left alone. Returns 0 on success (or when the file system can't
+ * preallocate), -1 with errno set when the synchronous part fails, notably
+ * with ENOSPC.
+ */
+int
+xmem_io_reserve (int fd, off_t off, size_t n, size_t sync)
+{
+  struct op *o;
+  if (sync > n)
+    sync = n;
+  if (sync > 0 && fallocate (fd, FALLOC_FL_KEEP_SIZE, off, sync) < 0)
+    return errno == EOPNOTSUPP || errno == ENOSYS ? 0 : -1;
+  if (sync == n)
+    return 0;
+  o = (struct op *) uthash_malloc_ (sizeof (struct op));
+  if (!o)
+    return 0;
+  memset (o, 0, sizeof (struct op));
+  o->src = dup (fd);
+  o->soff = off + sync;
+  o->n = n - sync;
+  if (o->src < 0 || xmem_pool_async (reserve, o, 1, op_done) < 0)
+    {
+      if (o->src > -1)
+        close (o->src);
+      uthash_free_ (o);
+    }
+  return 0;
+}
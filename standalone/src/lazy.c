@@ -0,0 +1,315 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <omp.h>
+#include <linux/userfaultfd.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * A lazy region (xmem_malloc_ex with XMEM_F_LAZY) reserves its address
+ * range right away but only creates its backing file when the region is
+ * first touched, so that allocations that may never be used cost nothing.
+ *
+ * The range starts out as anonymous memory registered with a userfaultfd
+ * (missing pages). On the first fault the handler thread creates the
+ * backing file, maps it over the whole range with MAP_FIXED, which also
+ * drops the registration, and wakes the faulting thread, whose fault is
+ * then retried against the file. If the file can't be created the range is
+ * unregistered instead and the region stays in anonymous memory.
+ *
+ * The handler takes the global lock and then llock, in the same order as
+ * everyone else, so the region's m->fd and m->path change only under the
+ * global lock that their readers (memcpy, xmem_lookup, xmem_flush and the
+ * like) hold. Nothing in the library touches region memory with the global
+ * lock held, so a thread faulting on a lazy region never holds it while it
+ * waits for the handler. The file is made from the file name template and
+ * xmem_unlinked setting as they were when the region was reserved.
+ * xmem_lazy_settle creates the file right away for code that needs it, such
+ * as realloc.
+ *
+ * A child process doesn't inherit the registration (there is no
+ * UFFD_FEATURE_EVENT_FORK here), so a lazy region the parent never touched
+ * is ordinary private anonymous memory in the child.
+ */
+
+struct lazy
+{
+  struct map *m;
+  int advice;
+  int huge;
+  char *fname;                  /* xmem_fname_template when reserved */
+  int unlinked;                 /* xmem_unlinked when reserved */
+  struct lazy *next;
+};
+
+static pthread_mutex_t llock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t lonce = PTHREAD_ONCE_INIT;
+static struct lazy *regions;
+static int uffd = -1;
+
+static struct lazy *
+find (unsigned long a)
+{
+  struct lazy *l;
+  for (l = regions; l; l = l->next)
+    if (a >= (unsigned long) l->m->addr
+        && a < (unsigned long) l->m->addr + l->m->length)
+      return l;
+  return NULL;
+}
+
+static void
+forget (struct lazy *l)
+{
+  struct lazy **p;
+  for (p = &regions; *p; p = &(*p)->next)
+    if (*p == l)
+      {
+        *p = l->next;
+        break;
+      }
+  l->m->lazy = NULL;
+  uthash_free_ (l->fname);
+  uthash_free_ (l);
+}
+
+/* Back the region of l with a new file, or leave it anonymous if that
+ * fails, and forget l. Called with the lock and llock held. Returns 0 if the
+ * region got its file.
+ */
+static int
+create (struct lazy *l)
+{
+  struct map *m = l->m;
+  struct uffdio_range r;
+  void *p;
+  int j = -1;
+
+  r.start = (unsigned long) m->addr;
+  r.len = m->length;
+  if (xmem_mkfile_at (m, l->fname, l->unlinked) == 0)
+    {
+      if (ftruncate (m->fd, m->length) == 0)
+        {
+          p = mmap (m->addr, m->length, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, m->fd, 0);
+          j = p == MAP_FAILED ? -1 : 0;
+        }
+      if (j < 0)
+        xmem_rmfile (m);
+    }
+  if (j == 0)
+    {
+      xmem_dropfd (m);
+      madvise (m->addr, m->length, l->advice);
+#ifdef MADV_HUGEPAGE
+      if (l->huge)
+        madvise (m->addr, m->length, MADV_HUGEPAGE);
+#endif
+    }
+  else if (uffd > -1)
+    ioctl (uffd, UFFDIO_UNREGISTER, &r);
+  if (uffd > -1)
+    ioctl (uffd, UFFDIO_WAKE, &r);
+  forget (l);
+  return j;
+}
+
+static void *
+handle (void *arg)
+{
+  struct uffd_msg msg[16];
+  struct uffdio_range r;
+  struct pollfd p;
+  struct lazy *l;
+  unsigned long a;
+  ssize_t n;
+  int j;
+  (void) arg;
+
+  p.fd = uffd;
+  p.events = POLLIN;
+  for (;;)
+    {
+      if (poll (&p, 1, -1) < 1)
+        continue;
+      n = read (uffd, msg, sizeof (msg));
+      if (n <= 0)
+        continue;
+      omp_set_nest_lock (&lock);
+      pthread_mutex_lock (&llock);
+      for (j = 0; j < n / (ssize_t) sizeof (struct uffd_msg); ++j)
+        {
+          if (msg[j].event != UFFD_EVENT_PAGEFAULT)
+            continue;
+          a = (unsigned long) msg[j].arg.pagefault.address;
+          l = find (a);
+          if (l)
+            create (l);
+          else
+            {
+/* Settled or unmapped since; let the fault retry. */
+              r.start = a & ~((unsigned long) sysconf (_SC_PAGESIZE) - 1);
+              r.len = sysconf (_SC_PAGESIZE);
+              ioctl (uffd, UFFDIO_WAKE, &r);
+            }
+        }
+      pthread_mutex_unlock (&llock);
+      omp_unset_nest_lock (&lock);
+    }
+  return NULL;
+}
+
+static void
+child ()
+{
+  struct lazy *l, *next;
+  pthread_mutex_init (&llock, NULL);
+  for (l = regions; l; l = next)
+    {
+      next = l->next;
+      l->m->lazy = NULL;
+      uthash_free_ (l->fname);
+      uthash_free_ (l);
+    }
+  regions = NULL;
+  if (uffd > -1)
+    close (uffd);
+  uffd = -1;
+}
+
+static void
+once ()
+{
+  pthread_atfork (NULL, NULL, child);
+}
+
+/* Start the userfaultfd and its handler. Called with llock held. */
+static int
+start ()
+{
+  struct uffdio_api api;
+  pthread_t t;
+  if (uffd > -1)
+    return 0;
+  uffd = syscall (SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (uffd < 0)
+    return -1;
+  memset (&api, 0, sizeof (api));
+  api.api = UFFD_API;
+  if (ioctl (uffd, UFFDIO_API, &api) < 0
+      || pthread_create (&t, NULL, handle, NULL) != 0)
+    {
+      close (uffd);
+      uffd = -1;
+      return -1;
+    }
+  pthread_detach (t);
+  return 0;
+}
+
+/* Reserve m->length bytes for m without a backing file, setting m->addr and
+ * m->lazy. advice and huge are applied once the file exists. Returns 0 on
+ * success and -1 otherwise, in which case the caller should map a file right
+ * away. Must be called with the lock held.
+ */
+int
+xmem_lazy_map (struct map *m, int advice, int huge)
+{
+  struct uffdio_register reg;
+  struct lazy *l;
+  size_t n = strlen (xmem_fname_template) + 1;
+  void *p;
+
+  pthread_once (&lonce, once);
+  l = (struct lazy *) uthash_malloc_ (sizeof (struct lazy));
+  if (!l)
+    return -1;
+  l->fname = (char *) uthash_malloc_ (n);
+  if (!l->fname)
+    {
+      uthash_free_ (l);
+      return -1;
+    }
+  memcpy (l->fname, xmem_fname_template, n);
+  l->unlinked = xmem_unlinked;
+  pthread_mutex_lock (&llock);
+  if (start () < 0)
+    goto fail;
+  p = mmap (NULL, m->length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    goto fail;
+  memset (&reg, 0, sizeof (reg));
+  reg.range.start = (unsigned long) p;
+  reg.range.len = m->length;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (ioctl (uffd, UFFDIO_REGISTER, &reg) < 0)
+    {
+      munmap (p, m->length);
+      goto fail;
+    }
+  m->addr = p;
+  m->lazy = l;
+  l->m = m;
+  l->advice = advice;
+  l->huge = huge;
+  l->next = regions;
+  regions = l;
+  pthread_mutex_unlock (&llock);
+  return 0;
+
+fail:
+  pthread_mutex_unlock (&llock);
+  uthash_free_ (l->fname);
+  uthash_free_ (l);
+  return -1;
+}
+
+/* Create the backing file of the lazy region m now. Returns 0 if m has a
+ * file afterwards, -1 if it stays anonymous. Must be called with the lock
+ * held.
+ */
+int
+xmem_lazy_settle (struct map *m)
+{
+  int j = 0;
+  pthread_mutex_lock (&llock);
+  if (m->lazy)
+    j = create (m->lazy);
+  pthread_mutex_unlock (&llock);
+  return XMEM_FILE (m) ? 0 : j;
+}
+
+/* Unmap the region of m, lazy or not yet. Must be called with the lock
+ * held.
+ */
+void
+xmem_lazy_unmap (struct map *m)
+{
+  pthread_mutex_lock (&llock);
+  if (m->lazy)
+    forget (m->lazy);
+  munmap (m->addr, m->length);
+  pthread_mutex_unlock (&llock);
+}
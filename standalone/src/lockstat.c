@@ -0,0 +1,108 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <omp.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Every interposed call takes the one library lock, so how long it is held
+ * and waited for bounds how xmem scales with threads. Built with
+ * XMEM_LOCKSTAT, xmem.h routes the lock functions through the wrappers
+ * below, which time the outermost acquisition of each thread (the lock is
+ * recursive) and add it up in the statistics while still holding the lock,
+ * so they need no synchronization of their own. The clock reads cost
+ * something on every call, which is why this is a build option. See
+ * stress.c for a harness that reports them.
+ *
+ * The wrappers call the OpenMP functions by their parenthesized names,
+ * which the macros of xmem.h don't expand.
+ */
+
+#ifdef XMEM_LOCKSTAT
+static struct xmem_lockstat stats;
+static __thread int depth;
+static __thread unsigned long long since;
+
+static unsigned long long
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return (unsigned long long) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* A forked child re-initializes the lock held by the forking thread. */
+void
+xmem_lock_init (omp_nest_lock_t *l)
+{
+  (omp_init_nest_lock) (l);
+  depth = 0;
+}
+
+void
+xmem_lock_set (omp_nest_lock_t *l)
+{
+  unsigned long long t = depth ? 0 : now ();
+  (omp_set_nest_lock) (l);
+  if (depth++)
+    return;
+  since = now ();
+  stats.wait_ns += since - t;
+  if (since - t > stats.max_wait_ns)
+    stats.max_wait_ns = since - t;
+}
+
+void
+xmem_lock_unset (omp_nest_lock_t *l)
+{
+  unsigned long long t;
+  int k;
+  if (!--depth)
+    {
+      t = now () - since;
+      k = t ? 63 - __builtin_clzll (t) : 0;
+      stats.hist[k < XMEM_LOCKSTAT_BUCKETS ? k : XMEM_LOCKSTAT_BUCKETS - 1]++;
+      stats.holds++;
+      stats.hold_ns += t;
+      if (t > stats.max_hold_ns)
+        stats.max_hold_ns = t;
+    }
+  (omp_unset_nest_lock) (l);
+}
+#endif
+
+/* Copy the lock statistics to s, if not NULL, and zero them if reset is
+ * set. Returns 0 on success, or -1 with errno ENOSYS if the library was
+ * built without XMEM_LOCKSTAT.
+ */
+int
+xmem_lockstat (struct xmem_lockstat *s, int reset)
+{
+#ifdef XMEM_LOCKSTAT
+  omp_set_nest_lock (&lock);
+  if (s)
+    *s = stats;
+  if (reset)
+    memset (&stats, 0, sizeof (stats));
+  omp_unset_nest_lock (&lock);
+  return 0;
+#else
+  (void) s;
+  (void) reset;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
@@ -0,0 +1,329 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Named regions (xmem_map_named) are backing files with a name of their
+ * own that outlive the process: free and exit unmap them and close their
+ * file but leave it in place, so a later run attaches the same data with
+ * one mmap instead of rebuilding it. A name without a slash is looked up in
+ * the directory of the file name template (xmem_set_path), anything else is
+ * used as a path.
+ *
+ * A named file holds the data at offset 0, like every other backing file
+ * (streams, prefetch and compaction rely on that), followed by one page of
+ * header: magic, data length, a caller-defined type tag and a checksum of
+ * those. The header is checked on attach; the data are not checksummed,
+ * which would mean reading all of them.
+ *
+ * A new file is prepared under a temporary name and linked into place, so
+ * another process never sees a file without its header, and two processes
+ * creating the same name at once end up attached to the same file.
+ */
+
+#define XMEM_NAMED_MAGIC "XMEMNAM1"
+
+struct xmem_named_header
+{
+  char magic[8];
+  uint64_t length;              /* Data length in bytes */
+  uint32_t tag;                 /* XMEM_NAMED_TAG */
+  uint32_t pad;
+  uint64_t checksum;            /* FNV-1a of the fields above */
+};
+
+static uint64_t
+checksum (const struct xmem_named_header *h)
+{
+  const unsigned char *p = (const unsigned char *) h;
+  uint64_t c = 0xcbf29ce484222325ULL;
+  size_t j;
+  for (j = 0; j < offsetof (struct xmem_named_header, checksum); ++j)
+    c = (c ^ p[j]) * 0x100000001b3ULL;
+  return c;
+}
+
+static size_t
+page ()
+{
+  return (size_t) sysconf (_SC_PAGESIZE);
+}
+
+/* The header offset (and data length rounded up to a page) of a region of
+ * n bytes.
+ */
+static size_t
+header_offset (size_t n)
+{
+  return (n + page () - 1) & ~(page () - 1);
+}
+
+/* Write the header of a region of n bytes with the given tag. */
+static int
+write_header (int fd, size_t n, int tag)
+{
+  struct xmem_named_header h;
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, XMEM_NAMED_MAGIC, sizeof (h.magic));
+  h.length = n;
+  h.tag = (uint32_t) tag;
+  h.checksum = checksum (&h);
+  if (pwrite (fd, &h, sizeof (h), header_offset (n)) != (ssize_t) sizeof (h))
+    return -1;
+  return 0;
+}
+
+/* Read and check the header of the open named file fd. Returns 0 and fills
+ * in h, or -1 with errno EINVAL if fd isn't a named region.
+ */
+static int
+read_header (int fd, struct xmem_named_header *h)
+{
+  struct stat st;
+  if (fstat (fd, &st) < 0)
+    return -1;
+  if ((size_t) st.st_size < page ()
+      || pread (fd, h, sizeof (*h), st.st_size - page ()) !=
+      (ssize_t) sizeof (*h)
+      || memcmp (h->magic, XMEM_NAMED_MAGIC, sizeof (h->magic))
+      || h->checksum != checksum (h)
+      || header_offset (h->length) + page () != (size_t) st.st_size)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  return 0;
+}
+
+/* Resolve a region name to a path in p, XMEM_MAX_PATH_LEN bytes. */
+static int
+resolve (const char *name, char *p)
+{
+  char *s;
+  if (!name || !*name)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  if (strchr (name, '/'))
+    {
+      if (strlen (name) >= XMEM_MAX_PATH_LEN)
+        goto toolong;
+      strcpy (p, name);
+      return 0;
+    }
+  strncpy (p, xmem_fname_template, XMEM_MAX_PATH_LEN - 1);
+  p[XMEM_MAX_PATH_LEN - 1] = 0;
+  s = strrchr (p, '/');
+  if (s)
+    s[1] = 0;
+  else
+    *p = 0;
+  if (strlen (p) + strlen (name) >= XMEM_MAX_PATH_LEN)
+    goto toolong;
+  strcat (p, name);
+  return 0;
+
+toolong:
+  errno = ENAMETOOLONG;
+  return -1;
+}
+
+/* Create the named file path for a region of n bytes, or find that someone
+ * else just did. Returns an open descriptor, or -1 with errno EEXIST if the
+ * file exists.
+ */
+static int
+create (const char *path, size_t n, int tag)
+{
+  char tmp[XMEM_MAX_PATH_LEN + 8];
+  int fd, j;
+
+  snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+  fd = mkostemp (tmp, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (ftruncate (fd, header_offset (n) + page ()) < 0
+      || write_header (fd, n, tag) < 0 || link (tmp, path) < 0)
+    {
+      j = errno;
+      close (fd);
+      unlink (tmp);
+      errno = j;
+      return -1;
+    }
+  unlink (tmp);
+  return fd;
+}
+
+/* Create or attach the named region name of size bytes (0 to attach one of
+ * any size) for m, as flags (XMEM_NAMED_* of xmem_api.h) say, and map it.
+ * Sets m->addr, m->length, m->fd, m->path and m->named. Returns 0 on
+ * success, -1 with errno set otherwise. Must be called with the lock held.
+ */
+int
+xmem_named_map (struct map *m, const char *name, size_t size, int flags)
+{
+  char path[XMEM_MAX_PATH_LEN];
+  struct xmem_named_header h;
+  int tag = XMEM_NAMED_TAG_OF (flags);
+  int j;
+
+  if (resolve (name, path) < 0)
+    return -1;
+  m->fd = open (path, O_RDWR | O_CLOEXEC);
+  if (m->fd > -1 && (flags & XMEM_NAMED_EXCL))
+    {
+      errno = EEXIST;
+      goto fail;
+    }
+  if (m->fd < 0 && errno == ENOENT && (flags & XMEM_NAMED_CREATE) && size)
+    {
+      m->fd = create (path, size, tag);
+      if (m->fd < 0 && errno == EEXIST && !(flags & XMEM_NAMED_EXCL))
+        m->fd = open (path, O_RDWR | O_CLOEXEC);
+    }
+  if (m->fd < 0)
+    return -1;
+  if (read_header (m->fd, &h) < 0)
+    goto fail;
+  if ((size && size != h.length) || (tag && (uint32_t) tag != h.tag)
+      || h.length == 0)
+    {
+      errno = EINVAL;
+      goto fail;
+    }
+  m->length = h.length;
+  m->addr = mmap (NULL, m->length, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd,
+                  0);
+  if (m->addr == MAP_FAILED)
+    goto fail;
+  m->path = (char *) uthash_malloc_ (strlen (path) + 1);
+  if (m->path)
+    strcpy (m->path, path);
+  m->named = 1;
+  return 0;
+
+fail:
+  j = errno;
+  if (m->fd > -1)
+    close (m->fd);
+  m->fd = -1;
+  errno = j;
+  return -1;
+}
+
+/* Resize the named region of m to size bytes, moving its header, and remap
+ * it; m->addr may change. The old header is only dropped once the mapping
+ * has moved. Returns 0 on success, -1 otherwise. Must be called with the
+ * lock held.
+ */
+int
+xmem_named_resize (struct map *m, size_t size)
+{
+  struct xmem_named_header h;
+  size_t old = header_offset (m->length), new = header_offset (size);
+  void *p;
+
+  if (read_header (m->fd, &h) < 0)
+    return -1;
+  if (new > old)
+    {
+      if (ftruncate (m->fd, new + page ()) < 0)
+        return -1;
+      if (write_header (m->fd, size, h.tag) < 0
+          || (p = mremap (m->addr, m->length, size, MREMAP_MAYMOVE))
+          == MAP_FAILED)
+        {
+          ftruncate (m->fd, old + page ());
+          return -1;
+        }
+/* The old header page is data now. */
+      fallocate (m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, old,
+                 page ());
+    }
+  else
+    {
+      p = mremap (m->addr, m->length, size, MREMAP_MAYMOVE);
+      if (p == MAP_FAILED)
+        return -1;
+      write_header (m->fd, size, h.tag);
+      if (new < old)
+        ftruncate (m->fd, new + page ());
+    }
+  m->addr = p;
+  m->length = size;
+  return 0;
+}
+
+/* The data length of the open named file fd, or -1 if fd isn't one. */
+ssize_t
+xmem_named_length (int fd)
+{
+  struct xmem_named_header h;
+  if (read_header (fd, &h) < 0)
+    return -1;
+  return (ssize_t) h.length;
+}
+
+/* Look up the length and tag of the named region name without attaching
+ * it. Either pointer may be NULL. Returns 0 on success, -1 with errno set
+ * otherwise.
+ */
+int
+xmem_named_info (const char *name, size_t *size, int *tag)
+{
+  char path[XMEM_MAX_PATH_LEN];
+  struct xmem_named_header h;
+  int fd, j;
+
+  if (resolve (name, path) < 0)
+    return -1;
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  j = read_header (fd, &h);
+  close (fd);
+  if (j < 0)
+    return -1;
+  if (size)
+    *size = h.length;
+  if (tag)
+    *tag = (int) h.tag;
+  return 0;
+}
+
+/* Remove the named region name. Processes that have it attached keep their
+ * mappings. Files that aren't named regions are left alone. Returns 0 on
+ * success, -1 with errno set otherwise.
+ */
+int
+xmem_unlink_named (const char *name)
+{
+  char path[XMEM_MAX_PATH_LEN];
+  if (xmem_named_info (name, NULL, NULL) < 0 || resolve (name, path) < 0)
+    return -1;
+  return unlink (path);
+}
@@ -0,0 +1,238 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <unistd.h>
+#include <sys/types.h>
+#include <omp.h>
+
+extern "C"
+{
+#include "uthash.h"
+#include "xmem.h"
+}
+
+/* NOTES
+ *
+ * The C++ allocation operators, interposed like malloc and free so that
+ * C++ programs get the same placement without relying on how the C++
+ * runtime happens to implement them.
+ *
+ * Plain new goes through malloc. Sized delete, which C++14 compilers emit
+ * whenever the size is known, goes through xmem_free_sized: allocations
+ * shorter than any region ever mapped are released without a flexmap
+ * lookup or the lock, which is nearly all of them in programs that churn
+ * small objects.
+ *
+ * Aligned new (std::align_val_t) hands large requests to malloc when the
+ * alignment is at most a page, since regions are page aligned, and checks
+ * the result in case malloc placed the request on the heap after all.
+ * Everything else comes from posix_memalign. free recognizes either kind.
+ */
+
+static void *
+xmem_new (std::size_t n)
+{
+  void *p;
+  if (n == 0)
+    n = 1;
+  while (!(p = malloc (n)))
+    {
+      std::new_handler h = std::get_new_handler ();
+      if (!h)
+        throw std::bad_alloc ();
+      h ();
+    }
+  return p;
+}
+
+static void *
+xmem_new_aligned (std::size_t n, std::size_t a)
+{
+  void *p;
+  if (n == 0)
+    n = 1;
+  for (;;)
+    {
+      p = NULL;
+      if (n > xmem_threshold && a <= (std::size_t) sysconf (_SC_PAGESIZE))
+        {
+          p = malloc (n);
+          if (p && ((std::uintptr_t) p & (a - 1)))
+            {
+              free (p);
+              p = NULL;
+            }
+        }
+      if (!p && posix_memalign (&p, a < sizeof (void *) ? sizeof (void *)
+                                : a, n) != 0)
+        p = NULL;
+      if (p)
+        return p;
+      std::new_handler h = std::get_new_handler ();
+      if (!h)
+        throw std::bad_alloc ();
+      h ();
+    }
+}
+
+void *
+operator new (std::size_t n)
+{
+  return xmem_new (n);
+}
+
+void *
+operator new[] (std::size_t n)
+{
+  return xmem_new (n);
+}
+
+void *
+operator new (std::size_t n, const std::nothrow_t &) noexcept
+{
+  try
+    {
+      return xmem_new (n);
+    }
+  catch (...)
+    {
+      return NULL;
+    }
+}
+
+void *
+operator new[] (std::size_t n, const std::nothrow_t &) noexcept
+{
+  try
+    {
+      return xmem_new (n);
+    }
+  catch (...)
+    {
+      return NULL;
+    }
+}
+
+void *
+operator new (std::size_t n, std::align_val_t a)
+{
+  return xmem_new_aligned (n, (std::size_t) a);
+}
+
+void *
+operator new[] (std::size_t n, std::align_val_t a)
+{
+  return xmem_new_aligned (n, (std::size_t) a);
+}
+
+void *
+operator new (std::size_t n, std::align_val_t a, const std::nothrow_t &)
+  noexcept
+{
+  try
+    {
+      return xmem_new_aligned (n, (std::size_t) a);
+    }
+  catch (...)
+    {
+      return NULL;
+    }
+}
+
+void *
+operator new[] (std::size_t n, std::align_val_t a, const std::nothrow_t &)
+  noexcept
+{
+  try
+    {
+      return xmem_new_aligned (n, (std::size_t) a);
+    }
+  catch (...)
+    {
+      return NULL;
+    }
+}
+
+void
+operator delete (void *p) noexcept
+{
+  free (p);
+}
+
+void
+operator delete[] (void *p) noexcept
+{
+  free (p);
+}
+
+void
+operator delete (void *p, const std::nothrow_t &) noexcept
+{
+  free (p);
+}
+
+void
+operator delete[] (void *p, const std::nothrow_t &) noexcept
+{
+  free (p);
+}
+
+void
+operator delete (void *p, std::size_t n) noexcept
+{
+  xmem_free_sized (p, n);
+}
+
+void
+operator delete[] (void *p, std::size_t n) noexcept
+{
+  xmem_free_sized (p, n);
+}
+
+void
+operator delete (void *p, std::align_val_t) noexcept
+{
+  free (p);
+}
+
+void
+operator delete[] (void *p, std::align_val_t) noexcept
+{
+  free (p);
+}
+
+void
+operator delete (void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  free (p);
+}
+
+void
+operator delete[] (void *p, std::align_val_t, const std::nothrow_t &)
+  noexcept
+{
+  free (p);
+}
+
+void
+operator delete (void *p, std::size_t n, std::align_val_t) noexcept
+{
+  xmem_free_sized (p, n);
+}
+
+void
+operator delete[] (void *p, std::size_t n, std::align_val_t) noexcept
+{
+  xmem_free_sized (p, n);
+}
@@ -0,0 +1,335 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <omp.h>
+
+#define uthash_malloc(sz) uthash_malloc_(sz)
+#define uthash_free(ptr, sz) uthash_free_(ptr)
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Size alone is a poor predictor of how an allocation is used. The profiler
+ * identifies an allocation by a hash of a short backtrace taken at the call
+ * to malloc (its call site) and records, per call site, the number of
+ * allocations, the largest size, the mean lifetime and the mean ratio of
+ * pages touched over the lifetime of the allocation.
+ *
+ * Call site keys must be stable across runs, so each frame is hashed as the
+ * name of the object that contains it plus its offset into that object
+ * rather than as a raw (address space layout randomized) address.
+ *
+ * The touched ratio is measured with mincore just before the allocation is
+ * released. For anonymous memory that is the set of pages ever touched; for
+ * xmem file mappings it is the set of pages still in the page cache, which is
+ * a reasonable stand-in.
+ *
+ * A profile recorded with XMEM_PROFILE_RECORD is loaded in a later run with
+ * XMEM_PROFILE_APPLY. Short-lived hot sites are then kept on the heap and
+ * long-lived cold sites are file-backed regardless of xmem_threshold. Sites
+ * that are neither are left to the threshold.
+ *
+ * All of the functions below must be called with the lock held, except for
+ * xmem_profile_site which must be called without it.
+ */
+
+/* Per call site statistics */
+struct site
+{
+  unsigned long long key;       /* Backtrace hash, hash key */
+  unsigned long count;          /* Number of completed allocations */
+  size_t size;                  /* Largest size seen */
+  double lifetime;              /* Summed lifetimes in seconds */
+  double touched;               /* Summed touched-page ratios */
+  int place;                    /* -1 no opinion, 0 heap, 1 file (APPLY) */
+  UT_hash_handle hh;
+};
+
+/* Live profiled allocations */
+struct palloc
+{
+  void *addr;                   /* Allocation address, hash key */
+  size_t size;
+  unsigned long long key;       /* Call site */
+  double start;                 /* Allocation time in seconds */
+  UT_hash_handle hh;
+};
+
+static struct site *sites;
+static struct palloc *pallocs;
+
+/* Set while a thread is taking a backtrace. backtrace may itself allocate
+ * (it loads libgcc_s on first use), and those allocations must not recurse
+ * into the profiler.
+ */
+static __thread int in_backtrace;
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return (double) t.tv_sec + 1e-9 * (double) t.tv_nsec;
+}
+
+static unsigned long long
+fnv (unsigned long long h, const void *p, size_t n)
+{
+  const unsigned char *c = (const unsigned char *) p;
+  while (n--)
+    {
+      h ^= *c++;
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+/* Return the call site key of the current allocation, or 0 when the site
+ * can't be determined.
+ */
+unsigned long long
+xmem_profile_site ()
+{
+  void *frames[XMEM_PROFILE_DEPTH + 2];
+  unsigned long long h = 14695981039346656037ULL;
+  const char *name;
+  uintptr_t off;
+  Dl_info info;
+  int j, n;
+
+  if (in_backtrace)
+    return 0;
+  in_backtrace = 1;
+  n = backtrace (frames, XMEM_PROFILE_DEPTH + 2);
+  in_backtrace = 0;
+/* Skip this function and the interposed allocator itself. */
+  for (j = 2; j < n; ++j)
+    {
+      off = (uintptr_t) frames[j];
+      if (dladdr (frames[j], &info) && info.dli_fname)
+        {
+          name = strrchr (info.dli_fname, '/');
+          name = name ? name + 1 : info.dli_fname;
+          h = fnv (h, name, strlen (name));
+          off -= (uintptr_t) info.dli_fbase;
+        }
+      h = fnv (h, &off, sizeof (off));
+    }
+  return h ? h : 1;
+}
+
+/* Look up the placement decision for a call site. Returns 1 for a file
+ * mapping, 0 for the heap and -1 when the profile has no opinion.
+ */
+int
+xmem_profile_place (unsigned long long site)
+{
+  struct site *s;
+  HASH_FIND (hh, sites, &site, sizeof (site), s);
+  return s ? s->place : -1;
+}
+
+void
+xmem_profile_alloc (void *addr, size_t size, unsigned long long site)
+{
+  struct palloc *p;
+  if (!addr || !site)
+    return;
+/* A stale entry means the address was released behind our back, for
+ * instance by a libc-internal free. Just reuse it.
+ */
+  HASH_FIND_PTR (pallocs, &addr, p);
+  if (!p)
+    {
+      p = (struct palloc *) uthash_malloc_ (sizeof (struct palloc));
+      if (!p)
+        return;
+      p->addr = addr;
+      HASH_ADD_PTR (pallocs, addr, p);
+    }
+  p->size = size;
+  p->key = site;
+  p->start = now ();
+}
+
+/* Carry a profiled allocation over a realloc that moved it to addr. */
+void
+xmem_profile_realloc (void *ptr, void *addr, size_t size)
+{
+  struct palloc *p;
+  HASH_FIND_PTR (pallocs, &ptr, p);
+  if (!p)
+    return;
+  HASH_DEL (pallocs, p);
+  if (!addr)
+    {
+      uthash_free_ (p);
+      return;
+    }
+  p->addr = addr;
+  p->size = size;
+  HASH_ADD_PTR (pallocs, addr, p);
+}
+
+/* Retire a profiled allocation, folding its lifetime and touched ratio into
+ * its call site statistics. Must be called before the memory is released.
+ */
+void
+xmem_profile_free (void *addr)
+{
+  struct palloc *p;
+  struct site *s;
+  unsigned char vec[4096];
+  size_t pg, first, last, len, n, j, k, touched, total;
+
+  HASH_FIND_PTR (pallocs, &addr, p);
+  if (!p)
+    return;
+  HASH_DEL (pallocs, p);
+
+/* Count resident pages in the page-aligned interior of the allocation, a
+ * few thousand pages at a time.
+ */
+  pg = (size_t) sysconf (_SC_PAGESIZE);
+  first = ((uintptr_t) p->addr + pg - 1) & ~(pg - 1);
+  last = ((uintptr_t) p->addr + p->size) & ~(pg - 1);
+  touched = total = 0;
+  while (first < last)
+    {
+      len = last - first;
+      if (len > sizeof (vec) * pg)
+        len = sizeof (vec) * pg;
+      n = len / pg;
+      if (mincore ((void *) first, len, vec) == 0)
+        {
+          for (k = 0, j = 0; j < n; ++j)
+            k += vec[j] & 1;
+          touched += k;
+          total += n;
+        }
+      first += len;
+    }
+
+  HASH_FIND (hh, sites, &p->key, sizeof (p->key), s);
+  if (!s)
+    {
+      s = (struct site *) uthash_malloc_ (sizeof (struct site));
+      if (!s)
+        {
+          uthash_free_ (p);
+          return;
+        }
+      memset (s, 0, sizeof (struct site));
+      s->key = p->key;
+      s->place = -1;
+      HASH_ADD (hh, sites, key, sizeof (s->key), s);
+    }
+  s->count++;
+  if (p->size > s->size)
+    s->size = p->size;
+  s->lifetime += now () - p->start;
+  s->touched += total ? (double) touched / (double) total : 1.0;
+  uthash_free_ (p);
+}
+
+/* Write the recorded call site statistics to path. One line per site:
+ * key count size mean_lifetime mean_touched
+ * Returns 0 on success, a negative number otherwise.
+ */
+int
+xmem_profile_save (const char *path)
+{
+  struct site *s, *tmp;
+  FILE *f;
+  f = fopen (path, "w");
+  if (!f)
+    return -1;
+  fprintf (f, "# xmem profile: key count size lifetime touched\n");
+  HASH_ITER (hh, sites, s, tmp)
+  {
+    if (s->count < 1)
+      continue;
+    fprintf (f, "%016llx %lu %lu %.6f %.6f\n", s->key, s->count,
+             (unsigned long) s->size, s->lifetime / s->count,
+             s->touched / s->count);
+  }
+  fclose (f);
+  return 0;
+}
+
+/* Load a profile written by xmem_profile_save and derive a placement for
+ * each call site. Returns the number of sites loaded or a negative number.
+ */
+int
+xmem_profile_load (const char *path)
+{
+  struct site *s;
+  unsigned long long key;
+  unsigned long count, size;
+  double lifetime, touched;
+  char line[256];
+  FILE *f;
+  int n = 0;
+
+  f = fopen (path, "r");
+  if (!f)
+    return -1;
+  xmem_profile_clear ();
+  while (fgets (line, sizeof (line), f))
+    {
+      if (sscanf (line, "%llx %lu %lu %lf %lf", &key, &count, &size,
+                  &lifetime, &touched) != 5)
+        continue;
+      s = (struct site *) uthash_malloc_ (sizeof (struct site));
+      if (!s)
+        break;
+      memset (s, 0, sizeof (struct site));
+      s->key = key;
+      s->count = count;
+      s->size = size;
+      s->lifetime = lifetime;
+      s->touched = touched;
+      s->place = -1;
+      if (touched >= XMEM_PROFILE_HOT && lifetime < XMEM_PROFILE_SHORT)
+        s->place = 0;
+      else if (touched < XMEM_PROFILE_HOT && lifetime >= XMEM_PROFILE_SHORT)
+        s->place = 1;
+      HASH_ADD (hh, sites, key, sizeof (s->key), s);
+      n++;
+    }
+  fclose (f);
+  return n;
+}
+
+/* Discard all call site statistics and live allocation records. */
+void
+xmem_profile_clear ()
+{
+  struct site *s, *stmp;
+  struct palloc *p, *ptmp;
+  HASH_ITER (hh, sites, s, stmp)
+  {
+    HASH_DEL (sites, s);
+    uthash_free_ (s);
+  }
+  HASH_ITER (hh, pallocs, p, ptmp)
+  {
+    HASH_DEL (pallocs, p);
+    uthash_free_ (p);
+  }
+}
@@ -0,0 +1,332 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Quotas keep one process, or one group of its threads, from taking all of
+ * a shared disk or all of the memory. Threads are grouped by tag
+ * (xmem_set_tag): a thread's own tag, else the process default. Every
+ * file-backed region from xmem_malloc is charged to the tag of the thread
+ * that allocated it, and to the process, with its length as long as its map
+ * structure lives; free and realloc give the bytes back. A region in
+ * reservation mode is charged the length of its file (m->extent), which
+ * realloc grows ahead of the region.
+ *
+ * Out-of-core (disk) budgets are checked before a region is created. Over
+ * budget, the tag's action decides: XMEM_QUOTA_FAIL fails the allocation,
+ * XMEM_QUOTA_BLOCK waits up to a timeout for frees to make room and fails
+ * after that, and XMEM_QUOTA_SPILL puts the region on the compressed tier
+ * instead (or fails without one). The check and the charge are not one
+ * step, so threads allocating at the same time may overshoot a budget by
+ * their last regions. realloc never waits; growth over budget moves the
+ * region through malloc, which applies the action, or fails with
+ * XMEM_QUOTA_FAIL.
+ *
+ * Resident budgets are kept by the governor (governor.c): the process
+ * budget is xmem_budget, and a tag over its own budget has the least
+ * recently used chunks of its own regions paged out.
+ *
+ * Tags are never freed, there are only ever a few.
+ */
+
+struct quota
+{
+  char name[XMEM_QUOTA_NAME];
+  size_t disk;                  /* Out-of-core budget, 0 for none */
+  size_t resident;              /* Resident budget, 0 for none */
+  int action;                   /* XMEM_QUOTA_* */
+  int timeout;                  /* XMEM_QUOTA_BLOCK wait in milliseconds */
+  size_t used;                  /* Bytes charged */
+  size_t rss;                   /* Resident bytes at the last sample */
+  struct quota *next;
+};
+
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;
+static struct quota whole = { "", 0, 0, XMEM_QUOTA_FAIL, 0, 0, 0, NULL };
+static struct quota *tags;
+static struct quota *fallback;  /* Process default tag */
+static __thread struct quota *mine;
+int xmem_quota_governed;        /* Tags with a resident budget */
+
+/* After fork the lock may have been held by a thread that doesn't exist in
+ * the child. Called by the fork handler of xmem.c.
+ */
+void
+xmem_quota_child ()
+{
+  pthread_mutex_init (&qlock, NULL);
+  pthread_cond_init (&qcond, NULL);
+}
+
+/* Find the tag name, creating it if make is set. Called with qlock held. */
+static struct quota *
+find (const char *name, int make)
+{
+  struct quota *q;
+  for (q = tags; q; q = q->next)
+    if (!strcmp (q->name, name))
+      return q;
+  if (!make)
+    {
+      errno = ENOENT;
+      return NULL;
+    }
+  q = (struct quota *) uthash_malloc_ (sizeof (struct quota));
+  if (!q)
+    return NULL;
+  memset (q, 0, sizeof (struct quota));
+  strcpy (q->name, name);
+  q->next = tags;
+  tags = q;
+  return q;
+}
+
+static int
+over (struct quota *q, size_t n)
+{
+  return q && q->disk && q->used + n > q->disk;
+}
+
+/* Check n more out-of-core bytes for the calling thread against its tag's
+ * budget and the process budget, waiting for room if so configured. Returns
+ * 0 if they fit, XMEM_QUOTA_SPILL if they should go to the compressed tier
+ * and -1 with errno ENOMEM otherwise. Must be called without the lock.
+ */
+int
+xmem_quota_check (size_t n)
+{
+  struct quota *q, *v;
+  struct timespec t;
+  int j = 0, waiting = 0;
+
+  if (!tags && !whole.disk)
+    return 0;
+  pthread_mutex_lock (&qlock);
+  q = mine ? mine : fallback;
+  while ((v = over (q, n) ? q : over (&whole, n) ? &whole : NULL))
+    {
+      if (v->action != XMEM_QUOTA_BLOCK)
+        {
+          j = v->action == XMEM_QUOTA_SPILL ? XMEM_QUOTA_SPILL : -1;
+          break;
+        }
+      if (!v->timeout)
+        {
+          pthread_cond_wait (&qcond, &qlock);
+          continue;
+        }
+      if (!waiting)
+        {
+          clock_gettime (CLOCK_REALTIME, &t);
+          t.tv_sec += v->timeout / 1000;
+          t.tv_nsec += (v->timeout % 1000) * 1000000L;
+          if (t.tv_nsec >= 1000000000L)
+            {
+              t.tv_sec += 1;
+              t.tv_nsec -= 1000000000L;
+            }
+          waiting = 1;
+        }
+      if (pthread_cond_timedwait (&qcond, &qlock, &t) == ETIMEDOUT)
+        {
+          j = over (q, n) || over (&whole, n) ? -1 : 0;
+          break;
+        }
+    }
+  pthread_mutex_unlock (&qlock);
+  if (j < 0)
+    errno = ENOMEM;
+  return j;
+}
+
+/* Returns nonzero if the region of m can grow to n bytes without going over
+ * a budget, and what the action is otherwise in *action.
+ */
+int
+xmem_quota_fits (struct map *m, size_t n, int *action)
+{
+  struct quota *q = m->quota;
+  int j = 1;
+  if (n <= m->charged)
+    return 1;
+  pthread_mutex_lock (&qlock);
+  if (over (q, n - m->charged))
+    {
+      *action = q->action;
+      j = 0;
+    }
+  else if (over (&whole, n - m->charged))
+    {
+      *action = whole.action;
+      j = 0;
+    }
+  pthread_mutex_unlock (&qlock);
+  return j;
+}
+
+/* Charge the region of m with n bytes in all, to the tag of the calling
+ * thread if it isn't charged yet. A charge of 0 gives everything back. Must
+ * be called with the lock held.
+ */
+void
+xmem_quota_charge (struct map *m, size_t n)
+{
+  if (n == m->charged)
+    return;
+  pthread_mutex_lock (&qlock);
+  if (!m->charged)
+    m->quota = mine ? mine : fallback;
+  whole.used += n - m->charged;
+  if (m->quota)
+    m->quota->used += n - m->charged;
+  if (n < m->charged)
+    pthread_cond_broadcast (&qcond);
+  m->charged = n;
+  if (!n)
+    m->quota = NULL;
+  pthread_mutex_unlock (&qlock);
+}
+
+/* Called by the governor, with the lock held, before (start set) and while
+ * sampling: zero the resident counts, then add the n resident bytes of the
+ * region of m.
+ */
+void
+xmem_quota_sample (struct map *m, size_t n, int start)
+{
+  struct quota *q;
+  if (start)
+    {
+      for (q = tags; q; q = q->next)
+        q->rss = 0;
+      return;
+    }
+  if (m->quota)
+    m->quota->rss += n;
+}
+
+/* The next tag after q (the first for NULL) over its resident budget, and
+ * its resident bytes and budget. Called by the governor with the lock held.
+ */
+struct quota *
+xmem_quota_over (struct quota *q, size_t *rss, size_t *budget)
+{
+  for (q = q ? q->next : tags; q; q = q->next)
+    if (q->resident && q->rss > q->resident)
+      {
+        *rss = q->rss;
+        *budget = q->resident;
+        return q;
+      }
+  return NULL;
+}
+
+/* Tag the calling thread's new regions with name, or all threads without
+ * one of their own when thread is 0. A NULL name removes the tag. Returns 0
+ * on success, -1 with errno set otherwise.
+ */
+int
+xmem_set_tag (const char *name, int thread)
+{
+  struct quota *q = NULL;
+  if (name && (!*name || strlen (name) >= XMEM_QUOTA_NAME))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  pthread_mutex_lock (&qlock);
+  if (name)
+    q = find (name, 1);
+  if (q || !name)
+    {
+      if (thread)
+        mine = q;
+      else
+        fallback = q;
+    }
+  pthread_mutex_unlock (&qlock);
+  return q || !name ? 0 : -1;
+}
+
+/* Set the out-of-core and resident budgets, in bytes (0 for none), of the
+ * tag name, or of the whole process when name is NULL, and the action
+ * (XMEM_QUOTA_FAIL, XMEM_QUOTA_BLOCK for up to timeout milliseconds, or
+ * XMEM_QUOTA_SPILL) when the out-of-core budget would be exceeded. A
+ * timeout of 0 blocks for as long as it takes. The process resident budget
+ * is the governor budget, see xmem_set_budget; a resident budget of 0 for
+ * the process leaves it as it is, xmem_set_budget (0) turns it off. Returns
+ * 0 on success, -1 with errno set otherwise.
+ */
+int
+xmem_set_quota (const char *name, size_t disk, size_t resident, int action,
+                int timeout)
+{
+  struct quota *q;
+  if (action < XMEM_QUOTA_FAIL || action > XMEM_QUOTA_SPILL || timeout < 0
+      || (name && (!*name || strlen (name) >= XMEM_QUOTA_NAME)))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  omp_set_nest_lock (&lock);
+  pthread_mutex_lock (&qlock);
+  q = name ? find (name, 1) : &whole;
+  if (q)
+    {
+      if (q != &whole)
+        xmem_quota_governed += (resident != 0) - (q->resident != 0);
+      q->disk = disk;
+      q->resident = resident;
+      q->action = action;
+      q->timeout = timeout;
+      pthread_cond_broadcast (&qcond);
+    }
+  pthread_mutex_unlock (&qlock);
+  if (q && !name && resident)
+    xmem_budget = resident;
+  omp_unset_nest_lock (&lock);
+  if (q)
+    xmem_governor_start ();
+  return q ? 0 : -1;
+}
+
+/* Report the out-of-core bytes charged to the tag name, or the whole
+ * process when name is NULL, and its resident bytes as of the last governor
+ * sample (0 when there is no resident budget to govern). Either pointer may
+ * be NULL. Returns 0 on success, -1 with errno set otherwise.
+ */
+int
+xmem_quota_usage (const char *name, size_t *disk, size_t *resident)
+{
+  struct quota *q;
+  pthread_mutex_lock (&qlock);
+  q = name ? find (name, 0) : &whole;
+  if (q)
+    {
+      if (disk)
+        *disk = q->used;
+      if (resident)
+        *resident = q == &whole ? xmem_resident_bytes : q->rss;
+    }
+  pthread_mutex_unlock (&qlock);
+  return q ? 0 : -1;
+}
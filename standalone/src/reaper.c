@@ -0,0 +1,190 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Removing a large, fully written backing file is slow: the file system has
+ * to free every extent, and on ext4 that takes hundreds of milliseconds for
+ * tens of gigabytes. free does it under the global lock. With a reaper limit
+ * set (xmem_set_reaper in api.c), free only unmaps the region and hands its
+ * descriptor and path to a reaper thread, which does the rest in batches off
+ * the critical path.
+ *
+ * The reaper punches the file out XMEM_REAP_STEP bytes at a time, so space
+ * comes back gradually and no single call holds the inode for long, then
+ * truncates, unlinks and closes it. Punching and truncating discard cached
+ * pages, dirty ones included, without writing them back, which is cheaper
+ * than POSIX_FADV_DONTNEED (that would start writeback of data no one will
+ * read again). Once the process has forked (xmem_forked) a child may still
+ * map the file, shared or copy-on-write, and would lose its data, so the
+ * reaper only unlinks and closes it.
+ *
+ * At most xmem_reap_limit bytes of files wait for the reaper at any time.
+ * A free that would go over that limit removes its file synchronously, as
+ * before, so disk use stays bounded.
+ *
+ * Files queued by a parent process belong to it: after fork the child just
+ * closes its copies of their descriptors.
+ */
+
+struct reap
+{
+  int fd;
+  char *path;
+  size_t length;
+  int mapped;                   /* Other processes may map the file */
+  struct reap *next;
+};
+
+static pthread_mutex_t rlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rdone = PTHREAD_COND_INITIALIZER;
+static struct reap *queue;
+static size_t pending;          /* Bytes queued or being reaped */
+static int running;
+
+static void
+reap (struct reap *r)
+{
+  off_t off;
+/* Files with a path are closed while mapped, see xmem_fd in xmem.c. */
+  if (r->fd < 0 && r->path && !r->mapped)
+    r->fd = open (r->path, O_RDWR | O_CLOEXEC);
+  if (r->fd > -1 && !r->mapped)
+    {
+      for (off = 0; (size_t) off < r->length; off += XMEM_REAP_STEP)
+        if (fallocate (r->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off,
+                       XMEM_REAP_STEP) < 0)
+          break;
+      ftruncate (r->fd, 0);
+    }
+  if (r->fd > -1)
+    close (r->fd);
+  if (r->path)
+    {
+      unlink (r->path);
+      uthash_free_ (r->path);
+    }
+}
+
+static void *
+reaper (void *arg)
+{
+  struct reap *batch, *r;
+  size_t n;
+  (void) arg;
+  pthread_mutex_lock (&rlock);
+  for (;;)
+    {
+      while (!queue)
+        pthread_cond_wait (&rcond, &rlock);
+      batch = queue;
+      queue = NULL;
+      pthread_mutex_unlock (&rlock);
+      for (n = 0; batch; batch = r)
+        {
+          r = batch->next;
+          reap (batch);
+          n += batch->length;
+          uthash_free_ (batch);
+        }
+      pthread_mutex_lock (&rlock);
+      pending -= n;
+      pthread_cond_broadcast (&rdone);
+    }
+  return NULL;
+}
+
+static void
+child ()
+{
+  struct reap *r;
+  pthread_mutex_init (&rlock, NULL);
+  pthread_cond_init (&rcond, NULL);
+  pthread_cond_init (&rdone, NULL);
+  for (r = queue; r; r = r->next)
+    if (r->fd > -1)
+      close (r->fd);
+  queue = NULL;
+  pending = 0;
+  running = 0;
+}
+
+/* Hand the backing file of m, whose region is already unmapped, to the
+ * reaper. On success m no longer refers to the file and the caller only
+ * frees the structure. Returns 0 if the file was queued and -1 if the caller
+ * must remove it itself. Called with the lock held.
+ */
+int
+xmem_reap (struct map *m)
+{
+  struct reap *r;
+  pthread_t t;
+  static int registered;
+
+  if (!xmem_reap_limit || m->named || m->shared || (m->fd < 0 && !m->path))
+    return -1;
+  r = (struct reap *) uthash_malloc_ (sizeof (struct reap));
+  if (!r)
+    return -1;
+  pthread_mutex_lock (&rlock);
+  if (pending + m->length > xmem_reap_limit)
+    goto sync;
+  if (!registered)
+    {
+      pthread_atfork (NULL, NULL, child);
+      registered = 1;
+    }
+  if (!running)
+    {
+      if (pthread_create (&t, NULL, reaper, NULL) != 0)
+        goto sync;
+      pthread_detach (t);
+      running = 1;
+    }
+  r->fd = m->fd;
+  r->length = m->length;
+  r->mapped = xmem_forked;
+/* m->path comes from the default malloc, like uthash_malloc_. */
+  r->path = m->path;
+  m->path = NULL;
+  m->fd = -1;
+  r->next = queue;
+  queue = r;
+  pending += r->length;
+  pthread_cond_signal (&rcond);
+  pthread_mutex_unlock (&rlock);
+  return 0;
+
+sync:
+  pthread_mutex_unlock (&rlock);
+  uthash_free_ (r);
+  return -1;
+}
+
+/* Wait until the reaper has removed every queued file. */
+void
+xmem_reap_wait ()
+{
+  pthread_mutex_lock (&rlock);
+  while (running && pending > 0)
+    pthread_cond_wait (&rdone, &rlock);
+  pthread_mutex_unlock (&rlock);
+}
@@ -0,0 +1,308 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Regions are files, so another process can map the same data without a
+ * copy. xmem_export returns a handle for a region, the path of its backing
+ * file (or a /proc/<pid>/fd path for unlinked files, valid while the
+ * exporting process lives), that xmem_import maps in another process.
+ * xmem_export_fd and xmem_import_fd pass the file descriptor over a Unix
+ * domain socket instead, which works across users and for unlinked files.
+ *
+ * Every process that maps a shared region holds a shared flock on a
+ * descriptor of its own for the backing file; that is the reference count.
+ * When a process lets go of a shared region it closes its descriptor and
+ * then tries for an exclusive lock on a fresh one: whoever gets it was the
+ * last user and removes the file. Unlinked files need none of this, they go
+ * with their last descriptor and mapping anyway.
+ *
+ * A forked child maps the shared regions it inherits too, so it takes a
+ * reference of its own: the inherited descriptor shares its lock with the
+ * parent's. The child lets go of them when it exits normally.
+ *
+ * Shared regions are not resized in place, which would pull the file out
+ * from under the other processes; realloc moves them instead. Named regions
+ * (named.c) can be shared as well and keep their file regardless.
+ */
+
+/* Give the child its own reference to every shared region. */
+static void
+child ()
+{
+  char p[64];
+  struct map *m, *tmp;
+  int fd;
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    if (!m->shared || m->named || m->fd < 0)
+      continue;
+    snprintf (p, sizeof (p), "/proc/self/fd/%d", m->fd);
+    fd = open (p, (fcntl (m->fd, F_GETFL) & O_ACCMODE) | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    if (flock (fd, LOCK_SH) == 0)
+      dup3 (fd, m->fd, O_CLOEXEC);
+    close (fd);
+  }
+}
+
+/* Mark the region of m shared, taking its reference. Called with the lock
+ * held. Returns 0 on success, -1 with errno set otherwise.
+ */
+static int
+share (struct map *m)
+{
+  static int registered;
+  if (!registered)
+    {
+      pthread_atfork (NULL, NULL, child);
+      registered = 1;
+    }
+  if (m->lazy)
+    xmem_lazy_settle (m);
+/* The descriptor holds the flock, so it stays open from now on. A child
+ * can't share a region it inherited, whose file may not hold what it sees.
+ */
+  if (m->tier || (m->pid != xmem_pid && !m->shared && !m->named)
+      || xmem_keepfd (m) < 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  if (!m->shared && !m->named && flock (m->fd, LOCK_SH) < 0)
+    return -1;
+  m->shared = 1;
+  return 0;
+}
+
+/* Return a handle for the region at addr that xmem_import in another
+ * process maps, or NULL with errno set. CALLER'S RESPONSIBILITY TO FREE
+ * RESULT!
+ */
+char *
+xmem_export (void *addr)
+{
+  struct map *m;
+  char *h = NULL;
+  char fdpath[64];
+  omp_set_nest_lock (&lock);
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (!m)
+    errno = EINVAL;
+  else if (share (m) == 0)
+    {
+      if (m->path)
+        h = strdup (m->path);
+      else
+        {
+          snprintf (fdpath, sizeof (fdpath), "/proc/%d/fd/%d", (int) getpid (),
+                    m->fd);
+          h = strdup (fdpath);
+        }
+    }
+  omp_unset_nest_lock (&lock);
+  return h;
+}
+
+/* Send the region at addr over the connected Unix domain socket sock, to be
+ * mapped with xmem_import_fd. Returns 0 on success, -1 with errno set
+ * otherwise.
+ */
+int
+xmem_export_fd (void *addr, int sock)
+{
+  struct map *m;
+  struct msghdr msg;
+  struct cmsghdr *c;
+  struct iovec iov;
+  char buf[CMSG_SPACE (sizeof (int))];
+  char tag = 'x';
+  int fd = -1, j;
+
+  omp_set_nest_lock (&lock);
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (!m)
+    errno = EINVAL;
+  else if (share (m) == 0)
+    fd = dup (m->fd);
+  omp_unset_nest_lock (&lock);
+  if (fd < 0)
+    return -1;
+  memset (&msg, 0, sizeof (msg));
+  memset (buf, 0, sizeof (buf));
+  iov.iov_base = &tag;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof (buf);
+  c = CMSG_FIRSTHDR (&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN (sizeof (int));
+  memcpy (CMSG_DATA (c), &fd, sizeof (int));
+  j = sendmsg (sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+  close (fd);
+  return j;
+}
+
+/* Receive a descriptor sent by xmem_export_fd on sock. */
+static int
+receive (int sock)
+{
+  struct msghdr msg;
+  struct cmsghdr *c;
+  struct iovec iov;
+  char buf[CMSG_SPACE (sizeof (int))];
+  char tag;
+  int fd = -1;
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = &tag;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof (buf);
+  if (recvmsg (sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+    return -1;
+  c = CMSG_FIRSTHDR (&msg);
+  if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+    memcpy (&fd, CMSG_DATA (c), sizeof (int));
+  if (fd < 0)
+    errno = EBADMSG;
+  return fd;
+}
+
+/* Map the region exported as handle, or sent over sock when handle is
+ * NULL, for m, read-only with XMEM_IMPORT_RDONLY in flags. Sets m->addr,
+ * m->length, m->fd, m->path and m->shared. Returns 0 on success, -1 with
+ * errno set otherwise. Must be called with the lock held.
+ */
+int
+xmem_share_import (struct map *m, const char *handle, int sock, int flags)
+{
+  char p[XMEM_MAX_PATH_LEN];
+  struct stat st;
+  ssize_t n;
+  int rdonly = (flags & XMEM_IMPORT_RDONLY) != 0;
+  int fd, j;
+
+/* A received descriptor shares its open file (and flock) with the sender,
+ * so the region gets one of its own.
+ */
+  if (!handle)
+    {
+      fd = receive (sock);
+      if (fd < 0)
+        return -1;
+      snprintf (p, sizeof (p), "/proc/self/fd/%d", fd);
+      m->fd = open (p, (rdonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+      close (fd);
+    }
+  else
+    m->fd = open (handle, (rdonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+  if (m->fd < 0)
+    return -1;
+  if (flock (m->fd, LOCK_SH) < 0 || fstat (m->fd, &st) < 0)
+    goto fail;
+  m->length = st.st_size;
+  n = xmem_named_length (m->fd);
+  if (n > 0)
+    {
+      m->named = 1;
+      m->length = n;
+    }
+  if (m->length == 0)
+    {
+      errno = EINVAL;
+      goto fail;
+    }
+  m->addr = mmap (NULL, m->length, PROT_READ | (rdonly ? 0 : PROT_WRITE),
+                  MAP_SHARED, m->fd, 0);
+  if (m->addr == MAP_FAILED)
+    goto fail;
+/* The path the file has now, if it still has one, for removing it later. */
+  snprintf (p, sizeof (p), "/proc/self/fd/%d", m->fd);
+  if (st.st_nlink > 0)
+    {
+      m->path = (char *) uthash_malloc_ (XMEM_MAX_PATH_LEN);
+      n = m->path ? readlink (p, m->path, XMEM_MAX_PATH_LEN - 1) : -1;
+      if (n > 0)
+        m->path[n] = 0;
+      else if (m->path)
+        {
+          uthash_free_ (m->path);
+          m->path = NULL;
+        }
+    }
+  m->shared = 1;
+  return 0;
+
+fail:
+  j = errno;
+  close (m->fd);
+  m->fd = -1;
+  errno = j;
+  return -1;
+}
+
+/* Drop this process's reference to the shared region of m, which is no
+ * longer mapped, and remove its file if that was the last one. Must be
+ * called with the lock held.
+ */
+void
+xmem_share_drop (struct map *m)
+{
+  struct stat a, b;
+  int fd;
+
+  if (m->path && m->fd > -1)
+    {
+      fd = open (m->path, O_RDONLY | O_CLOEXEC);
+      if (fd > -1 && fstat (fd, &a) == 0 && fstat (m->fd, &b) == 0
+          && a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+        {
+          close (m->fd);
+          m->fd = -1;
+/* Someone else may have removed the file, and the name been reused, in
+ * between.
+ */
+          if (flock (fd, LOCK_EX | LOCK_NB) == 0 && stat (m->path, &b) == 0
+              && a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+            unlink (m->path);
+        }
+      if (fd > -1)
+        close (fd);
+    }
+  if (m->fd > -1)
+    close (m->fd);
+  if (m->path)
+    uthash_free_ (m->path);
+  m->fd = -1;
+  m->path = NULL;
+}
@@ -0,0 +1,332 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <omp.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * Streams read and write the backing file of a region with O_DIRECT, next to
+ * (not through) its mapping, so that one-pass scans of huge regions run at
+ * device speed without pushing everyone else's data out of the page cache.
+ *
+ * xmem_stream_read and xmem_stream_write transfer straight between the file
+ * and a caller buffer, which must be aligned to XMEM_STREAM_ALIGN, in
+ * multiples of XMEM_STREAM_ALIGN bytes. xmem_stream_next is double-buffered
+ * instead: it hands out the next XMEM_STREAM_BLOCK of the region from an
+ * internal buffer while the pool (see io.c) reads the block after it into
+ * the other one.
+ *
+ * The kernel keeps direct I/O coherent with the mapping: direct reads write
+ * back dirty cached pages first, and direct writes invalidate cached pages,
+ * so the mapping sees the new data on its next fault.
+ *
+ * Some file systems (tmpfs notably) refuse O_DIRECT. Streams then use an
+ * ordinary descriptor and drop the pages they read or write from the page
+ * cache with POSIX_FADV_DONTNEED.
+ */
+
+struct xmem_stream
+{
+  int fd;                       /* O_DIRECT (or fallback) descriptor */
+  int tail;                     /* Buffered descriptor for unaligned tails */
+  int direct;                   /* fd is O_DIRECT */
+  void *addr;                   /* Region address */
+  size_t length;                /* Region length */
+  off_t pos;                    /* Stream position */
+  char *buf[2];                 /* xmem_stream_next buffers */
+  off_t bpos[2];                /* File offset of each buffer */
+  ssize_t got[2];               /* Bytes in each buffer, -1 while filling */
+  int cur;                      /* Buffer handed out last */
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+};
+
+static ssize_t
+xfer (struct xmem_stream *s, char *buf, size_t n, off_t off, int write)
+{
+  ssize_t r, k = 0;
+  while ((size_t) k < n)
+    {
+      r = write ? pwrite (s->fd, buf + k, n - k, off + k)
+        : pread (s->fd, buf + k, n - k, off + k);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        break;
+      k += r;
+    }
+  if (!s->direct && k > 0)
+    posix_fadvise (s->fd, off, k, POSIX_FADV_DONTNEED);
+  return k > 0 || n == 0 ? k : -1;
+}
+
+/* Open a stream on the region at addr, positioned at its start. Returns NULL
+ * if addr is not the start of a file-backed region.
+ */
+struct xmem_stream *
+xmem_stream_open (void *addr)
+{
+  struct xmem_stream *s;
+  struct map *m;
+  char name[64];
+  int fd = -1;
+  size_t length = 0;
+
+  omp_set_nest_lock (&lock);
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (m)
+    {
+      fd = xmem_fd (m);
+      length = m->length;
+    }
+  omp_unset_nest_lock (&lock);
+  if (fd < 0)
+    return NULL;
+
+  s = (struct xmem_stream *) uthash_malloc_ (sizeof (struct xmem_stream));
+  if (!s)
+    {
+      close (fd);
+      return NULL;
+    }
+  memset (s, 0, sizeof (struct xmem_stream));
+  s->tail = fd;
+  s->addr = addr;
+  s->length = length;
+/* Reopen through /proc for a descriptor of our own that can be O_DIRECT;
+ * this works for unlinked backing files too.
+ */
+  snprintf (name, sizeof (name), "/proc/self/fd/%d", fd);
+  s->fd = open (name, O_RDWR | O_DIRECT | O_CLOEXEC);
+  s->direct = s->fd > -1;
+  if (s->fd < 0)
+    s->fd = open (name, O_RDWR | O_CLOEXEC);
+  if (s->fd < 0)
+    {
+      close (fd);
+      uthash_free_ (s);
+      return NULL;
+    }
+  s->got[0] = s->got[1] = 0;
+  s->cur = 1;
+  pthread_mutex_init (&s->mu, NULL);
+  pthread_cond_init (&s->cv, NULL);
+  return s;
+}
+
+/* Set the stream position. Returns the new position or -1. */
+off_t
+xmem_stream_seek (struct xmem_stream *s, off_t off)
+{
+  if (!s || off < 0 || (size_t) off > s->length)
+    return -1;
+  s->pos = off;
+  return off;
+}
+
+/* Read up to n bytes at the stream position into buf and advance. buf and n
+ * must be multiples of XMEM_STREAM_ALIGN, as must the position. Returns the
+ * number of bytes read, 0 at the end of the region, or -1 with errno set.
+ */
+ssize_t
+xmem_stream_read (struct xmem_stream *s, void *buf, size_t n)
+{
+  ssize_t k;
+  if (((uintptr_t) buf | n | (size_t) s->pos) & (XMEM_STREAM_ALIGN - 1))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  if (n > s->length - s->pos)
+    n = s->length - s->pos;
+  k = xfer (s, (char *) buf, (n + XMEM_STREAM_ALIGN - 1)
+            & ~((size_t) XMEM_STREAM_ALIGN - 1), s->pos, 0);
+  if (k > (ssize_t) n)
+    k = n;
+  if (k > 0)
+    s->pos += k;
+  return k;
+}
+
+/* Write up to n bytes from buf at the stream position and advance. The same
+ * alignment rules as for xmem_stream_read apply; writes are clipped to the
+ * region. Returns the number of bytes written or -1 with errno set.
+ */
+ssize_t
+xmem_stream_write (struct xmem_stream *s, const void *buf, size_t n)
+{
+  struct map *m;
+  size_t whole;
+  ssize_t k, r;
+  if (((uintptr_t) buf | n | (size_t) s->pos) & (XMEM_STREAM_ALIGN - 1))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  if (n > s->length - s->pos)
+    n = s->length - s->pos;
+/* Writes past the mapping leave no soft-dirty bits, see checkpoint.c. */
+  omp_set_nest_lock (&lock);
+  HASH_FIND_PTR (flexmap, &s->addr, m);
+  if (m)
+    m->fdirty = 1;
+  omp_unset_nest_lock (&lock);
+/* Direct writes come in whole alignment units, which could grow the file
+ * past the region. The last partial unit goes through the page cache.
+ */
+  whole = n & ~((size_t) XMEM_STREAM_ALIGN - 1);
+  xmem_compact_enter ();
+  k = xfer (s, (char *) buf, whole, s->pos, 1);
+  if (k == (ssize_t) whole && n > whole)
+    {
+      r = pwrite (s->tail, (const char *) buf + whole, n - whole,
+                  s->pos + whole);
+      if (r > 0)
+        k += r;
+    }
+  xmem_compact_leave ();
+  if (k > 0)
+    s->pos += k;
+  return k;
+}
+
+struct fill
+{
+  struct xmem_stream *s;
+  int b;
+};
+
+static void
+fill (void *arg, size_t i)
+{
+  struct fill *f = (struct fill *) arg;
+  struct xmem_stream *s = f->s;
+  ssize_t k = 0;
+  (void) i;
+  if ((size_t) s->bpos[f->b] < s->length)
+    k = xfer (s, s->buf[f->b], XMEM_STREAM_BLOCK, s->bpos[f->b], 0);
+  pthread_mutex_lock (&s->mu);
+  s->got[f->b] = k < 0 ? 0 : k;
+  pthread_cond_broadcast (&s->cv);
+  pthread_mutex_unlock (&s->mu);
+}
+
+static void
+fill_done (void *arg)
+{
+  uthash_free_ (arg);
+}
+
+/* Start reading the block at off into buffer b. */
+static void
+prefill (struct xmem_stream *s, int b, off_t off)
+{
+  struct fill *f = (struct fill *) uthash_malloc_ (sizeof (struct fill));
+  s->bpos[b] = off;
+  s->got[b] = -1;
+  if (f)
+    {
+      f->s = s;
+      f->b = b;
+      if (xmem_pool_async (fill, f, 1, fill_done) == 0)
+        return;
+      uthash_free_ (f);
+    }
+  s->got[b] = 0;
+}
+
+static void
+await (struct xmem_stream *s, int b)
+{
+  pthread_mutex_lock (&s->mu);
+  while (s->got[b] < 0)
+    pthread_cond_wait (&s->cv, &s->mu);
+  pthread_mutex_unlock (&s->mu);
+}
+
+/* Return the data from the stream position to the end of the current
+ * XMEM_STREAM_BLOCK, setting *n to its length, and advance past it. The data
+ * stay valid until the next call. Returns NULL at the end of the region.
+ */
+const void *
+xmem_stream_next (struct xmem_stream *s, size_t *n)
+{
+  off_t start, skip, end;
+  int b;
+
+  *n = 0;
+  if ((size_t) s->pos >= s->length)
+    return NULL;
+  if (!s->buf[0])
+    {
+      s->buf[0] = mmap (NULL, 2 * (size_t) XMEM_STREAM_BLOCK,
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+      if (s->buf[0] == MAP_FAILED)
+        {
+          s->buf[0] = NULL;
+          return NULL;
+        }
+      s->buf[1] = s->buf[0] + XMEM_STREAM_BLOCK;
+    }
+  start = s->pos & ~((off_t) XMEM_STREAM_BLOCK - 1);
+  b = 1 - s->cur;
+  await (s, b);
+  if (s->bpos[b] != start || s->got[b] == 0)
+    {
+/* Not what we prefetched (first call, or after a seek): read it now. */
+      s->bpos[b] = start;
+      s->got[b] = xfer (s, s->buf[b], XMEM_STREAM_BLOCK, start, 0);
+      if (s->got[b] < 0)
+        s->got[b] = 0;
+    }
+/* The other buffer is no longer handed out; fill it with the next block. */
+  await (s, s->cur);
+  prefill (s, s->cur, start + XMEM_STREAM_BLOCK);
+  s->cur = b;
+
+  end = start + s->got[b];
+  if ((size_t) end > s->length)
+    end = s->length;
+  skip = s->pos - start;
+  if (end <= s->pos)
+    return NULL;
+  *n = end - s->pos;
+  s->pos = end;
+  return s->buf[b] + skip;
+}
+
+/* Close a stream. */
+void
+xmem_stream_close (struct xmem_stream *s)
+{
+  if (!s)
+    return;
+  await (s, 0);
+  await (s, 1);
+  if (s->buf[0])
+    munmap (s->buf[0], 2 * (size_t) XMEM_STREAM_BLOCK);
+  close (s->fd);
+  close (s->tail);
+  pthread_mutex_destroy (&s->mu);
+  pthread_cond_destroy (&s->cv);
+  uthash_free_ (s);
+}
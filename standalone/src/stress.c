@@ -0,0 +1,421 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "xmem_api.h"
+
+/* NOTES
+ *
+ * Allocation storm and fork fan-out under LD_PRELOAD=libxmem.so, see
+ * "make stress". For 1, 2, 4, ... up to -t threads, every thread does -n
+ * operations on its own SLOTS live blocks: malloc, realloc, free and memcpy
+ * between two of them, with sizes spread log-uniformly over a quarter to
+ * four times the threshold (-s), so that blocks keep crossing it. Meanwhile
+ * another thread forks -f children at a time; each child writes to and
+ * reallocates a region inherited from the parent, allocates and frees a few
+ * of its own and exits, like forktest.R.
+ *
+ * For each run it reports the throughput, the latency percentiles of single
+ * operations, fork latency, corrupted blocks (every block carries a tag at
+ * both ends), backing files left behind in the directory (-d, a new one by
+ * default) once everything is freed, and, if libxmem.so was built with
+ * XMEM_LOCKSTAT (make LOCKSTAT=1, as make stress does), how long the library
+ * lock was held and waited for. Latencies go to log-linear histograms, good
+ * to 1/8 of a power of two, kept off the heap. The random sequence is fixed
+ * by -r.
+ *
+ * The exit status is 1 if anything was corrupted or leaked.
+ */
+
+#define SLOTS 8
+#define SUB 8                           /* Histogram buckets per power of 2 */
+#define BUCKETS (64 * SUB)
+
+struct worker
+{
+  pthread_t t;
+  int id;
+  unsigned int seed;
+  char *p[SLOTS];
+  size_t n[SLOTS];
+  unsigned long long *hist;
+  unsigned long long errors;
+};
+
+static size_t threshold = 65536;
+static long ops = 20000;
+static int fanout = 8;
+static volatile int done;
+static unsigned long long forks, fork_ns, fork_max, fork_errors;
+
+static size_t (*set_threshold) (size_t);
+static int (*set_path) (char *);
+static int (*lockstat) (struct xmem_lockstat *, int);
+
+static unsigned long long
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return (unsigned long long) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static int
+bucket (unsigned long long ns)
+{
+  int k;
+  if (ns < SUB)
+    return (int) ns;
+  k = 63 - __builtin_clzll (ns);
+  return (k - 2) * SUB + (int) ((ns >> (k - 3)) & (SUB - 1));
+}
+
+/* The largest latency in bucket b. */
+static unsigned long long
+upper (int b)
+{
+  int k = b / SUB + 2;
+  if (b < SUB)
+    return b;
+  return ((unsigned long long) (SUB + b % SUB + 1) << (k - 3)) - 1;
+}
+
+/* The latency at or below which fraction f of the n samples of h fall. */
+static unsigned long long
+percentile (unsigned long long *h, unsigned long long n, double f)
+{
+  unsigned long long k = 0;
+  int b;
+  for (b = 0; b < BUCKETS; ++b)
+    if ((k += h[b]) >= f * n)
+      return upper (b);
+  return upper (BUCKETS - 1);
+}
+
+static size_t
+size (unsigned int *seed)
+{
+  double r = (double) rand_r (seed) / RAND_MAX;
+  return (size_t) ((double) threshold / 4 * (1 << (int) (4 * r))
+                   * (1 + (4 * r - (int) (4 * r))));
+}
+
+static void
+tag (struct worker *w, int j)
+{
+  unsigned char c = (unsigned char) (w->id * SLOTS + j + 1);
+  w->p[j][0] = c;
+  w->p[j][w->n[j] - 1] = c;
+}
+
+static void
+check (struct worker *w, int j)
+{
+  unsigned char c = (unsigned char) (w->id * SLOTS + j + 1);
+  if ((unsigned char) w->p[j][0] != c
+      || (unsigned char) w->p[j][w->n[j] - 1] != c)
+    w->errors++;
+}
+
+static void *
+work (void *arg)
+{
+  struct worker *w = (struct worker *) arg;
+  unsigned long long t;
+  size_t n;
+  long i;
+  int j, k, op;
+  char *x;
+
+  for (i = 0; i < ops; ++i)
+    {
+      j = rand_r (&w->seed) % SLOTS;
+      op = rand_r (&w->seed) % 10;
+      n = size (&w->seed);
+      t = now ();
+      if (!w->p[j])
+        {
+          w->p[j] = malloc (n);
+          if (w->p[j])
+            {
+              w->n[j] = n;
+              tag (w, j);
+            }
+          else
+            w->errors++;
+        }
+      else if (op < 3)
+        {
+          check (w, j);
+          x = realloc (w->p[j], n);
+          if (x)
+            {
+              w->p[j] = x;
+              if ((unsigned char) x[0] != (unsigned char) (w->id * SLOTS + j + 1))
+                w->errors++;
+              w->n[j] = n;
+              tag (w, j);
+            }
+          else
+            w->errors++;
+        }
+      else if (op < 5 && w->p[k = (j + 1) % SLOTS])
+        {
+          memcpy (w->p[k], w->p[j], w->n[j] < w->n[k] ? w->n[j] : w->n[k]);
+          tag (w, k);
+        }
+      else
+        {
+          check (w, j);
+          free (w->p[j]);
+          w->p[j] = NULL;
+        }
+      w->hist[bucket (now () - t)]++;
+    }
+  for (j = 0; j < SLOTS; ++j)
+    if (w->p[j])
+      {
+        check (w, j);
+        free (w->p[j]);
+        w->p[j] = NULL;
+      }
+  return NULL;
+}
+
+/* What a child does with the region x of n bytes it inherited. */
+static int
+child (char *x, size_t n, unsigned int seed)
+{
+  char *y;
+  int j;
+  x[0] = 1;
+  x = realloc (x, 2 * n);
+  if (!x || x[n - 1] != 7)
+    return 1;
+  x[2 * n - 1] = 7;
+  for (j = 0; j < 4; ++j)
+    {
+      y = malloc (size (&seed));
+      if (!y)
+        return 1;
+      y[0] = 1;
+      free (y);
+    }
+  free (x);
+  return 0;
+}
+
+static void *
+fan (void *arg)
+{
+  size_t n = 2 * threshold;
+  unsigned int seed = 1;
+  unsigned long long t;
+  pid_t pid[64];
+  char *x;
+  int j, k, s;
+  (void) arg;
+
+  x = malloc (n);
+  if (!x)
+    return NULL;
+  memset (x, 7, n);
+  while (!done)
+    {
+      for (k = 0; k < fanout && !done; ++k)
+        {
+          t = now ();
+          pid[k] = fork ();
+          if (pid[k] == 0)
+            _exit (child (x, n, seed + k));
+          t = now () - t;
+          if (pid[k] < 0)
+            {
+              fork_errors++;
+              break;
+            }
+          forks++;
+          fork_ns += t;
+          if (t > fork_max)
+            fork_max = t;
+        }
+      for (j = 0; j < k; ++j)
+        if (waitpid (pid[j], &s, 0) < 0 || !WIFEXITED (s) || WEXITSTATUS (s))
+          fork_errors++;
+      seed += k;
+    }
+  free (x);
+  return NULL;
+}
+
+/* Files in directory d, but for . and .. */
+static int
+files (const char *d)
+{
+  DIR *dir = opendir (d);
+  struct dirent *e;
+  int n = 0;
+  if (!dir)
+    return -1;
+  while ((e = readdir (dir)))
+    n += strcmp (e->d_name, ".") && strcmp (e->d_name, "..");
+  closedir (dir);
+  return n;
+}
+
+static int
+run (int nthreads, unsigned int seed, const char *dir)
+{
+  struct worker *w;
+  struct xmem_lockstat ls;
+  unsigned long long h[BUCKETS], all = 0, errors = 0, t;
+  pthread_t f;
+  int j, b, leaked = files (dir);
+
+  w = mmap (NULL, nthreads * (sizeof (struct worker)
+                              + BUCKETS * sizeof (unsigned long long)),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (w == MAP_FAILED)
+    return -1;
+  memset (h, 0, sizeof (h));
+  forks = fork_ns = fork_max = fork_errors = 0;
+  done = 0;
+  if (lockstat)
+    lockstat (NULL, 1);
+  t = now ();
+  if (fanout)
+    pthread_create (&f, NULL, fan, NULL);
+  for (j = 0; j < nthreads; ++j)
+    {
+      w[j].id = j;
+      w[j].seed = seed + j;
+      w[j].hist = (unsigned long long *) (w + nthreads) + j * BUCKETS;
+      pthread_create (&w[j].t, NULL, work, &w[j]);
+    }
+  for (j = 0; j < nthreads; ++j)
+    {
+      pthread_join (w[j].t, NULL);
+      errors += w[j].errors;
+      for (b = 0; b < BUCKETS; ++b)
+        h[b] += w[j].hist[b];
+    }
+  t = now () - t;
+  done = 1;
+  if (fanout)
+    pthread_join (f, NULL);
+  if (lockstat && lockstat (&ls, 0) < 0)
+    memset (&ls, 0, sizeof (ls));
+  leaked = files (dir) - leaked;
+  all = (unsigned long long) nthreads * ops;
+
+  printf ("%4d %10.0f %8.1f %8.1f %8.1f %9.1f %6llu %8.1f %3llu %4d",
+          nthreads, all / (t / 1e9), percentile (h, all, 0.5) / 1e3,
+          percentile (h, all, 0.99) / 1e3, percentile (h, all, 0.999) / 1e3,
+          percentile (h, all, 1.0) / 1e3, forks,
+          forks ? fork_ns / forks / 1e3 : 0.0, errors + fork_errors, leaked);
+  if (lockstat && ls.holds)
+    printf (" %9.2f %9.1f %9.1f %9.1f",
+            (double) ls.hold_ns / t * 100, (double) ls.hold_ns / ls.holds,
+            ls.max_hold_ns / 1e3, ls.max_wait_ns / 1e3);
+  printf ("\n");
+  fflush (stdout);
+  munmap (w, nthreads * (sizeof (struct worker)
+                         + BUCKETS * sizeof (unsigned long long)));
+  return errors + fork_errors || leaked ? 1 : 0;
+}
+
+static void
+usage ()
+{
+  fprintf (stderr, "usage: stress [-t max threads (128)] [-n ops per thread "
+           "(20000)]\n              [-s threshold (65536)] [-f children per "
+           "fork round (8)]\n              [-d backing file directory] "
+           "[-r seed (1)]\n");
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  char dir[4096] = "";
+  char tmp[] = "/tmp/xmem_stressXXXXXX";
+  int max = 128, seed = 1, made = 0, c, j, status = 0;
+
+  while ((c = getopt (argc, argv, "t:n:s:f:d:r:")) != -1)
+    switch (c)
+      {
+      case 't': max = atoi (optarg); break;
+      case 'n': ops = atol (optarg); break;
+      case 's': threshold = strtoul (optarg, NULL, 10); break;
+      case 'f': fanout = atoi (optarg); break;
+      case 'd': snprintf (dir, sizeof (dir), "%s", optarg); break;
+      case 'r': seed = atoi (optarg); break;
+      default: usage ();
+      }
+  if (max < 1 || ops < 1 || threshold < 64 || fanout < 0 || fanout > 64)
+    usage ();
+
+  set_threshold = (size_t (*)(size_t)) dlsym (RTLD_DEFAULT,
+                                              "xmem_set_threshold");
+  set_path = (int (*)(char *)) dlsym (RTLD_DEFAULT, "xmem_set_path");
+  lockstat = (int (*)(struct xmem_lockstat *, int))
+    dlsym (RTLD_DEFAULT, "xmem_lockstat");
+  if (!set_threshold || !set_path)
+    {
+      fprintf (stderr, "stress: run with LD_PRELOAD=libxmem.so\n");
+      return 2;
+    }
+  if (!*dir)
+    {
+      if (!mkdtemp (tmp))
+        {
+          perror ("stress");
+          return 2;
+        }
+      strcpy (dir, tmp);
+      made = 1;
+    }
+  if (set_path (dir) < 0)
+    {
+      fprintf (stderr, "stress: bad directory %s\n", dir);
+      return 2;
+    }
+  set_threshold (threshold);
+  if (lockstat && lockstat (NULL, 1) < 0)
+    lockstat = NULL;
+
+  printf ("threshold %lu, %ld ops per thread, %d children per fork round, "
+          "files in %s\n", (unsigned long) threshold, ops, fanout, dir);
+  printf ("thr      ops/s  p50(us)  p99(us) p999(us)   max(us)  forks "
+          "fork(us) bad leak%s\n",
+          lockstat ? "  lock(%)  hold(ns)  maxhold(us) maxwait(us)" : "");
+  for (j = 1;; j = 2 * j < max ? 2 * j : max)
+    {
+      status |= run (j, seed, dir);
+      if (j == max)
+        break;
+    }
+  if (!lockstat)
+    printf ("(lock statistics need a library built with make LOCKSTAT=1)\n");
+  if (made && files (dir) == 0)
+    rmdir (dir);
+  return status;
+}
@@ -0,0 +1,188 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * A backing file lives in one directory, so one region gets the bandwidth
+ * of one device. With striping on (xmem_set_stripe) file-backed regions
+ * larger than the chunk size are made of chunk files instead, spread round
+ * robin over a list of directories, presumably on different devices, and
+ * mapped back to back with MAP_FIXED into one range reserved up front. A
+ * sequential scan then reads from all the devices in turn, and with
+ * readahead from several at once.
+ *
+ * Chunk files are always anonymous (O_TMPFILE, or unlinked right after
+ * creation) and their descriptors are closed once they are mapped, so the
+ * region needs no bookkeeping beyond m->striped and goes away with its
+ * mapping. Striped regions therefore have no m->fd, and the features that
+ * work on the backing file (the residency governor, compaction, prefetch,
+ * export, copy-on-write children) leave them alone; realloc moves them.
+ */
+
+#define XMEM_STRIPE_DIRS 16
+
+static char dirs[XMEM_STRIPE_DIRS][XMEM_MAX_PATH_LEN];
+static int ndirs;
+static int next;                /* Directory of the next region's first chunk */
+
+/* Create an anonymous chunk file in directory d. */
+static int
+chunk_file (const char *d)
+{
+  char name[XMEM_MAX_PATH_LEN];
+  const char *s;
+  int fd;
+#ifdef O_TMPFILE
+  fd = open (d, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd > -1)
+    return fd;
+#endif
+  s = strrchr (xmem_fname_template, '/');
+  s = s ? s + 1 : xmem_fname_template;
+  if (snprintf (name, sizeof (name), "%s/%s", d, s) >= (int) sizeof (name))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  fd = mkostemp (name, O_RDWR | O_CREAT | O_CLOEXEC);
+  if (fd > -1)
+    unlink (name);
+  return fd;
+}
+
+/* Returns nonzero if a file-backed region of n bytes should be striped. */
+int
+xmem_stripe_wanted (size_t n)
+{
+  return ndirs > 0 && n > xmem_stripe_chunk;
+}
+
+/* Map m->length bytes of chunk files for m with the given madvise advice,
+ * and transparent huge pages if huge is set, and set m->addr and
+ * m->striped. Unless zero is set the chunks are preallocated as
+ * xmem_prealloc says. Returns 0 on success, -1 with errno set and nothing
+ * left behind otherwise. Must be called with the lock held.
+ */
+int
+xmem_stripe_map (struct map *m, int zero, int advice, int huge)
+{
+  size_t off, n;
+  char *p;
+  void *q;
+  int fd, j, d = next;
+
+  p = mmap (NULL, m->length, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    return -1;
+  for (off = 0; off < m->length; off += n)
+    {
+      n = m->length - off;
+      if (n > xmem_stripe_chunk)
+        n = xmem_stripe_chunk;
+      fd = chunk_file (dirs[d]);
+      if (fd < 0)
+        goto fail;
+      q = MAP_FAILED;
+      if (ftruncate (fd, n) == 0
+          && (zero || xmem_prealloc == XMEM_PREALLOC_SPARSE
+              || xmem_io_reserve (fd, 0, n,
+                                  xmem_prealloc == XMEM_PREALLOC_FULL ? n
+                                  : XMEM_PREALLOC_CHUNK_SIZE) == 0))
+        q = mmap (p + off, n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                  fd, 0);
+      j = errno;
+      close (fd);
+      errno = j;
+      if (q == MAP_FAILED)
+        goto fail;
+      d = (d + 1) % ndirs;
+    }
+  next = (next + 1) % ndirs;
+  madvise (p, m->length, advice);
+#ifdef MADV_HUGEPAGE
+  if (huge)
+    madvise (p, m->length, MADV_HUGEPAGE);
+#endif
+  m->addr = p;
+  m->striped = (m->length + xmem_stripe_chunk - 1) / xmem_stripe_chunk;
+  return 0;
+
+fail:
+  j = errno;
+  munmap (p, m->length);
+  errno = j;
+  return -1;
+}
+
+/* Stripe file-backed regions larger than chunk bytes over the directories
+ * in the colon-separated list dirs. An empty list turns striping off, NULL
+ * leaves the list as it is, and a chunk of 0 leaves the chunk size, which
+ * is rounded up to a page. Returns the number of directories in use, or -1
+ * with errno set if a directory is unusable or the list too long, in which
+ * case nothing changes.
+ */
+int
+xmem_set_stripe (const char *list, size_t chunk)
+{
+  char d[XMEM_STRIPE_DIRS][XMEM_MAX_PATH_LEN];
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  const char *s, *e;
+  struct stat st;
+  int n = 0, j;
+
+  if (list)
+    for (s = list; *s; s = *e ? e + 1 : e)
+      {
+        e = strchrnul (s, ':');
+        if (e == s)
+          continue;
+        if (n == XMEM_STRIPE_DIRS || e - s >= XMEM_MAX_PATH_LEN)
+          {
+            errno = n == XMEM_STRIPE_DIRS ? E2BIG : ENAMETOOLONG;
+            return -1;
+          }
+        memcpy (d[n], s, e - s);
+        d[n][e - s] = 0;
+        if (stat (d[n], &st) < 0)
+          return -1;
+        if (!S_ISDIR (st.st_mode))
+          {
+            errno = ENOTDIR;
+            return -1;
+          }
+        ++n;
+      }
+  omp_set_nest_lock (&lock);
+  if (list)
+    {
+      for (j = 0; j < n; ++j)
+        strcpy (dirs[j], d[j]);
+      ndirs = n;
+      next = 0;
+    }
+  if (chunk > 0)
+    xmem_stripe_chunk = (chunk + pg - 1) & ~(pg - 1);
+  n = ndirs;
+  omp_unset_nest_lock (&lock);
+  return n;
+}
@@ -21,6 +21,12 @@ main (int argc, void **argv)
   size_t SIZE = 1000000;
 
   size_t (*set_threshold) (size_t);
+  size_t (*set_cache) (size_t);
+  void (*free_sized) (void *, size_t);
+  int (*set_tier) (int);
+  size_t (*tier_evict) (void);
+  char *c;
+  size_t k, pg = (size_t) sysconf (_SC_PAGESIZE);
   void *handle;
   handle = dlopen (NULL, RTLD_LAZY);
   if (!handle) return -1;
@@ -29,6 +35,62 @@ main (int argc, void **argv)
   if ((derror = dlerror ()) == NULL)  (*set_threshold) (SIZE);
   dlclose (handle);
 
+/* Regions are rounded up to a size class with the cache on, and sized free
+ * (C++ sized delete) must still find them, also when reused for a smaller
+ * request of the same class.
+ */
+  printf ("> sized free with the cache on\n");
+  handle = dlopen (NULL, RTLD_LAZY);
+  dlerror ();
+  set_cache = (size_t (*)(size_t ))dlsym(handle, "xmem_set_cache");
+  free_sized = (void (*)(void *, size_t ))dlsym(handle, "xmem_free_sized");
+  if ((derror = dlerror ()) == NULL)
+  {
+    (*set_cache) (1 << 30);
+    x = malloc (SIZE + 100000);
+    memcpy (x, (const void *) y, strlen (y));
+    (*free_sized) (x, SIZE + 100000);
+    x = malloc (SIZE + 99000);
+    memcpy (x, (const void *) y, strlen (y));
+    (*free_sized) (x, SIZE + 99000);
+    (*set_cache) (0);
+  }
+  dlclose (handle);
+  printf ("> (press a key to continue)\n");
+  getc (stdin);
+
+/* Compressed tier chunks must read back what was written to them once they
+ * have been evicted and faulted back in, and a page the program drops from
+ * a chunk that is in must fault back in as zeros. Skipped when the library
+ * was built without a compressor (tier 1 is XMEM_TIER_COMPRESSED).
+ */
+  printf ("> compressed tier eviction\n");
+  handle = dlopen (NULL, RTLD_LAZY);
+  dlerror ();
+  set_tier = (int (*)(int ))dlsym(handle, "xmem_set_tier");
+  tier_evict = (size_t (*)(void ))dlsym(handle, "xmem_tier_evict");
+  if ((derror = dlerror ()) == NULL && (*set_tier) (1) == 1)
+  {
+    c = malloc (4 * SIZE);
+    for (k = 0; k < 4 * SIZE; ++k)
+      c[k] = (char) (k % 251);
+/* The first sweep only clears the reference bits. */
+    (*tier_evict) ();
+    if ((*tier_evict) () == 0)
+      return 1;
+    for (k = 0; k < 4 * SIZE; ++k)
+      if (c[k] != (char) (k % 251))
+        return 1;
+    madvise (c + 2 * pg, pg, MADV_DONTNEED);
+    if (c[2 * pg] != 0 || c[2 * pg - 1] != (char) ((2 * pg - 1) % 251))
+      return 1;
+    free (c);
+    (*set_tier) (0);
+  }
+  dlclose (handle);
+  printf ("> (press a key to continue)\n");
+  getc (stdin);
+
   printf ("> malloc below threshold\n");
   x = malloc (SIZE - 1);
   memcpy (x, (const void *) y, strlen (y));
@@ -75,6 +137,14 @@ main (int argc, void **argv)
   getc (stdin);
   free (x);
 
+  printf ("> malloc above threshold + realloc below threshold\n");
+  x = malloc (SIZE + 1);
+  memcpy (x, (const void *) y, strlen (y) + 1);
+  x = realloc (x, 4096);
+  printf ("> %s (press a key to continue)\n", (char *) x);
+  getc (stdin);
+  free (x);
+
 
   return 0;
 }
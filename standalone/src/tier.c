@@ -0,0 +1,585 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <omp.h>
+#include <linux/userfaultfd.h>
+
+#if defined(XMEM_ZSTD)
+#include <zstd.h>
+#define COMPRESS_BOUND(n) ZSTD_compressBound (n)
+#define COMPRESS(dst, cap, src, n) ZSTD_compress (dst, cap, src, n, 1)
+#define COMPRESS_ERROR(r) ZSTD_isError (r)
+#define DECOMPRESS(dst, cap, src, n) ZSTD_decompress (dst, cap, src, n)
+#define DECOMPRESS_ERROR(r) ZSTD_isError (r)
+#elif defined(XMEM_LZ4)
+#include <lz4.h>
+#define COMPRESS_BOUND(n) ((size_t) LZ4_compressBound ((int) (n)))
+#define COMPRESS(dst, cap, src, n) \
+  ((size_t) LZ4_compress_default (src, dst, (int) (n), (int) (cap)))
+#define COMPRESS_ERROR(r) ((r) == 0)
+#define DECOMPRESS(dst, cap, src, n) \
+  ((size_t) LZ4_decompress_safe (src, dst, (int) (n), (int) (cap)))
+#define DECOMPRESS_ERROR(r) ((ssize_t) (r) < 0)
+#endif
+#if defined(XMEM_ZSTD) || defined(XMEM_LZ4)
+#define XMEM_COMPRESS
+#endif
+
+#include "uthash.h"
+#include "xmem.h"
+
+/* NOTES
+ *
+ * The compressed tier keeps a region in anonymous private memory registered
+ * with userfaultfd, and moves its cold chunks (XMEM_TIER_CHUNK bytes each)
+ * out to a per-process chunk store file in compressed form.
+ *
+ * A chunk is tracked as a whole, present or not, though the program may drop
+ * pages of a present chunk (MADV_DONTNEED), which then fault in as zeros.
+ * Missing chunks that were never evicted are filled with the zero page on
+ * first touch; evicted chunks are read from the store, decompressed and
+ * copied back in by a handler thread that services the userfaultfd. Store space of a chunk is
+ * released with FALLOC_FL_PUNCH_HOLE as soon as it is faulted back in. A
+ * chunk that can't be read back or decompressed comes back as zeros, with a
+ * message on stderr, rather than leave the faulting thread waiting forever.
+ *
+ * Coldness is tracked CLOCK style: a chunk's reference bit is set when it is
+ * faulted in, and a sweep clears the bit of referenced chunks and evicts the
+ * rest. A chunk that is in use but doesn't fault thus survives one sweep.
+ * Sweeps run every xmem_tier_interval milliseconds on the handler thread, or
+ * on demand with xmem_tier_evict.
+ *
+ * Eviction write-protects the chunk (userfaultfd WP) before compressing it so
+ * that concurrent writers wait instead of losing their writes, drops the
+ * pages with MADV_DONTNEED and finally lifts the protection, which wakes the
+ * writers up to take an ordinary missing-page fault.
+ *
+ * Userfaultfd registrations are not inherited across fork, so evicted chunks
+ * would read as zeros in a child. A pthread_atfork prepare handler therefore
+ * brings all evicted chunks back in before fork. Children see their tier
+ * regions as plain memory.
+ *
+ * The tier state is protected by its own mutex, never by the global lock: a
+ * thread that holds the global lock may fault on a tier region and needs the
+ * handler thread to make progress. Where both are needed the global lock is
+ * taken first.
+ */
+
+int xmem_tier = XMEM_TIER_FILE;
+int xmem_tier_interval = 0;
+
+#ifdef XMEM_COMPRESS
+
+#define CHUNK_MISSING 0         /* Never touched, reads as zeros */
+#define CHUNK_PRESENT 1
+#define CHUNK_EVICTED 2         /* In the chunk store */
+
+struct chunk
+{
+  off_t off;                    /* Store offset */
+  unsigned int clen;            /* Compressed length, 0 if stored raw */
+  unsigned char state;
+  unsigned char ref;            /* CLOCK reference bit */
+};
+
+struct tier
+{
+  char *addr;
+  size_t length;                /* Mapped length, a page multiple */
+  size_t nchunks;
+  struct chunk *chunks;
+  int inherited;                /* Created before fork by a parent */
+  struct tier *next;
+};
+
+static pthread_mutex_t tlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tonce = PTHREAD_ONCE_INIT;
+static pthread_t handler;
+static int uffd = -1;
+static int store = -1;
+static off_t store_end;
+static struct tier *regions;
+static char *cbuf, *dbuf;       /* Compression scratch buffers */
+static size_t cbuf_len;
+
+static size_t
+chunk_len (struct tier *t, size_t c)
+{
+  size_t off = c * XMEM_TIER_CHUNK;
+  return t->length - off < XMEM_TIER_CHUNK ? t->length - off : XMEM_TIER_CHUNK;
+}
+
+static struct tier *
+find (unsigned long addr)
+{
+  struct tier *t;
+  for (t = regions; t; t = t->next)
+    if (addr >= (unsigned long) t->addr
+        && addr < (unsigned long) t->addr + t->length)
+      return t;
+  return NULL;
+}
+
+static void
+punch (struct chunk *c)
+{
+  size_t n = c->clen ? c->clen : XMEM_TIER_CHUNK;
+  fallocate (store, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, c->off, n);
+}
+
+/* Map len bytes at a with the data at src, or with the zero page if src is
+ * NULL. mode is 0 or UFFDIO_COPY_MODE_DONTWAKE (the same bit as
+ * UFFDIO_ZEROPAGE_MODE_DONTWAKE). Returns 0 on success, -1 with errno set
+ * (EEXIST if some of the pages are there already) otherwise.
+ */
+static int
+place (unsigned long a, size_t len, char *src, int mode)
+{
+  struct uffdio_copy cp;
+  struct uffdio_zeropage zp;
+  if (!src)
+    {
+      zp.range.start = a;
+      zp.range.len = len;
+      zp.mode = mode;
+      return ioctl (uffd, UFFDIO_ZEROPAGE, &zp);
+    }
+  cp.dst = a;
+  cp.src = (unsigned long) src;
+  cp.len = len;
+  cp.mode = mode;
+  return ioctl (uffd, UFFDIO_COPY, &cp);
+}
+
+/* Bring chunk c of t back in and wake up threads waiting on it. Called with
+ * tlock held.
+ *
+ * A chunk is placed whole where it can be. A missing-page fault on a present
+ * chunk, whose pages the program dropped (MADV_DONTNEED) or of which only
+ * some were placed before, gets the pages still missing one by one instead;
+ * they read as zeros, as dropped anonymous pages do.
+ */
+static void
+fill (struct tier *t, size_t c)
+{
+  struct uffdio_range r;
+  struct chunk *k = &t->chunks[c];
+  size_t len = chunk_len (t, c);
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  size_t off;
+  char *src = NULL;
+  int j = -1;
+
+  r.start = (unsigned long) t->addr + c * XMEM_TIER_CHUNK;
+  r.len = len;
+  if (k->state == CHUNK_EVICTED)
+    {
+      size_t n = len;
+      if (k->clen)
+        {
+          n = 0;
+          if (pread (store, cbuf, k->clen, k->off) == (ssize_t) k->clen)
+            n = DECOMPRESS (dbuf, XMEM_TIER_CHUNK, cbuf, k->clen);
+          if (DECOMPRESS_ERROR (n))
+            n = 0;
+        }
+      else if (pread (store, dbuf, len, k->off) != (ssize_t) len)
+        n = 0;
+      if (n == len)
+        src = dbuf;
+      else
+/* The chunk can't be read back. The threads waiting on it must not hang,
+ * so they get zeros, and the loss is reported.
+ */
+        fprintf (stderr, "xmem: lost %lu bytes at %p of a compressed "
+                 "region\n", (unsigned long) len, (void *) r.start);
+    }
+  if (k->state != CHUNK_PRESENT)
+    j = place (r.start, len, src, 0);
+  if (j < 0)
+    {
+      j = 0;
+      for (off = 0; off < len; off += pg)
+        if (place (r.start + off, pg, src ? src + off : NULL,
+                   UFFDIO_COPY_MODE_DONTWAKE) < 0 && errno != EEXIST)
+          j = -1;
+      ioctl (uffd, UFFDIO_WAKE, &r);
+    }
+/* A chunk that couldn't be placed stays as it was, and the next fault on it
+ * tries again.
+ */
+  if (j < 0)
+    return;
+  if (k->state == CHUNK_EVICTED)
+    punch (k);
+  k->state = CHUNK_PRESENT;
+  k->ref = 1;
+}
+
+/* Compress chunk c of t into the store and drop its pages. Returns the
+ * number of bytes evicted. Called with tlock held.
+ */
+static size_t
+evict (struct tier *t, size_t c)
+{
+  struct uffdio_writeprotect wp;
+  struct chunk *k = &t->chunks[c];
+  size_t len = chunk_len (t, c);
+  size_t n;
+  char *p = t->addr + c * XMEM_TIER_CHUNK;
+
+  wp.range.start = (unsigned long) p;
+  wp.range.len = len;
+  wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+  if (ioctl (uffd, UFFDIO_WRITEPROTECT, &wp) < 0)
+    return 0;
+  n = COMPRESS (cbuf, cbuf_len, p, len);
+  if (COMPRESS_ERROR (n) || n >= len)
+    {
+      k->clen = 0;
+      n = pwrite (store, p, len, store_end) == (ssize_t) len ? len : 0;
+    }
+  else
+    {
+      k->clen = (unsigned int) n;
+      if (pwrite (store, cbuf, n, store_end) != (ssize_t) n)
+        n = 0;
+    }
+  if (n > 0)
+    {
+      k->off = store_end;
+      store_end += (n + 4095) & ~((off_t) 4095);
+      madvise (p, len, MADV_DONTNEED);
+      k->state = CHUNK_EVICTED;
+    }
+  wp.mode = 0;
+  ioctl (uffd, UFFDIO_WRITEPROTECT, &wp);
+  return n > 0 ? len : 0;
+}
+
+/* One CLOCK pass over all tier regions. Returns the number of bytes evicted.
+ */
+size_t
+xmem_tier_sweep ()
+{
+  struct tier *t;
+  size_t c, n = 0;
+  pthread_mutex_lock (&tlock);
+  if (uffd > -1)
+    for (t = regions; t; t = t->next)
+      {
+        if (t->inherited)
+          continue;
+        for (c = 0; c < t->nchunks; ++c)
+          {
+            if (t->chunks[c].state != CHUNK_PRESENT)
+              continue;
+            if (t->chunks[c].ref)
+              t->chunks[c].ref = 0;
+            else
+              n += evict (t, c);
+          }
+      }
+  pthread_mutex_unlock (&tlock);
+  return n;
+}
+
+static void *
+handle (void *arg)
+{
+  struct uffd_msg msg[16];
+  struct uffdio_writeprotect wp;
+  struct pollfd p;
+  struct tier *t;
+  ssize_t n;
+  int j, timeout;
+  unsigned long a;
+  (void) arg;
+
+  p.fd = uffd;
+  p.events = POLLIN;
+  for (;;)
+    {
+      timeout = xmem_tier_interval > 0 ? xmem_tier_interval : -1;
+      j = poll (&p, 1, timeout);
+      if (j == 0)
+        {
+          xmem_tier_sweep ();
+          continue;
+        }
+      if (j < 0)
+        continue;
+      n = read (uffd, msg, sizeof (msg));
+      if (n <= 0)
+        continue;
+      pthread_mutex_lock (&tlock);
+      for (j = 0; j < n / (ssize_t) sizeof (struct uffd_msg); ++j)
+        {
+          if (msg[j].event != UFFD_EVENT_PAGEFAULT)
+            continue;
+          a = (unsigned long) msg[j].arg.pagefault.address;
+          if (msg[j].arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)
+            {
+/* A write to a chunk that was being evicted. evict has lifted the
+ * protection since, which woke the writer; lifting it here too wakes it in
+ * case it came in late. If its page is gone it takes a missing-page fault
+ * next.
+ */
+              wp.range.len = sysconf (_SC_PAGESIZE);
+              wp.range.start = a & ~(wp.range.len - 1);
+              wp.mode = 0;
+              ioctl (uffd, UFFDIO_WRITEPROTECT, &wp);
+              continue;
+            }
+          t = find (a);
+          if (!t)
+            continue;
+          fill (t, (a - (unsigned long) t->addr) / XMEM_TIER_CHUNK);
+        }
+      pthread_mutex_unlock (&tlock);
+    }
+  return NULL;
+}
+
+/* Fork handlers, see the notes above. */
+static void
+prepare ()
+{
+  struct tier *t;
+  size_t c;
+/* Our prepare handler runs before the one in xmem.c, which takes the global
+ * lock; take it here first to keep the lock order.
+ */
+  omp_set_nest_lock (&lock);
+  pthread_mutex_lock (&tlock);
+  for (t = regions; t; t = t->next)
+    for (c = 0; c < t->nchunks; ++c)
+      if (t->chunks[c].state == CHUNK_EVICTED)
+        fill (t, c);
+}
+
+static void
+parent ()
+{
+  pthread_mutex_unlock (&tlock);
+  omp_unset_nest_lock (&lock);
+}
+
+static void
+child ()
+{
+  struct tier *t;
+/* The global lock has been reset in xmem.c already. */
+  pthread_mutex_init (&tlock, NULL);
+  for (t = regions; t; t = t->next)
+    t->inherited = 1;
+  if (uffd > -1)
+    close (uffd);
+  if (store > -1)
+    close (store);
+  uffd = -1;
+  store = -1;
+  store_end = 0;
+}
+
+/* Set up the userfaultfd, chunk store and handler thread. Called with the
+ * global lock and tlock held, in that order. Returns 0 on success.
+ */
+static int
+start ()
+{
+  struct uffdio_api api;
+  char name[XMEM_MAX_PATH_LEN];
+
+  if (uffd > -1)
+    return 0;
+  uffd = syscall (SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (uffd < 0)
+    return -1;
+  memset (&api, 0, sizeof (api));
+  api.api = UFFD_API;
+  api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+  if (ioctl (uffd, UFFDIO_API, &api) < 0)
+    goto fail;
+  if (!cbuf)
+    {
+      cbuf_len = COMPRESS_BOUND (XMEM_TIER_CHUNK);
+      cbuf = mmap (NULL, cbuf_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      dbuf = mmap (NULL, XMEM_TIER_CHUNK, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (cbuf == MAP_FAILED || dbuf == MAP_FAILED)
+        {
+          cbuf = dbuf = NULL;
+          goto fail;
+        }
+    }
+/* The chunk store lives next to the other backing files and is always
+ * anonymous.
+ */
+  strncpy (name, xmem_fname_template, XMEM_MAX_PATH_LEN - 1);
+  name[XMEM_MAX_PATH_LEN - 1] = 0;
+  store = mkostemp (name, O_RDWR | O_CREAT | O_CLOEXEC);
+  if (store < 0)
+    goto fail;
+  unlink (name);
+  if (pthread_create (&handler, NULL, handle, NULL) != 0)
+    goto fail;
+  pthread_detach (handler);
+  return 0;
+fail:
+  if (store > -1)
+    close (store);
+  close (uffd);
+  store = uffd = -1;
+  return -1;
+}
+
+static void
+once ()
+{
+  pthread_atfork (prepare, parent, child);
+}
+
+/* Returns nonzero if the compressed tier can be used in this process. Must
+ * be called with the lock held.
+ */
+int
+xmem_tier_available ()
+{
+  int j;
+  pthread_once (&tonce, once);
+  pthread_mutex_lock (&tlock);
+  j = start () == 0;
+  pthread_mutex_unlock (&tlock);
+  return j;
+}
+
+/* Map m->length bytes of compressed tier memory for m and set m->addr and
+ * m->tier. Returns 0 on success and -1 otherwise, in which case the caller
+ * should fall back to a file mapping. Must be called with the lock held.
+ */
+int
+xmem_tier_map (struct map *m)
+{
+  struct uffdio_register reg;
+  struct tier *t;
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+
+  pthread_once (&tonce, once);
+  pthread_mutex_lock (&tlock);
+  if (start () < 0)
+    goto fail;
+  t = (struct tier *) uthash_malloc_ (sizeof (struct tier));
+  if (!t)
+    goto fail;
+  t->length = (m->length + pg - 1) & ~(pg - 1);
+  t->nchunks = (t->length + XMEM_TIER_CHUNK - 1) / XMEM_TIER_CHUNK;
+  t->inherited = 0;
+  t->chunks = (struct chunk *) uthash_malloc_ (t->nchunks * sizeof (struct chunk));
+  if (!t->chunks)
+    {
+      uthash_free_ (t);
+      goto fail;
+    }
+  memset (t->chunks, 0, t->nchunks * sizeof (struct chunk));
+  t->addr = mmap (NULL, t->length, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (t->addr == MAP_FAILED)
+    goto fail_free;
+  reg.range.start = (unsigned long) t->addr;
+  reg.range.len = t->length;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+  if (ioctl (uffd, UFFDIO_REGISTER, &reg) < 0)
+    {
+      munmap (t->addr, t->length);
+      goto fail_free;
+    }
+  t->next = regions;
+  regions = t;
+  m->addr = t->addr;
+  m->tier = t;
+  pthread_mutex_unlock (&tlock);
+  return 0;
+
+fail_free:
+  uthash_free_ (t->chunks);
+  uthash_free_ (t);
+fail:
+  pthread_mutex_unlock (&tlock);
+  return -1;
+}
+
+/* Unmap a compressed tier region and release its chunk store space. */
+void
+xmem_tier_unmap (struct map *m)
+{
+  struct tier **p, *t = m->tier;
+  size_t c;
+  if (!t)
+    return;
+  pthread_mutex_lock (&tlock);
+  for (p = &regions; *p; p = &(*p)->next)
+    if (*p == t)
+      {
+        *p = t->next;
+        break;
+      }
+  if (!t->inherited)
+    for (c = 0; c < t->nchunks; ++c)
+      if (t->chunks[c].state == CHUNK_EVICTED)
+        punch (&t->chunks[c]);
+  munmap (t->addr, t->length);
+  pthread_mutex_unlock (&tlock);
+  uthash_free_ (t->chunks);
+  uthash_free_ (t);
+  m->tier = NULL;
+}
+
+#else
+
+/* Built without a compression library: the tier is never available. */
+int
+xmem_tier_available ()
+{
+  return 0;
+}
+
+int
+xmem_tier_map (struct map *m)
+{
+  (void) m;
+  return -1;
+}
+
+void
+xmem_tier_unmap (struct map *m)
+{
+  (void) m;
+}
+
+size_t
+xmem_tier_sweep ()
+{
+  return 0;
+}
+
+#endif
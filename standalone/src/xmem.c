@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <omp.h>
 
 #define uthash_malloc(sz) uthash_malloc_(sz)
@@ -34,10 +35,22 @@ static void *(*xmem_default_malloc) (size_t);
 static void *(*xmem_default_valloc) (size_t);
 static void *(*xmem_default_realloc) (void *, size_t);
 static void *(*xmem_default_memcpy) (void *dest, const void *src, size_t n);
+static void forget (struct map *m);
+static void xmem_prepare (void);
+static void xmem_parent (void);
+static void xmem_child (void);
 
-static void *uthash_malloc_ (size_t);
-static void uthash_free_ (void *);
 void freemap (struct map *);
+static struct map *newmap (void);
+static void dropmap (struct map *);
+static void xmem_unmap (struct map *);
+
+struct map *flexmap;
+omp_nest_lock_t lock;
+size_t xmem_min_mapped = (size_t) -1;
+static uintptr_t span_lo, span_hi;    /* Bounds of all regions, see span */
+pid_t xmem_pid;
+int xmem_forked;
 
 /* READY has three states:
  * -1 at startup, prior to initialization of anything
@@ -59,6 +72,11 @@ static int READY = -1;
  * Be cautious when debugging about placement of printf, write, etc. These
  * things often end up re-entering one of our functions. The general rule here
  * is to keep things as minimal as possible.
+ *
+ * Forked children inherit the registry. Regions still belong to the process
+ * that allocated them (m->pid): a child unmaps the regions it inherits when
+ * it frees them or exits, but leaves their files to the parent. See the fork
+ * handlers below.
  */
 
 /* Xmem initialization
@@ -79,14 +97,52 @@ xmem_init ()
 #ifdef DEBUG
 write(2,"INIT \n",6);
 #endif
-  if(READY < 0)
+  int first = READY < 0;
+  if(first)
   {
     omp_init_nest_lock (&lock);
+    xmem_pid = getpid ();
     READY=1;
   }
   if(!xmem_hook) xmem_hook = __libc_malloc;
   if(!xmem_default_free) xmem_default_free =
     (void *(*)(void *)) dlsym (RTLD_NEXT, "free");
+/* Last, pthread_atfork and the configuration may allocate. */
+  if(first)
+  {
+    pthread_atfork (xmem_prepare, xmem_parent, xmem_child);
+    xmem_config_init ();
+  }
+}
+
+/* Unmap the region of m, remove it from flexmap and release it: remove its
+ * file, or let go of it if it was inherited. Must be called with the lock
+ * held.
+ */
+void
+xmem_release (struct map *m)
+{
+#if defined(DEBUG) || defined(DEBUG2)
+  fprintf(stderr,"Xmem unmap address %p of size %lu\n", m->addr,
+          (unsigned long int) m->length);
+#endif
+  xmem_unmap (m);
+  HASH_DEL (flexmap, m);
+  if (!flexmap)
+    span_lo = span_hi = 0;
+/* Make sure a child process does not accidentally delete a mapping owned
+ * by a parent.
+ */
+  if (m->pid == xmem_pid)
+  {
+#if defined(DEBUG) || defined(DEBUG2)
+    if (m->path) fprintf(stderr,"Xmem ulink %p/%s\n", m->addr, m->path);
+#endif
+    xmem_reap (m);
+    dropmap (m);
+  }
+  else
+    forget (m);
 }
 
 /* Xmem finalization
@@ -96,34 +152,68 @@ static void
 xmem_finalize ()
 {
   struct map *m, *tmp;
-  pid_t pid;
   omp_set_nest_lock (&lock);
   READY = 0;
+  xmem_cache_bytes = 0;
+  if (xmem_profile_mode == XMEM_PROFILE_RECORD && xmem_profile_pid == getpid())
+    xmem_profile_save (xmem_profile_path);
   HASH_ITER(hh, flexmap, m, tmp)
   {
-    munmap (m->addr, m->length);
+    xmem_unmap (m);
 #if defined(DEBUG) || defined(DEBUG2)
     fprintf(stderr,"Xmem unmap address %p of size %lu\n", m->addr,
             (unsigned long int) m->length);
 #endif
-    pid = getpid();
-    if(pid == m->pid)
+    HASH_DEL (flexmap, m);
+    if (m->pid == xmem_pid)
     {
 #if defined(DEBUG) || defined(DEBUG2)
-      fprintf(stderr,"Xmem ulink %s\n", m->path);
+      if (m->path) fprintf(stderr,"Xmem ulink %s\n", m->path);
 #endif
-      unlink (m->path);
-      HASH_DEL (flexmap, m);
-      freemap (m);
+      dropmap (m);
     }
+    else
+      forget (m);
   }
   omp_unset_nest_lock (&lock);
+/* Don't leave files queued for removal behind. */
+  xmem_reap_wait ();
 #if defined(DEBUG) || defined(DEBUG2)
   fprintf(stderr,"Xmem finalized\n");
 #endif
 }
 
 
+/* Map structures are carved out of slabs of XMEM_SLAB_COUNT entries and
+ * recycled through a free list threaded through the addr field. Slabs are
+ * never returned to the system. Both functions must be called with the lock
+ * held.
+ */
+static struct map *slab;
+
+static struct map *
+newmap ()
+{
+  struct map *m;
+  int j;
+  if (!slab)
+    {
+      m = (struct map *) uthash_malloc_ (XMEM_SLAB_COUNT * sizeof (struct map));
+      if (!m)
+        return NULL;
+      for (j = 0; j < XMEM_SLAB_COUNT; ++j)
+        {
+          m[j].addr = slab;
+          slab = &m[j];
+        }
+    }
+  m = slab;
+  slab = (struct map *) m->addr;
+  memset (m, 0, sizeof (struct map));
+  m->fd = -1;
+  return m;
+}
+
 /* freemap is a utility function that deallocates the supplied map structure */
 void
 freemap (struct map *m)
@@ -132,8 +222,477 @@ freemap (struct map *m)
     {
       if (m->path)
         (*xmem_default_free) (m->path);
-      (*xmem_default_free) (m);
+      if (m->clock)
+        uthash_free_ (m->clock);
+      if (m->charged)
+        xmem_quota_charge (m, 0);
+      m->path = NULL;
+      m->clock = NULL;
+      m->addr = slab;
+      slab = m;
+    }
+}
+
+/* Unmap the region of m, whatever its tier. */
+static void
+xmem_unmap (struct map *m)
+{
+  if (m->tier)
+    xmem_tier_unmap (m);
+  else if (m->lazy)
+    xmem_lazy_unmap (m);
+  else
+    munmap (m->addr, XMEM_MAPPED (m));
+}
+
+/* Widen the bounds of all regions to the region of m, just added to
+ * flexmap. They only shrink when flexmap empties, which is good enough to
+ * let most large memcpy calls skip the search of flexmap.
+ */
+static void
+span (struct map *m)
+{
+  uintptr_t a = (uintptr_t) m->addr;
+  if (!span_hi || a < span_lo)
+    span_lo = a;
+  if (a + XMEM_MAPPED (m) > span_hi)
+    span_hi = a + XMEM_MAPPED (m);
+}
+
+/* dropmap closes and removes the backing file of a map structure that is
+ * not (or no longer) mapped and deallocates the structure.
+ */
+static void
+dropmap (struct map *m)
+{
+  xmem_rmfile (m);
+  freemap (m);
+}
+
+/* forget lets go of a region inherited from the parent process, which owns
+ * its file, and deallocates the map structure. The region is not (or no
+ * longer) mapped.
+ */
+static void
+forget (struct map *m)
+{
+  if (m->shared && !m->named)
+    xmem_share_drop (m);
+  else if (m->fd > -1)
+    close (m->fd);
+  m->fd = -1;
+  freemap (m);
+}
+
+/* Fork handlers
+ *
+ * The lock is taken before fork and released after it in the parent, so
+ * that no other thread holds it, halfway through changing flexmap, when the
+ * child is made; the child starts over with a fresh lock. Regions inherited
+ * from the parent are told apart by their m->pid, which is no longer
+ * xmem_pid in the child, so they are all marked at once without visiting
+ * them. The child unmaps them on free without touching their files.
+ *
+ * With xmem_fork_cow set, the child remaps its inherited file-backed
+ * regions copy-on-write (MAP_PRIVATE): the child sees the data as of the
+ * fork, and its writes stay in its own memory instead of reaching the
+ * parent's files. Shared and named regions stay mapped shared, since
+ * sharing them with other processes is their point (see share.c).
+ */
+static int xmem_forking;
+
+static void
+xmem_prepare ()
+{
+  xmem_forking = READY > -1;
+  if (xmem_forking)
+    omp_set_nest_lock (&lock);
+}
+
+static void
+xmem_parent ()
+{
+  xmem_forked = 1;
+  if (xmem_forking)
+    omp_unset_nest_lock (&lock);
+}
+
+static void
+xmem_child ()
+{
+  struct map *m, *tmp;
+  int prot, fd;
+  omp_init_nest_lock (&lock);
+  xmem_pid = getpid ();
+  xmem_forked = 0;
+  xmem_quota_child ();
+  if (!xmem_fork_cow)
+    return;
+  HASH_ITER(hh, flexmap, m, tmp)
+  {
+    if (!XMEM_FILE (m) || m->tier || m->lazy || m->shared || m->named)
+      continue;
+    fd = m->fd > -1 ? fcntl (m->fd, F_DUPFD_CLOEXEC, 0)
+      : open (m->path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    prot = (fcntl (fd, F_GETFL) & O_ACCMODE) == O_RDONLY ? PROT_READ
+      : PROT_READ | PROT_WRITE;
+    if (mmap (m->addr, m->length, prot, MAP_PRIVATE | MAP_FIXED, fd, 0)
+        != MAP_FAILED)
+      madvise (m->addr, m->length, xmem_advise);
+    close (fd);
+  }
+}
+
+/* xmem_rmfile closes and removes the backing file of m, if any. The files
+ * of named regions stay, and those of shared regions go with their last
+ * mapping.
+ */
+void
+xmem_rmfile (struct map *m)
+{
+  if (m->shared && !m->named)
+    {
+      xmem_share_drop (m);
+      return;
+    }
+  if (m->fd > -1)
+    close (m->fd);
+  if (m->path)
+    {
+      if (!m->named)
+        unlink (m->path);
+      (*xmem_default_free) (m->path);
     }
+  m->fd = -1;
+  m->path = NULL;
+}
+
+/* Backing file descriptors
+ *
+ * A process has only so many descriptors (RLIMIT_NOFILE), fewer than it may
+ * have regions, so a backing file with a path is closed once it is mapped
+ * and opened again by its path when it is needed. Unlinked files have no
+ * path and stay open in m->fd, as do the files of named and shared regions,
+ * whose descriptors hold their flock (see share.c). All three functions
+ * must be called with the lock held.
+ */
+
+/* Return a new descriptor for the backing file of m, which the caller
+ * closes, or -1 if there is none. Regions inherited from the parent get
+ * none: in copy-on-write mode their file no longer holds what the child
+ * sees, and the child must not write to the parent's data through it.
+ */
+int
+xmem_fd (struct map *m)
+{
+  if (m->pid != xmem_pid)
+    return -1;
+  if (m->fd > -1)
+    return fcntl (m->fd, F_DUPFD_CLOEXEC, 0);
+  if (m->path)
+    return open (m->path, O_RDWR | O_CLOEXEC);
+  return -1;
+}
+
+/* Open the backing file of m again in m->fd if it was closed. Returns 0 if
+ * m->fd is open.
+ */
+int
+xmem_keepfd (struct map *m)
+{
+  if (m->fd < 0 && m->path)
+    m->fd = open (m->path, O_RDWR | O_CLOEXEC);
+  return m->fd > -1 ? 0 : -1;
+}
+
+/* Close m->fd if the backing file can be opened again by its path. */
+void
+xmem_dropfd (struct map *m)
+{
+  if (m->fd > -1 && m->path && !m->named && !m->shared)
+    {
+      close (m->fd);
+      m->fd = -1;
+    }
+}
+
+/* Create a new backing file for m from the current file name template,
+ * leaving an open descriptor in m->fd. When xmem_unlinked is set the file is
+ * anonymous: created with O_TMPFILE in the template directory where the
+ * file system supports it, otherwise unlinked right after mkostemp. It then
+ * disappears with its last descriptor or mapping, even after a crash, and
+ * m->path is NULL. Otherwise m->path holds a copy of the file name just
+ * large enough for it.
+ *
+ * Returns 0 on success, -1 otherwise. Must be called with the lock held.
+ */
+int
+xmem_mkfile (struct map *m)
+{
+  return xmem_mkfile_at (m, xmem_fname_template, xmem_unlinked);
+}
+
+/* xmem_mkfile with the given file name template and unlinked setting
+ * instead of the current ones, for lazy regions, whose files are made as
+ * these were when the region was reserved (see lazy.c).
+ */
+int
+xmem_mkfile_at (struct map *m, const char *fname, int unlinked)
+{
+  char name[XMEM_MAX_PATH_LEN];
+  char *s;
+  size_t n;
+
+  strncpy (name, fname, XMEM_MAX_PATH_LEN - 1);
+  name[XMEM_MAX_PATH_LEN - 1] = 0;
+#ifdef O_TMPFILE
+  if (unlinked)
+    {
+      s = strrchr (name, '/');
+      if (s == name)
+        s[1] = 0;
+      else if (s)
+        *s = 0;
+      m->fd = open (s ? name : ".", O_TMPFILE | O_RDWR | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR);
+      if (m->fd > -1)
+        return 0;
+      strncpy (name, fname, XMEM_MAX_PATH_LEN - 1);
+    }
+#endif
+  m->fd = mkostemp (name, O_RDWR | O_CREAT | O_CLOEXEC);
+  if (m->fd < 0)
+    return -1;
+  if (unlinked)
+    {
+      unlink (name);
+      return 0;
+    }
+  n = strlen (name) + 1;
+  m->path = (char *) (*xmem_default_malloc) (n);
+  if (!m->path)
+    {
+      close (m->fd);
+      m->fd = -1;
+      unlink (name);
+      return -1;
+    }
+  memcpy (m->path, name, n);
+  return 0;
+}
+
+/* Map the m->length bytes of the backing file of m, which is that long and
+ * open in m->fd, at a new address, with room to grow into in reservation
+ * mode (see xmem.h). Sets m->reserve and m->extent and returns the address
+ * or MAP_FAILED.
+ */
+static void *
+xmem_mapreserve (struct map *m)
+{
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  size_t n = 0;
+  if (xmem_reserve_factor > 1 && m->length <= (size_t) -1 / xmem_reserve_factor)
+    {
+      n = m->length * xmem_reserve_factor;
+      if (xmem_reserve_cap && n - m->length > xmem_reserve_cap)
+        n = m->length + xmem_reserve_cap;
+      n = (n + pg - 1) & ~(pg - 1);
+      if (n <= m->length)
+        n = 0;
+    }
+  m->reserve = n;
+  m->extent = m->length;
+  return mmap (NULL, XMEM_MAPPED (m), PROT_READ | PROT_WRITE, MAP_SHARED,
+               m->fd, 0);
+}
+
+/* The backing file length the region of m has once resized to n bytes.
+ * Within the reserve the file grows to at least n bytes, doubling where the
+ * reserve allows so that a run of small steps extends it only now and then;
+ * otherwise it is n bytes long.
+ */
+static size_t
+xmem_extent (struct map *m, size_t n)
+{
+  size_t e = m->extent * 2;
+  if (!m->reserve || n > m->reserve)
+    return n;
+  if (n <= m->extent)
+    return m->extent;
+  if (e < n)
+    e = n;
+  return e > m->reserve ? m->reserve : e;
+}
+
+/* Extend the backing file of the reserved region m to hold at least n
+ * bytes, see xmem_extent. Returns 0 on success, -1 otherwise. Must be called
+ * with the lock held.
+ */
+static int
+xmem_extend (struct map *m, size_t n)
+{
+  size_t e = xmem_extent (m, n);
+  int j = -1;
+  if (xmem_keepfd (m) < 0)
+    return -1;
+  if ((xmem_prealloc == XMEM_PREALLOC_SPARSE
+       || xmem_io_reserve (m->fd, m->extent, e - m->extent,
+                           xmem_prealloc == XMEM_PREALLOC_FULL ? e - m->extent
+                           : XMEM_PREALLOC_CHUNK_SIZE) == 0)
+      && ftruncate (m->fd, e) == 0)
+    {
+      m->extent = e;
+      m->fdirty = 1;
+      j = 0;
+    }
+  xmem_dropfd (m);
+  return j;
+}
+
+/* Back m with a new file of m->length bytes and map it with the given
+ * madvise advice, and transparent huge pages if huge is set. Unless zero is
+ * set (calloc data are often sparse), the file's blocks are preallocated as
+ * xmem_prealloc says. Returns 0 on success, -1 with errno set and no file
+ * left behind otherwise. Must be called with the lock held.
+ */
+static int
+xmem_mapfile (struct map *m, int zero, int advice, int huge)
+{
+  int j;
+/* Large regions are striped when that is on, see stripe.c. */
+  if (xmem_stripe_wanted (m->length)
+      && (xmem_stripe_map (m, zero, advice, huge) == 0 || errno == ENOSPC))
+    return m->striped ? 0 : -1;
+  if (xmem_mkfile (m) < 0)
+    return -1;
+  if (ftruncate (m->fd, m->length) < 0)
+    goto fail;
+  if (!zero && xmem_prealloc != XMEM_PREALLOC_SPARSE
+      && xmem_io_reserve (m->fd, 0, m->length,
+                          xmem_prealloc == XMEM_PREALLOC_FULL ? m->length
+                          : XMEM_PREALLOC_CHUNK_SIZE) < 0)
+    goto fail;
+  m->addr = xmem_mapreserve (m);
+  if (m->addr == MAP_FAILED)
+    goto fail;
+  madvise(m->addr, XMEM_MAPPED (m), advice);
+#ifdef MADV_HUGEPAGE
+  if (huge)
+    madvise(m->addr, XMEM_MAPPED (m), MADV_HUGEPAGE);
+#endif
+  xmem_dropfd (m);
+  return 0;
+
+fail:
+  j = errno;
+  xmem_rmfile (m);
+  errno = j;
+  return -1;
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+static void
+populate_chunk (void *addr, size_t i)
+{
+  char *p = (char *) addr + i * XMEM_POPULATE_CHUNK;
+  madvise (p, XMEM_POPULATE_CHUNK, MADV_POPULATE_WRITE);
+}
+
+/* Fault in the n bytes at addr, a new region no one else has seen yet
+ * (XMEM_POPULATE_ASYNC excepted), as mode (an XMEM_POPULATE_* mode) says. The region is
+ * populated in XMEM_POPULATE_CHUNK pieces with MADV_POPULATE_WRITE, which
+ * allocates the blocks and write-faults the pages without changing them.
+ * Kernels before 5.14 don't have it; there the pages are touched instead,
+ * which is only safe for a region that is still all zeros.
+ */
+static void
+xmem_populate_region (void *addr, size_t n, int mode)
+{
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  size_t chunks = n / XMEM_POPULATE_CHUNK;
+  size_t j;
+  long i;
+  int touch;
+
+  switch (mode)
+    {
+    case XMEM_POPULATE_ASYNC:
+/* The caller may be writing to the region already, so never touch it. The
+ * tail that doesn't fill a chunk is done right away.
+ */
+      madvise ((char *) addr + chunks * XMEM_POPULATE_CHUNK,
+               n - chunks * XMEM_POPULATE_CHUNK, MADV_POPULATE_WRITE);
+      xmem_pool_async (populate_chunk, addr, chunks, NULL);
+      break;
+    case XMEM_POPULATE_SYNC:
+      if (madvise (addr, n, MADV_POPULATE_WRITE) == 0)
+        break;
+      for (j = 0; j < n; j += pg)
+        ((volatile char *) addr)[j] = 0;
+      break;
+    case XMEM_POPULATE_PARALLEL:
+      touch = madvise (addr, n < pg ? n : pg, MADV_POPULATE_WRITE) < 0;
+      chunks = (n + XMEM_POPULATE_CHUNK - 1) / XMEM_POPULATE_CHUNK;
+#pragma omp parallel for private(j) schedule(dynamic)
+      for (i = 0; i < (long) chunks; ++i)
+        {
+          char *p = (char *) addr + i * XMEM_POPULATE_CHUNK;
+          size_t len = n - i * XMEM_POPULATE_CHUNK;
+          if (len > XMEM_POPULATE_CHUNK)
+            len = XMEM_POPULATE_CHUNK;
+          if (!touch)
+            madvise (p, len, MADV_POPULATE_WRITE);
+          else
+            for (j = 0; j < len; j += pg)
+              ((volatile char *) p)[j] = 0;
+        }
+      break;
+    }
+}
+
+/* Apply XMEM_F_HUGE and XMEM_F_POPULATE to a heap allocation: ask for huge
+ * pages on its page-aligned interior and fault it in without changing it.
+ */
+static void
+xmem_tune_heap (void *addr, size_t n, int flags)
+{
+  size_t pg = (size_t) sysconf (_SC_PAGESIZE);
+  uintptr_t first = ((uintptr_t) addr + pg - 1) & ~(pg - 1);
+  uintptr_t last = ((uintptr_t) addr + n) & ~(pg - 1);
+  size_t j;
+#ifdef MADV_HUGEPAGE
+  if ((flags & XMEM_F_HUGE) && last > first)
+    madvise ((void *) first, last - first, MADV_HUGEPAGE);
+#endif
+  if (flags & XMEM_F_POPULATE)
+    for (j = 0; j < n; j += pg)
+      ((volatile char *) addr)[j] = ((volatile char *) addr)[j];
+}
+
+/* Move n bytes between buf and the start of the file fd with pwrite (write
+ * set) or pread, which go straight to the page cache instead of faulting in
+ * a mapping first. Returns the number of bytes moved, which may be short.
+ */
+static size_t
+transfer (int fd, char *buf, size_t n, int write)
+{
+  ssize_t r;
+  size_t k = 0;
+  while (k < n)
+    {
+      r = write ? pwrite (fd, buf + k, n - k, k) : pread (fd, buf + k, n - k, k);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        break;
+      k += r;
+    }
+  return k;
 }
 
 /* Make sure uthash uses the default malloc and free functions. */
@@ -153,78 +712,188 @@ uthash_free_ (void *ptr)
   (*xmem_default_free) (ptr);
 }
 
-void *
-malloc (size_t size)
+/* The allocator shared by malloc, calloc and xmem_malloc_ex. Allocations
+ * above the threshold are file-backed, unless a loaded call site profile
+ * says otherwise or flags (XMEM_F_* of xmem_api.h, or those of a size class
+ * rule, see config.c) decide the placement.
+ * XMEM_F_ZERO requests zeroed memory; new file mappings are zero already.
+ */
+static void *
+xmem_malloc (size_t size, int flags)
 {
   struct map *m, *y;
   void *x;
   int j;
-  int fd;
+  int file;
+  int place;
+  int tier;
+  int advice;
+  int plain;
+  int spill;
+  int huge = (flags & XMEM_F_HUGE) != 0;
+  int zero = (flags & XMEM_F_ZERO) != 0;
+  unsigned long long site = 0;
 
   if(!xmem_default_malloc)
     xmem_default_malloc = (void *(*)(size_t)) dlsym (RTLD_NEXT, "malloc");
-  if (size > xmem_threshold && READY>0)
+  if (READY>0 && xmem_nclasses
+      && !(flags & (XMEM_F_FILE | XMEM_F_RAM | XMEM_F_COMPRESSED
+                    | XMEM_F_LAZY)))
+    flags |= xmem_size_class (size);
+  file = size > xmem_threshold && READY>0;
+  if (READY>0 && xmem_profile_mode && size > xmem_profile_min)
     {
-      m = (struct map *) ((*xmem_default_malloc) (sizeof (struct map)));
-      m->path = (char *) ((*xmem_default_malloc) (XMEM_MAX_PATH_LEN));
-      memset(m->path,0,XMEM_MAX_PATH_LEN);
-      omp_set_nest_lock (&lock);
-      strncpy (m->path, xmem_fname_template, XMEM_MAX_PATH_LEN);
-      m->length = size;
-      fd = mkostemp (m->path, O_RDWR | O_CREAT);
-      j = ftruncate (fd, m->length);
+      site = xmem_profile_site ();
+      if (site && xmem_profile_mode == XMEM_PROFILE_APPLY
+          && !(flags & (XMEM_F_FILE | XMEM_F_RAM)))
+        {
+          omp_set_nest_lock (&lock);
+          place = xmem_profile_place (site);
+          omp_unset_nest_lock (&lock);
+          if (place >= 0)
+            file = place;
+        }
+    }
+  if (flags & (XMEM_F_FILE | XMEM_F_COMPRESSED | XMEM_F_LAZY))
+    file = READY>0;
+  if (flags & XMEM_F_RAM)
+    file = 0;
+  tier = (flags & XMEM_F_COMPRESSED)
+    || (xmem_tier == XMEM_TIER_COMPRESSED && !(flags & XMEM_F_FILE));
+  advice = flags & XMEM_F_ADVICE_MASK ? ((flags & XMEM_F_ADVICE_MASK) >> 8) - 1
+    : xmem_advise;
+/* Plain file-backed regions can be recycled, see cache.c. */
+  plain = file && !tier && !(flags & ~XMEM_F_FILE);
+  x = NULL;
+  if (plain && xmem_cache_bytes)
+    {
+      x = xmem_cache_get (size);
+      if (x)
+        file = 0;
+    }
+/* Out-of-core quotas may block here, so before taking the lock. */
+  spill = 0;
+  if (file && !tier)
+    {
+      j = xmem_quota_check (size);
       if (j < 0)
+        return NULL;
+      spill = j == XMEM_QUOTA_SPILL;
+    }
+  if (file)
+    {
+      omp_set_nest_lock (&lock);
+      m = newmap ();
+      if (!m)
         {
           omp_unset_nest_lock (&lock);
-          close (fd);
-          unlink (m->path);
+          return NULL;
+        }
+      m->length = plain ? xmem_cache_size (size) : size;
+      m->size = size;
+      if (spill && xmem_tier_map (m) < 0)
+        {
           freemap (m);
+          omp_unset_nest_lock (&lock);
+          errno = ENOMEM;
           return NULL;
         }
-      m->addr =
-        mmap (NULL, m->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-      madvise(m->addr, m->length, xmem_advise);
-      m->pid = getpid();
+/* Use the compressed tier when selected, falling back to a (possibly lazily
+ * created) file if it can't map the region. When the file system is full,
+ * xmem_enospc decides between failing, the compressed tier and the heap.
+ */
+      if (!m->tier && (!tier || xmem_tier_map (m) < 0)
+          && (!(flags & XMEM_F_LAZY) || xmem_lazy_map (m, advice, huge) < 0)
+          && xmem_mapfile (m, zero, advice, huge) < 0)
+        {
+          j = errno;
+          if (j != ENOSPC || xmem_enospc != XMEM_ENOSPC_TIER
+              || xmem_tier_map (m) < 0)
+            {
+              freemap (m);
+              omp_unset_nest_lock (&lock);
+              if (j != ENOSPC || xmem_enospc != XMEM_ENOSPC_HEAP)
+                {
+                  errno = ENOMEM;
+                  return NULL;
+                }
+              file = 0;
+            }
+        }
+    }
+  if (file)
+    {
+      m->pid = xmem_pid;
+/* The size asked for, m->length may be rounded up to a cache size class. */
+      if (size < xmem_min_mapped)
+        xmem_min_mapped = size;
       x = m->addr;
-      close (fd);
+      tier = m->tier != NULL || m->lazy != NULL;
 #if defined(DEBUG) || defined(DEBUG2)
       fprintf(stderr,"Xmem malloc address %p, size %lu, file  %s\n", m->addr,
-              (unsigned long int) m->length, m->path);
+              (unsigned long int) m->length,
+              m->path ? m->path : m->tier ? "(compressed)"
+              : m->lazy ? "(lazy)" : m->striped ? "(striped)" : "(unlinked)");
 #endif
 /* Check to make sure that this address is not already in the hash. If it is,
  * then something is terribly wrong and we must bail.
  */
-      HASH_FIND_PTR (flexmap, m->addr, y);
+      HASH_FIND_PTR (flexmap, &m->addr, y);
       if(y)
       {
-        munmap (m->addr, m->length);
-        unlink (m->path);
-        freemap (m);
+        xmem_unmap (m);
+        dropmap (m);
         x = NULL;
       } else
       {
         HASH_ADD_PTR (flexmap, addr, m);
+        span (m);
+        if (!m->tier)
+          xmem_quota_charge (m, m->length);
       }
 #if defined(DEBUG) || defined(DEBUG2)
       fprintf(stderr,"hash count = %u\n", HASH_COUNT (flexmap));
 #endif
       omp_unset_nest_lock (&lock);
+      xmem_governor_start ();
+/* Compressed and lazy regions fault in on their own terms. */
+      if (x && !tier && (flags & XMEM_F_POPULATE))
+        xmem_populate_region (x, size, xmem_populate ? xmem_populate
+                              : XMEM_POPULATE_SYNC);
+      else if (x && !tier && xmem_populate
+               && (!xmem_populate_max || size <= xmem_populate_max))
+        xmem_populate_region (x, size, xmem_populate);
     }
-  else
+  if (!file && !x)
     {
       x = (*xmem_default_malloc) (size);
+      if (x && zero)
+        memset (x, 0, size);
+      if (x && (flags & (XMEM_F_HUGE | XMEM_F_POPULATE)))
+        xmem_tune_heap (x, size, flags);
 #ifdef DEBUG
       fprintf(stderr,"malloc %p\n",x);
 #endif
     }
+  if (site && xmem_profile_mode == XMEM_PROFILE_RECORD)
+    {
+      omp_set_nest_lock (&lock);
+      xmem_profile_alloc (x, size, site);
+      omp_unset_nest_lock (&lock);
+    }
   return x;
 }
 
+void *
+malloc (size_t size)
+{
+  return xmem_malloc (size, 0);
+}
+
 void
 free (void *ptr)
 {
   struct map *m;
-  pid_t pid;
   if (!ptr)
     return;
   if (READY>0)
@@ -233,27 +902,18 @@ free (void *ptr)
 fprintf(stderr,"free %p \n",ptr);
 #endif
       omp_set_nest_lock (&lock);
+      if (xmem_profile_mode == XMEM_PROFILE_RECORD)
+        xmem_profile_free (ptr);
       HASH_FIND_PTR (flexmap, &ptr, m);
       if (m)
         {
-#if defined(DEBUG) || defined(DEBUG2)
-          fprintf(stderr,"Xmem unmap address %p of size %lu\n", ptr,
-                  (unsigned long int) m->length);
-#endif
-          munmap (ptr, m->length);
-/* Make sure a child process does not accidentally delete a mapping owned
- * by a parent.
+/* Already on a free list: a double free. Otherwise keep the region for
+ * reuse if there is room, see cache.c.
  */
-          pid = getpid();
-          if(pid == m->pid)
-          {
-#if defined(DEBUG) || defined(DEBUG2)
-          fprintf(stderr,"Xmem ulink %p/%s\n", ptr, m->path);
-#endif
-            unlink (m->path);
-            HASH_DEL (flexmap, m);
-            freemap (m);
-          }
+          if (!m->cached)
+            xmem_compact_cancel (m);
+          if (!m->cached && xmem_cache_put (m) < 0)
+            xmem_release (m);
           omp_unset_nest_lock (&lock);
           return;
         }
@@ -264,6 +924,181 @@ fprintf(stderr,"free %p \n",ptr);
   (*xmem_default_free) (ptr);
 }
 
+/* free for callers that know the size of the allocation, C++ sized delete
+ * in particular (see new.cc). No region has ever been shorter than
+ * xmem_min_mapped, so smaller allocations go straight to the default free
+ * without a look at flexmap or the lock. When call sites are profiled every
+ * free has to be seen, so the shortcut is off.
+ */
+void
+xmem_free_sized (void *ptr, size_t size)
+{
+  if (size < xmem_min_mapped && xmem_profile_mode != XMEM_PROFILE_RECORD)
+    {
+      if(!xmem_default_free)
+        xmem_default_free = (void *(*)(void *)) dlsym (RTLD_NEXT, "free");
+      (*xmem_default_free) (ptr);
+      return;
+    }
+  free (ptr);
+}
+
+/* Allocate size bytes placed as flags (XMEM_F_* of xmem_api.h) say, see
+ * the notes in xmem_api.h.
+ */
+void *
+xmem_malloc_ex (size_t size, int flags)
+{
+  return xmem_malloc (size, flags & ~XMEM_F_ZERO);
+}
+
+/* Release memory from xmem_malloc_ex. */
+void
+xmem_free_ex (void *ptr)
+{
+  free (ptr);
+}
+
+/* Register the region of m, just mapped by one of the functions below,
+ * and apply the XMEM_F_ADVICE, HUGE and POPULATE flags to it. Called with
+ * the lock held, which it releases. Returns the region's address, or NULL
+ * with errno set.
+ */
+static void *
+xmem_attach (struct map *m, int flags)
+{
+  struct map *y;
+  size_t n = m->length;
+  void *x = m->addr;
+
+  madvise (m->addr, m->length, flags & XMEM_F_ADVICE_MASK
+           ? ((flags & XMEM_F_ADVICE_MASK) >> 8) - 1 : xmem_advise);
+#ifdef MADV_HUGEPAGE
+  if (flags & XMEM_F_HUGE)
+    madvise (m->addr, m->length, MADV_HUGEPAGE);
+#endif
+  m->pid = xmem_pid;
+  m->size = m->length;
+  if (m->length < xmem_min_mapped)
+    xmem_min_mapped = m->length;
+#if defined(DEBUG) || defined(DEBUG2)
+  fprintf(stderr,"Xmem attach address %p, size %lu, file  %s\n", m->addr,
+          (unsigned long int) m->length, m->path ? m->path : "(unlinked)");
+#endif
+  HASH_FIND_PTR (flexmap, &m->addr, y);
+  if (y)
+    {
+      xmem_unmap (m);
+      dropmap (m);
+      x = NULL;
+      errno = EEXIST;
+    }
+  else
+    {
+      HASH_ADD_PTR (flexmap, addr, m);
+      span (m);
+    }
+  omp_unset_nest_lock (&lock);
+  if (x)
+    {
+      xmem_governor_start ();
+      if (flags & XMEM_F_POPULATE)
+        xmem_populate_region (x, n, xmem_populate ? xmem_populate
+                              : XMEM_POPULATE_SYNC);
+    }
+  return x;
+}
+
+/* A new map structure for one of the functions below, returned with the
+ * lock held. Returns NULL with errno set and the lock released otherwise.
+ */
+static struct map *
+xmem_attach_map ()
+{
+  struct map *m;
+  if (READY <= 0)
+    {
+      errno = EAGAIN;
+      return NULL;
+    }
+  omp_set_nest_lock (&lock);
+  m = newmap ();
+  if (!m)
+    {
+      omp_unset_nest_lock (&lock);
+      errno = ENOMEM;
+    }
+  return m;
+}
+
+/* Give up on m from xmem_attach_map, keeping errno. */
+static void *
+xmem_attach_fail (struct map *m)
+{
+  int j = errno;
+  freemap (m);
+  omp_unset_nest_lock (&lock);
+  errno = j;
+  return NULL;
+}
+
+/* Make a region with fn, which maps it for a new map structure with arg and
+ * returns 0 or -1 with errno set, and register it with flags as for
+ * xmem_attach. Returns the region's address, or NULL with errno set.
+ */
+void *
+xmem_attach_with (int (*fn) (struct map *, void *), void *arg, int flags)
+{
+  struct map *m = xmem_attach_map ();
+  if (!m)
+    return NULL;
+  if (fn (m, arg) < 0)
+    return xmem_attach_fail (m);
+  return xmem_attach (m, flags);
+}
+
+/* Create or attach the named region name, see the notes in xmem_api.h and
+ * named.c. Returns its address, or NULL with errno set.
+ */
+void *
+xmem_map_named (const char *name, size_t size, int flags)
+{
+  struct map *m = xmem_attach_map ();
+  if (!m)
+    return NULL;
+  if (xmem_named_map (m, name, size, flags) < 0)
+    return xmem_attach_fail (m);
+  return xmem_attach (m, flags);
+}
+
+/* Map a region exported by another process with xmem_export (handle) or
+ * xmem_export_fd (sock), see share.c. Returns its address, or NULL with
+ * errno set.
+ */
+void *
+xmem_import (const char *handle, int flags)
+{
+  struct map *m = xmem_attach_map ();
+  if (!m)
+    return NULL;
+  if (xmem_share_import (m, handle, -1, flags) < 0)
+    return xmem_attach_fail (m);
+  return xmem_attach (m, flags & XMEM_IMPORT_RDONLY ? flags & ~XMEM_F_POPULATE
+                      : flags);
+}
+
+void *
+xmem_import_fd (int sock, int flags)
+{
+  struct map *m = xmem_attach_map ();
+  if (!m)
+    return NULL;
+  if (xmem_share_import (m, NULL, sock, flags) < 0)
+    return xmem_attach_fail (m);
+  return xmem_attach (m, flags & XMEM_IMPORT_RDONLY ? flags & ~XMEM_F_POPULATE
+                      : flags);
+}
+
 /* valloc returns memory aligned to a page boundary.  Memory mapped flies are
  * aligned to page boundaries, so we simply return our modified malloc when
  * over the threshold. Otherwise, fall back to default valloc.
@@ -292,10 +1127,9 @@ void *
 realloc (void *ptr, size_t size)
 {
   struct map *m, *y;
-  int j, fd, child;
+  int j, child, fd;
   void *x;
-  pid_t pid;
-  size_t copylen;
+  size_t copylen, k;
 #ifdef DEBUG
   fprintf(stderr,"realloc\n");
 #endif
@@ -317,60 +1151,238 @@ realloc (void *ptr, size_t size)
     {
       omp_set_nest_lock (&lock);
       HASH_FIND_PTR (flexmap, &ptr, m);
+      if (m && m->lazy)
+        xmem_lazy_settle (m);
+      if (m && (m->tier || !XMEM_FILE (m) || (m->shared && !m->named)))
+        {
+/* Compressed tier regions, regions that never got a backing file and
+ * regions other processes map can't be resized in place. Move the data.
+ */
+          copylen = size < m->size ? size : m->size;
+          omp_unset_nest_lock (&lock);
+          x = malloc (size);
+          if (x)
+            {
+              memcpy (x, ptr, copylen);
+              free (ptr);
+            }
+          return x;
+        }
+      if (m && m->named && m->pid == xmem_pid)
+        {
+/* Named regions keep their file, which grows or shrinks with them. */
+          HASH_DEL (flexmap, m);
+          x = xmem_named_resize (m, size) < 0 ? NULL : m->addr;
+          if (x)
+            {
+              m->size = m->length;
+              if (m->clock)
+                uthash_free_ (m->clock);
+              m->clock = NULL;
+              if (m->length < xmem_min_mapped)
+                xmem_min_mapped = m->length;
+              if (xmem_profile_mode == XMEM_PROFILE_RECORD)
+                xmem_profile_realloc (ptr, x, size);
+            }
+          else
+            errno = ENOMEM;
+          HASH_ADD_PTR (flexmap, addr, m);
+          span (m);
+          omp_unset_nest_lock (&lock);
+          return x;
+        }
+      if (m && !m->named && m->length > xmem_threshold
+          && size <= xmem_threshold)
+        {
+/* Shrunk to the threshold or below: move the data to the heap. pread copies
+ * them from the page cache without faulting in the mapping; a child reads
+ * its own view through the mapping instead.
+ */
+          fd = xmem_fd (m);
+          omp_unset_nest_lock (&lock);
+          x = malloc (size);
+          if (x)
+            {
+              k = fd > -1 ? transfer (fd, x, size, 0) : 0;
+              if (k < size)
+                memcpy ((char *) x + k, (char *) ptr + k, size - k);
+              free (ptr);
+            }
+          if (fd > -1)
+            close (fd);
+          return x;
+        }
+      if (!m && size > xmem_threshold)
+        {
+/* A heap block grown past the threshold moves to a file, unless a call site
+ * profile says otherwise. The data go in with pwrite, which fills the page
+ * cache directly instead of faulting in zeroed pages only to overwrite them.
+ */
+          omp_unset_nest_lock (&lock);
+          copylen = malloc_usable_size (ptr);
+          if (copylen > size)
+            copylen = size;
+          x = malloc (size);
+          if (!x)
+            return NULL;
+          omp_set_nest_lock (&lock);
+          HASH_FIND_PTR (flexmap, &x, m);
+          fd = m && !m->tier && !m->lazy ? xmem_fd (m) : -1;
+          if (fd > -1)
+            m->fdirty = 1;
+          omp_unset_nest_lock (&lock);
+          k = fd > -1 ? transfer (fd, ptr, copylen, 1) : 0;
+          if (k < copylen)
+            memcpy ((char *) x + k, (char *) ptr + k, copylen - k);
+          if (fd > -1)
+            close (fd);
+/* Through free, which closes the profile record of ptr. */
+          free (ptr);
+          return x;
+        }
+      if (m && m->charged && m->pid == xmem_pid
+          && !xmem_quota_fits (m, xmem_extent (m, size), &j))
+        {
+/* Growth over an out-of-core quota fails, or moves the region through
+ * malloc, which blocks or spills as the quota says. Reserved regions are
+ * charged their file's extent, which may grow by more than asked for.
+ */
+          copylen = size < m->size ? size : m->size;
+          omp_unset_nest_lock (&lock);
+          if (j == XMEM_QUOTA_FAIL)
+            {
+              errno = ENOMEM;
+              return NULL;
+            }
+          x = malloc (size);
+          if (x)
+            {
+              memcpy (x, ptr, copylen);
+              free (ptr);
+            }
+          return x;
+        }
+      if (m && m->reserve && m->pid == xmem_pid && size <= m->reserve)
+        {
+/* Within the reserve the mapping stays where it is, and only the file may
+ * need to grow or shrink. The region is charged the file's extent.
+ */
+          if (size > m->extent && xmem_extend (m, size) < 0)
+            {
+              omp_unset_nest_lock (&lock);
+              errno = ENOMEM;
+              return NULL;
+            }
+/* Shrinking gives the tail of the file back, unless a child may map it. */
+          if (size < m->length && !xmem_forked && xmem_keepfd (m) == 0)
+            {
+              if (ftruncate (m->fd, size) == 0)
+                m->extent = size;
+              xmem_dropfd (m);
+            }
+          m->length = m->size = size;
+          xmem_quota_charge (m, m->extent);
+          if (m->clock)
+            uthash_free_ (m->clock);
+          m->clock = NULL;
+          if (m->length < xmem_min_mapped)
+            xmem_min_mapped = m->length;
+          if (xmem_profile_mode == XMEM_PROFILE_RECORD)
+            xmem_profile_realloc (ptr, ptr, size);
+          omp_unset_nest_lock (&lock);
+          return ptr;
+        }
+      if (m && m->pid == xmem_pid && size > m->length
+          && xmem_prealloc != XMEM_PREALLOC_SPARSE
+          && (xmem_keepfd (m) < 0
+              || xmem_io_reserve (m->fd, m->length, size - m->length,
+                                  xmem_prealloc == XMEM_PREALLOC_FULL
+                                  ? size - m->length
+                                  : XMEM_PREALLOC_CHUNK_SIZE) < 0))
+        {
+/* No space to grow into. The region is left as it was. */
+          xmem_dropfd (m);
+          omp_unset_nest_lock (&lock);
+          errno = ENOMEM;
+          return NULL;
+        }
       if (m)
         {
 /* Remove the current file mapping, truncate the file, and return a new
  * file mapping to the truncated file. But don't allow a child process
  * to screw with the parent's mapping.
  */
-          munmap (ptr, m->length);
-          pid = getpid();
           child = 0;
-          if(pid == m->pid)
+          y = NULL;
+          if (m->pid == xmem_pid)
           {
+            xmem_compact_cancel (m);
+            munmap (ptr, XMEM_MAPPED (m));
             HASH_DEL (flexmap, m);
-            m->length = size;
-            fd = open (m->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+            m->length = m->size = size;
+            if (m->clock)
+              uthash_free_ (m->clock);
+            m->clock = NULL;
           } else
           {
 /* Uh oh. We're in a child process. We need to copy this mapping and create a
  * new map entry unique to the child.  Also  need to copy old data up to min
- * (size, m->length), this sucks.
+ * (size, m->length), this sucks. The data are copied from the inherited
+ * mapping, which holds the child's own changes in copy-on-write mode.
  */
             y = m;
             child = 1;
-            m = (struct map *) ((*xmem_default_malloc) (sizeof (struct map)));
-            m->path = (char *) ((*xmem_default_malloc) (XMEM_MAX_PATH_LEN));
-            memset(m->path,0,XMEM_MAX_PATH_LEN);
-            strncpy (m->path, xmem_fname_template, XMEM_MAX_PATH_LEN);
-            m->length = size;
+            m = newmap ();
+            if (!m)
+              {
+                omp_unset_nest_lock (&lock);
+                return NULL;
+              }
+            m->length = m->size = size;
             copylen = m->length;
-            if(y->length < copylen) copylen = y->length;
-            fd = mkostemp (m->path, O_RDWR | O_CREAT);
+            if(y->size < copylen) copylen = y->size;
+            if (xmem_mkfile (m) < 0)
+              goto bail;
           }
-          if (fd < 0)
+          if (xmem_keepfd (m) < 0)
             goto bail;
-          j = ftruncate (fd, m->length);
+          j = ftruncate (m->fd, m->length);
           if (j < 0)
             goto bail;
-          m->addr =
-            mmap (NULL, m->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-/* Here is a rather unfortunate child copy... XXX ADAPT THIS TO USE A COW MAP */
-          if(child) xmem_default_memcpy(m->addr,y->addr,copylen);
-          m->pid = getpid();
+          m->fdirty = 1;
+          m->addr = xmem_mapreserve (m);
+          if (m->addr == MAP_FAILED)
+            goto bail;
+/* Here is a rather unfortunate child copy, after which the child lets go of
+ * the parent's region.
+ */
+          if(child)
+          {
+            memcpy (m->addr, ptr, copylen);
+            xmem_unmap (y);
+            HASH_DEL (flexmap, y);
+            forget (y);
+          }
+          m->pid = xmem_pid;
+          if (m->length < xmem_min_mapped)
+            xmem_min_mapped = m->length;
 /* Check for existence of the address in the hash. It must not already exist,
  * (after all we just removed it and we hold the lock)--if it does something
  * is terribly wrong and we bail.
  */
-          HASH_FIND_PTR (flexmap, m->addr, y);
+          HASH_FIND_PTR (flexmap, &m->addr, y);
           if(y)
           {
-            munmap (m->addr, m->length);
+            munmap (m->addr, XMEM_MAPPED (m));
             goto bail;
           }
           HASH_ADD_PTR (flexmap, addr, m);
+          span (m);
+          xmem_dropfd (m);
+          xmem_quota_charge (m, m->length);
           x = m->addr;
-          close (fd);
+          if (xmem_profile_mode == XMEM_PROFILE_RECORD)
+            xmem_profile_realloc (ptr, x, size);
 #if defined(DEBUG) || defined(DEBUG2)
           fprintf(stderr,"Xmem realloc address %p size %lu\n", ptr,
                   (unsigned long int) m->length);
@@ -381,12 +1393,17 @@ realloc (void *ptr, size_t size)
       omp_unset_nest_lock (&lock);
     }
   x = (*xmem_default_realloc) (ptr, size);
+  if (READY>0 && xmem_profile_mode == XMEM_PROFILE_RECORD)
+    {
+      omp_set_nest_lock (&lock);
+      xmem_profile_realloc (ptr, x, size);
+      omp_unset_nest_lock (&lock);
+    }
   return x;
 
 bail:
-  close (fd);
-  unlink (m->path);
-  freemap (m);
+  dropmap (m);
+  omp_unset_nest_lock (&lock);
   return NULL;
 }
 
@@ -405,6 +1422,79 @@ reallocf (void *ptr, size_t size)
 #endif
 
 
+/* Copy arguments shared by the tasks of a parallel memcpy. Task 0 copies the
+ * first bytes up to the first XMEM_COPY_CHUNK boundary of dest, the others
+ * one whole chunk each (the last one what is left).
+ */
+struct pcopy
+{
+  char *dest;
+  const char *src;
+  size_t n;
+  size_t first;
+};
+
+static void
+copy_chunk (void *arg, size_t i)
+{
+  struct pcopy *c = (struct pcopy *) arg;
+  size_t off = i == 0 ? 0 : c->first + (i - 1) * XMEM_COPY_CHUNK;
+  size_t len = i == 0 ? c->first : XMEM_COPY_CHUNK;
+  if (len > c->n - off)
+    len = c->n - off;
+  (*xmem_default_memcpy) (c->dest + off, c->src + off, len);
+}
+
+/* Fallback for memcpy calls the fast path can't take. Copies of at least
+ * XMEM_COPY_MIN bytes into or out of a xmem region run on the thread pool in
+ * XMEM_COPY_CHUNK pieces aligned to dest, so that several threads take page
+ * faults and keep several device queues busy at once. The chunk is a
+ * multiple of the page size and of the default readahead window.
+ * Everything else goes to the default memcpy.
+ */
+static void *
+xmem_memcpy_parallel (void *dest, const void *src, size_t n)
+{
+  struct pcopy c;
+  struct map *m, *tmp;
+  char *d = (char *) dest;
+  const char *r = (const char *) src;
+  int involved = 0;
+
+  if (READY < 1 || n < XMEM_COPY_MIN)
+    return (*xmem_default_memcpy) (dest, src, n);
+  omp_set_nest_lock (&lock);
+/* Copies wholly outside the bounds of all regions don't involve any. */
+  if (((uintptr_t) d >= span_hi || (uintptr_t) d + n <= span_lo)
+      && ((uintptr_t) r >= span_hi || (uintptr_t) r + n <= span_lo))
+    {
+      omp_unset_nest_lock (&lock);
+      return (*xmem_default_memcpy) (dest, src, n);
+    }
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    char *a = (char *) m->addr;
+    if ((d < a + m->length && a < d + n) || (r < a + m->length && a < r + n))
+      {
+        involved = 1;
+        break;
+      }
+  }
+  omp_unset_nest_lock (&lock);
+  if (!involved)
+    return (*xmem_default_memcpy) (dest, src, n);
+  c.dest = d;
+  c.src = r;
+  c.n = n;
+  c.first = (((uintptr_t) d + XMEM_COPY_CHUNK) & ~((uintptr_t) XMEM_COPY_CHUNK - 1))
+    - (uintptr_t) d;
+  if (c.first > n)
+    c.first = n;
+  xmem_pool_run (copy_chunk, &c,
+                 1 + (n - c.first + XMEM_COPY_CHUNK - 1) / XMEM_COPY_CHUNK);
+  return dest;
+}
+
 /* A xmem-aware memcpy.
  *
  * It turns out, at least on Linux, that memcpy on memory-mapped files is much
@@ -413,11 +1503,13 @@ reallocf (void *ptr, size_t size)
  *
  * We provide a custom memcpy that copies xmem-allocated regions. We use
  * read/write instead of sendfile because sometimes we only partially copy the
- * files.
+ * files. The reads and writes are handed to the bulk I/O engine in io.c, which
+ * keeps many of them in flight at once.
  *
  * This routine can only copy entire files or portions of files defined by a
  * fixed-lengh offset (a common use case in R for example). Other kinds of
- * memcpy use the default memcpy.
+ * memcpy use the default memcpy, split over the I/O thread pool when they
+ * are large and touch a xmem region (see xmem_memcpy_parallel).
  *
  * Many additional improvements are possible here. See the inline comments
  * below...
@@ -429,8 +1521,7 @@ memcpy (void *dest, const void *src, size_t n)
   void *dest_off;
   void *src_off;
   int src_fd, dest_fd;
-  char buf[BUFSIZ];
-  ssize_t s;
+  int j;
   if(!xmem_default_memcpy)
     xmem_default_memcpy =
       (void *(*)(void *, const void *, size_t)) dlsym (RTLD_NEXT, "memcpy");
@@ -439,21 +1530,25 @@ memcpy (void *dest, const void *src, size_t n)
   omp_set_nest_lock (&lock);
   HASH_FIND_PTR (flexmap, &src_off, SRC);
   HASH_FIND_PTR (flexmap, &dest_off, DEST);
-  if (!SRC || !DEST)
+  if (!SRC || !DEST || !XMEM_FILE (SRC) || !XMEM_FILE (DEST))
   {
-/* One or more of src, dest is not the start of a xmem allocation.
+/* One or more of src, dest is not the start of a xmem allocation, or has
+ * no backing file (compressed tier).
  * Default in this case to the usual memcpy.
  */
     omp_unset_nest_lock (&lock);
-    return (*xmem_default_memcpy) (dest, src, n);
+    return xmem_memcpy_parallel (dest, src, n);
   }
-  if(SRC->length != (n + xmem_offset) || DEST->length != (n+xmem_offset))
+  if(SRC->size != (n + xmem_offset) || DEST->size != (n+xmem_offset)
+     || SRC->pid != xmem_pid || DEST->pid != xmem_pid)
   {
-/* Our efficient methods below require copy of a full region.
+/* Our efficient methods below require copy of a full region, of files this
+ * process owns: a child's view of an inherited region may differ from the
+ * file, and its writes must not reach the parent's file.
  * Default in this case to the usual memcpy.
  */
     omp_unset_nest_lock (&lock);
-    return (*xmem_default_memcpy) (dest, src, n);
+    return xmem_memcpy_parallel (dest, src, n);
   }
 #if defined(DEBUG) || defined(DEBUG2)
   fprintf(stderr,"CAZART! Xmem memcopy address %p src_addr %p of size %lu\n", SRC->addr, src,
@@ -474,12 +1569,18 @@ file (all in place).
 
 for now the best we can do is a reasonably efficient copy
 */
-  src_fd = open(SRC->path,O_RDONLY);
-  dest_fd = open(DEST->path,O_RDWR);
+  src_fd = xmem_fd (SRC);
+  dest_fd = xmem_fd (DEST);
+  DEST->fdirty = 1;
   omp_unset_nest_lock (&lock);
-  lseek(src_fd, xmem_offset, SEEK_SET);
-  lseek(dest_fd, xmem_offset, SEEK_SET);
-  while ((s = read(src_fd, buf, BUFSIZ)) > 0) write(dest_fd, buf, s);
+  xmem_compact_enter ();
+  j = src_fd < 0 || dest_fd < 0 ? -1
+    : xmem_io_copy (src_fd, xmem_offset, dest_fd, xmem_offset, n);
+  xmem_compact_leave ();
+  close(src_fd);
+  close(dest_fd);
+  if (j < 0)
+    return xmem_memcpy_parallel (dest, src, n);
   return dest;
 }
 
@@ -497,12 +1598,13 @@ calloc (size_t count, size_t size)
 {
   void *x;
   size_t n = count * size;
-  if (READY>0 && n > xmem_threshold)
+  if (READY>0 && (n > xmem_threshold ||
+                  (xmem_profile_mode && n > xmem_profile_min)))
     {
 #if defined(DEBUG) || defined(DEBUG2)
       fprintf(stderr,"Xmem calloc...handing off to xmem malloc\n");
 #endif
-      return malloc (n);
+      return xmem_malloc (n, XMEM_F_ZERO);
     }
   if(!xmem_hook) xmem_init();
   x = xmem_hook (n);//, NULL);
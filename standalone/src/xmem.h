@@ -9,8 +9,10 @@
  */                                                        
 #include <omp.h>
 #include "uthash.h"
+#include "xmem_api.h"
 
 #define XMEM_MAX_PATH_LEN 4096
+#define XMEM_SLAB_COUNT 64          /* Map structures allocated at a time */
 #undef DEBUG
 #undef DEBUG2
 
@@ -32,12 +34,33 @@
  * is to keep things as minimal as possible.
  */
 
+/* Internal xmem_malloc flag, next to the XMEM_F_* flags of xmem_api.h:
+ * the region must read as zeros (calloc).
+ */
+#define XMEM_F_ZERO 0x10000
+
 /* The map structure tracks the file mappings.  */
 struct map
 {
   void *addr;                   /* Memory address, list key */
-  char *path;                   /* File path */
+  char *path;                   /* File path, NULL if unlinked */
+  int fd;                       /* Backing file descriptor, see xmem_fd */
+  struct tier *tier;            /* Compressed tier state, NULL for files */
+  struct lazy *lazy;            /* Lazy creation state, see lazy.c */
+  unsigned short *clock;        /* Residency governor chunk state */
+  int named;                    /* Persistent named region, see named.c */
+  int shared;                   /* Exported or imported, see share.c */
+  int striped;                  /* Number of chunk files, see stripe.c */
+  unsigned int cached;          /* Nonzero on a free list, see cache.c */
+  int fdirty;                   /* Written through its file, see checkpoint.c */
+  int compact;                  /* Compaction queued or running, compact.c */
+  size_t reserve;               /* Mapped length when reserved, else 0 */
+  size_t extent;                /* Backing file length when reserved */
+  struct map *next;             /* Free list link */
   size_t length;                /* Mapping length */
+  size_t size;                  /* Size asked for, see cache.c */
+  struct quota *quota;          /* Tag charged, see quota.c */
+  size_t charged;               /* Out-of-core bytes charged */
   pid_t pid;                    /* Process ID of owner (for fork) */
   UT_hash_handle hh;            /* Make this thing uthash-hashable */
 };
@@ -47,15 +70,245 @@ struct map
 extern char xmem_fname_template[];
 extern size_t xmem_threshold;
 extern int xmem_advise;
+extern int xmem_unlinked;
+extern int xmem_fork_cow;
+
+/* Reservation mode (xmem_set_reserve in api.c): file-backed regions map
+ * xmem_reserve_factor times their length, but at most xmem_reserve_cap
+ * bytes more when that is set, of their file up front. realloc within the
+ * reserve only extends the file, geometrically, and leaves the mapping as
+ * it is. XMEM_MAPPED is the length actually mapped.
+ */
+#define XMEM_MAPPED(m) ((m)->reserve ? (m)->reserve : (m)->length)
+
+extern int xmem_reserve_factor;
+extern size_t xmem_reserve_cap;
+
+/* Preallocation of backing files, see xmem_mapfile in xmem.c.
+ * XMEM_PREALLOC_SPARSE files get their blocks when pages are first written,
+ * XMEM_PREALLOC_FULL files get all of them with fallocate at allocation time
+ * and XMEM_PREALLOC_CHUNK files get the first XMEM_PREALLOC_CHUNK_SIZE bytes
+ * at allocation time and the rest in the background. When a file can't be
+ * preallocated for lack of space, xmem_enospc says what malloc does instead:
+ * fail (XMEM_ENOSPC_FAIL), use the heap (XMEM_ENOSPC_HEAP) or the compressed
+ * tier (XMEM_ENOSPC_TIER).
+ */
+#define XMEM_PREALLOC_CHUNK_SIZE 67108864
+
+extern int xmem_prealloc;
+extern int xmem_enospc;
+
+/* Pre-faulting of new regions, see xmem_populate_region in xmem.c.
+ * XMEM_POPULATE_SYNC faults the region in from the allocating thread,
+ * XMEM_POPULATE_PARALLEL with an OpenMP team and XMEM_POPULATE_ASYNC on the
+ * I/O pool after malloc has returned. Only regions of at most
+ * xmem_populate_max bytes (0 means any size) are pre-faulted.
+ */
+#define XMEM_POPULATE_CHUNK 4194304   /* Bytes per task, a page multiple */
+
+extern int xmem_populate;
+extern size_t xmem_populate_max;
 
 /* The xmem_offset global can be set by the api. It affects memcpy by
  * searching for keys offset from the given memcpy address.
  */
 extern int xmem_offset;
 
+/* Profiling modes, see profile.c and xmem_profile in api.c.
+ * XMEM_PROFILE_RECORD collects per call site allocation statistics and writes
+ * them to a profile file; XMEM_PROFILE_APPLY loads such a file and uses it to
+ * decide file-backed versus heap placement per call site.
+ */
+#define XMEM_PROFILE_DEPTH 8          /* Backtrace frames hashed per site */
+#define XMEM_PROFILE_HOT 0.5          /* Touched-page ratio of a hot site */
+#define XMEM_PROFILE_SHORT 1.0        /* Lifetime (seconds) of a short site */
+
+extern int xmem_profile_mode;
+extern size_t xmem_profile_min;
+extern char xmem_profile_path[];
+extern pid_t xmem_profile_pid;
+
+/* Profiling hooks, see profile.c */
+unsigned long long xmem_profile_site (void);
+int xmem_profile_place (unsigned long long site);
+void xmem_profile_alloc (void *addr, size_t size, unsigned long long site);
+void xmem_profile_realloc (void *ptr, void *addr, size_t size);
+void xmem_profile_free (void *addr);
+int xmem_profile_load (const char *path);
+int xmem_profile_save (const char *path);
+void xmem_profile_clear (void);
+
+/* Backing tiers, see tier.c. XMEM_TIER_FILE regions are mapped from a
+ * backing file. XMEM_TIER_COMPRESSED regions live in anonymous memory whose
+ * cold chunks are compressed into a chunk store and faulted back in through
+ * userfaultfd. The compressed tier requires a build with COMPRESS=zstd or
+ * COMPRESS=lz4.
+ */
+#define XMEM_TIER_CHUNK 1048576     /* Compression unit, a page multiple */
+
+struct tier;
+extern int xmem_tier;
+extern int xmem_tier_interval;
+int xmem_tier_available (void);
+int xmem_tier_map (struct map *m);
+void xmem_tier_unmap (struct map *m);
+size_t xmem_tier_sweep (void);
+
+/* Lazily created regions, see lazy.c */
+struct lazy;
+int xmem_lazy_map (struct map *m, int advice, int huge);
+int xmem_lazy_settle (struct map *m);
+void xmem_lazy_unmap (struct map *m);
+
+/* Striped regions, see stripe.c */
+extern size_t xmem_stripe_chunk;
+int xmem_stripe_wanted (size_t n);
+int xmem_stripe_map (struct map *m, int zero, int advice, int huge);
+
+/* Named regions, see named.c */
+int xmem_named_map (struct map *m, const char *name, size_t size, int flags);
+int xmem_named_resize (struct map *m, size_t size);
+ssize_t xmem_named_length (int fd);
+
+/* Regions shared between processes, see share.c */
+int xmem_share_import (struct map *m, const char *handle, int sock,
+                       int flags);
+void xmem_share_drop (struct map *m);
+
+/* Backing files and region registration, see xmem.c. Backing files with a
+ * path are closed once mapped and opened again when needed, so m->fd may
+ * be -1 for a file-backed region; XMEM_FILE tells whether there is a file.
+ */
+#define XMEM_FILE(m) ((m)->fd > -1 || (m)->path)
+
+int xmem_fd (struct map *m);
+int xmem_keepfd (struct map *m);
+void xmem_dropfd (struct map *m);
+int xmem_mkfile (struct map *m);
+int xmem_mkfile_at (struct map *m, const char *fname, int unlinked);
+void xmem_rmfile (struct map *m);
+void *xmem_attach_with (int (*fn) (struct map *, void *), void *arg,
+                        int flags);
+
+/* Checkpoints, see checkpoint.c. The governor pages nothing out while
+ * xmem_checkpoint_busy is set.
+ */
+extern int xmem_checkpoint_busy;
+void xmem_checkpoint_evict (struct map *m, size_t off, size_t n);
+
+/* Bulk I/O engine and thread pool, see io.c */
+#define XMEM_IO_DEPTH 32            /* Requests in flight */
+#define XMEM_IO_BLOCK 131072        /* Bytes per request */
+
+#define XMEM_COPY_MIN 67108864      /* Smallest memcpy split over the pool */
+#define XMEM_COPY_CHUNK 8388608     /* Bytes per memcpy task, a power of 2 */
+
+extern int xmem_io_threads;
+int xmem_io_copy (int src, off_t soff, int dst, off_t doff, size_t n);
+int xmem_io_flush (int fd, off_t off, size_t n);
+int xmem_io_prefetch (int fd, off_t off, size_t n);
+int xmem_io_reserve (int fd, off_t off, size_t n, size_t sync);
+void xmem_pool_run (void (*fn) (void *, size_t), void *arg, size_t n);
+int xmem_pool_async (void (*fn) (void *, size_t), void *arg, size_t n,
+                     void (*fin) (void *));
+
+/* Page cache residency governor, see governor.c. A background thread keeps
+ * the resident size of all file-backed regions under xmem_budget bytes (0
+ * disables it) by paging out the least recently used chunks.
+ */
+#define XMEM_GOVERNOR_CHUNK 2097152   /* Sampling and eviction unit */
+#define XMEM_GOVERNOR_INTERVAL 250    /* Sampling period in milliseconds */
+#define XMEM_GOVERNOR_LOW 90          /* Evict down to this % of the budget */
+#define XMEM_GOVERNOR_REF 0x8000      /* Chunk referenced bit */
+
+extern size_t xmem_budget;
+extern size_t xmem_resident_bytes;
+void xmem_governor_start (void);
+
+/* Deferred removal of freed backing files, see reaper.c */
+#define XMEM_REAP_STEP 1073741824     /* Bytes hole-punched per call */
+
+extern size_t xmem_reap_limit;
+int xmem_reap (struct map *m);
+void xmem_reap_wait (void);
+
+/* Recycling of freed regions, see cache.c */
+#define XMEM_CACHE_CLASSES 256        /* Four size classes per power of 2 */
+#define XMEM_CACHE_PERIOD 256         /* Frees between returns to the pool */
+
+extern size_t xmem_cache_bytes;
+size_t xmem_cache_size (size_t n);
+void *xmem_cache_get (size_t n);
+int xmem_cache_put (struct map *m);
+void xmem_cache_trim (void);
+void xmem_release (struct map *m);
+
+/* Disk and resident quotas per process and per thread tag, see quota.c */
+#define XMEM_QUOTA_NAME 64            /* Tag name length, with the NUL */
+
+struct quota;
+extern int xmem_quota_governed;
+int xmem_quota_check (size_t n);
+int xmem_quota_fits (struct map *m, size_t n, int *action);
+void xmem_quota_charge (struct map *m, size_t n);
+void xmem_quota_sample (struct map *m, size_t n, int start);
+struct quota *xmem_quota_over (struct quota *q, size_t *rss, size_t *budget);
+void xmem_quota_child (void);
+
+/* Configuration from the environment and a config file, see config.c */
+extern int xmem_nclasses;
+void xmem_config_init (void);
+int xmem_size_class (size_t n);
+
+/* Zero page compaction, see compact.c */
+#define XMEM_COMPACT_CHUNK XMEM_GOVERNOR_CHUNK /* Bytes checked at a time */
+
+extern size_t xmem_compacted_bytes;
+ssize_t xmem_compact_region (void *addr);
+int xmem_compact_async (void *addr);
+void xmem_compact_cancel (struct map *m);
+void xmem_compact_enter (void);
+void xmem_compact_leave (void);
+
+/* uthash allocation hooks that bypass the interposed malloc and free, see
+ * xmem.c. Files that add items to a hash must define uthash_malloc and
+ * uthash_free in terms of these before including uthash.h.
+ */
+void *uthash_malloc_ (size_t);
+void uthash_free_ (void *);
+
 /* The global variable flexmap is a key-value list of addresses (keys) and file
  * paths (values). The recursive OpenMP lock is used widely in the library and
- * API functions.
+ * API functions. Both are defined in xmem.c.
+ */
+extern struct map *flexmap;
+extern omp_nest_lock_t lock;
+
+/* Lock statistics, see lockstat.c. Built with XMEM_LOCKSTAT (make
+ * LOCKSTAT=1), every use of the lock goes through these to time it.
+ */
+#ifdef XMEM_LOCKSTAT
+void xmem_lock_init (omp_nest_lock_t *l);
+void xmem_lock_set (omp_nest_lock_t *l);
+void xmem_lock_unset (omp_nest_lock_t *l);
+#define omp_init_nest_lock(l) xmem_lock_init (l)
+#define omp_set_nest_lock(l) xmem_lock_set (l)
+#define omp_unset_nest_lock(l) xmem_lock_unset (l)
+#endif
+
+/* The length of the shortest region ever mapped, which only goes down. free
+ * of anything shorter can skip flexmap, see xmem_free_sized in xmem.c.
+ */
+extern size_t xmem_min_mapped;
+
+/* The process ID, reset in forked children by the fork handlers in xmem.c.
+ * Regions whose m->pid differs were inherited from the parent, which owns
+ * their files.
+ */
+extern pid_t xmem_pid;
+
+/* Set once this process has forked: its children may still map the files
+ * of its regions, shared or copy-on-write, see reaper.c.
  */
-struct map *flexmap;
-omp_nest_lock_t lock;
+extern int xmem_forked;
+void xmem_free_sized (void *ptr, size_t size);
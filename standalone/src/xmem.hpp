@@ -0,0 +1,500 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#ifndef XMEM_HPP
+#define XMEM_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* NOTES
+ *
+ * An explicit C++ interface to out of core memory, header only. Nothing here
+ * depends on libxmem.so or on LD_PRELOAD: the classes below map their own
+ * backing files, so containers can be placed out of core one at a time
+ * without lowering xmem_threshold for the whole process. They work the same
+ * with or without the library preloaded.
+ *
+ * xmem::options says where and how a mapping is made: tier::file maps an
+ * unlinked temporary file in dir, tier::ram maps anonymous memory (handy to
+ * keep a hot container in RAM with the same interface). huge_pages asks for
+ * transparent huge pages, advice is passed to madvise and populate faults
+ * the mapping in up front.
+ *
+ * xmem::memory_resource is a std::pmr::memory_resource. Allocations of at
+ * least options::min_bytes get a mapping each; smaller ones go to an
+ * upstream resource. xmem::allocator<T> is a standard allocator over a
+ * memory_resource. xmem::mapped_vector<T> is a vector of trivially copyable
+ * T on one mapping that grows in place where it can (mremap), reserves ahead
+ * geometrically and offers prefetch and advise.
+ *
+ * Errors are reported with std::bad_alloc, like the standard allocators.
+ */
+
+namespace xmem
+{
+
+enum class tier
+{
+  file,
+  ram
+};
+
+struct options
+{
+  tier where = tier::file;
+  std::string dir = "/tmp";
+  bool huge_pages = false;
+  int advice = MADV_NORMAL;
+  bool populate = false;
+  std::size_t min_bytes = 1 << 20;      /* memory_resource only */
+};
+
+namespace detail
+{
+
+inline std::size_t
+page ()
+{
+  static const std::size_t pg = (std::size_t) sysconf (_SC_PAGESIZE);
+  return pg;
+}
+
+inline std::size_t
+round_up (std::size_t n)
+{
+  return (n + page () - 1) & ~(page () - 1);
+}
+
+/* Create an unlinked backing file in dir. Returns a descriptor or -1. */
+inline int
+make_file (const std::string &dir)
+{
+  int fd = -1;
+#ifdef O_TMPFILE
+  fd = open (dir.c_str (), O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+#endif
+  if (fd < 0)
+    {
+      std::string name = dir + "/xmem_XXXXXX";
+      fd = mkostemp (&name[0], O_CLOEXEC);
+      if (fd > -1)
+        unlink (name.c_str ());
+    }
+  return fd;
+}
+
+inline void
+tune (void *p, std::size_t n, const options &o)
+{
+#ifdef MADV_HUGEPAGE
+  if (o.huge_pages)
+    madvise (p, n, MADV_HUGEPAGE);
+#endif
+  if (o.advice != MADV_NORMAL)
+    madvise (p, n, o.advice);
+  if (o.populate)
+    {
+#ifdef MADV_POPULATE_WRITE
+      if (madvise (p, n, MADV_POPULATE_WRITE) == 0)
+        return;
+#endif
+      for (std::size_t j = 0; j < n; j += page ())
+        ((volatile char *) p)[j] = ((volatile char *) p)[j];
+    }
+}
+
+/* Map n bytes (a page multiple) as o says. With fd not NULL and a file
+ * tier, the backing file stays open and its descriptor is returned there.
+ */
+inline void *
+map (std::size_t n, const options &o, int *fd = nullptr)
+{
+  void *p;
+  if (o.where == tier::ram)
+    {
+      p = mmap (nullptr, n, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (p == MAP_FAILED)
+        throw std::bad_alloc ();
+      tune (p, n, o);
+      return p;
+    }
+  int f = make_file (o.dir);
+  if (f < 0)
+    throw std::bad_alloc ();
+  if (ftruncate (f, (off_t) n) < 0)
+    {
+      close (f);
+      throw std::bad_alloc ();
+    }
+  p = mmap (nullptr, n, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+  if (p == MAP_FAILED)
+    {
+      close (f);
+      throw std::bad_alloc ();
+    }
+  if (fd)
+    *fd = f;
+  else
+    close (f);                  /* The mapping keeps the file alive. */
+  tune (p, n, o);
+  return p;
+}
+
+} /* namespace detail */
+
+/* A std::pmr::memory_resource that maps large allocations. */
+class memory_resource : public std::pmr::memory_resource
+{
+public:
+  explicit memory_resource (options o = options (),
+                            std::pmr::memory_resource *upstream =
+                            std::pmr::new_delete_resource ())
+    : opt (std::move (o)), up (upstream)
+  {
+  }
+
+  const options &get_options () const
+  {
+    return opt;
+  }
+
+  std::pmr::memory_resource *upstream_resource () const
+  {
+    return up;
+  }
+
+private:
+  options opt;
+  std::pmr::memory_resource *up;
+
+  void *do_allocate (std::size_t n, std::size_t align) override
+  {
+    if (n < opt.min_bytes || align > detail::page ())
+      return up->allocate (n, align);
+    return detail::map (detail::round_up (n), opt);
+  }
+
+  void do_deallocate (void *p, std::size_t n, std::size_t align) override
+  {
+    if (n < opt.min_bytes || align > detail::page ())
+      up->deallocate (p, n, align);
+    else
+      munmap (p, detail::round_up (n));
+  }
+
+  bool do_is_equal (const std::pmr::memory_resource &other) const noexcept
+    override
+  {
+    return this == &other;
+  }
+};
+
+/* A process-wide memory_resource with default options. */
+inline memory_resource *
+default_resource ()
+{
+  static memory_resource r;
+  return &r;
+}
+
+/* A standard allocator drawing from a memory_resource. */
+template < class T > class allocator
+{
+public:
+  typedef T value_type;
+
+  allocator () noexcept : res (default_resource ())
+  {
+  }
+
+  explicit allocator (memory_resource *r) noexcept : res (r)
+  {
+  }
+
+  template < class U > allocator (const allocator < U > &a) noexcept
+    : res (a.resource ())
+  {
+  }
+
+  T *allocate (std::size_t n)
+  {
+    if (n > (std::size_t) -1 / sizeof (T))
+      throw std::bad_alloc ();
+    return static_cast < T * >(res->allocate (n * sizeof (T), alignof (T)));
+  }
+
+  void deallocate (T *p, std::size_t n) noexcept
+  {
+    res->deallocate (p, n * sizeof (T), alignof (T));
+  }
+
+  memory_resource *resource () const noexcept
+  {
+    return res;
+  }
+
+private:
+  memory_resource *res;
+};
+
+template < class T, class U >
+bool
+operator== (const allocator < T > &a, const allocator < U > &b) noexcept
+{
+  return a.resource () == b.resource ();
+}
+
+template < class T, class U >
+bool
+operator!= (const allocator < T > &a, const allocator < U > &b) noexcept
+{
+  return !(a == b);
+}
+
+/* A vector of trivially copyable T on a single mapping. Growth reserves
+ * ahead geometrically and extends the mapping with mremap, which moves no
+ * data in memory; pointers and iterators are invalidated by growth as for
+ * std::vector.
+ */
+template < class T > class mapped_vector
+{
+  static_assert (std::is_trivially_copyable < T >::value,
+                 "mapped_vector needs a trivially copyable type");
+
+public:
+  typedef T value_type;
+  typedef T *iterator;
+  typedef const T *const_iterator;
+
+  explicit mapped_vector (options o = options ()) : opt (std::move (o))
+  {
+  }
+
+  explicit mapped_vector (std::size_t n, options o = options ())
+    : opt (std::move (o))
+  {
+    resize (n);
+  }
+
+  mapped_vector (const mapped_vector &) = delete;
+  mapped_vector &operator= (const mapped_vector &) = delete;
+
+  mapped_vector (mapped_vector &&v) noexcept
+  {
+    swap (v);
+  }
+
+  mapped_vector &operator= (mapped_vector &&v) noexcept
+  {
+    swap (v);
+    return *this;
+  }
+
+  ~mapped_vector ()
+  {
+    release ();
+  }
+
+  void swap (mapped_vector &v) noexcept
+  {
+    std::swap (opt, v.opt);
+    std::swap (p, v.p);
+    std::swap (n, v.n);
+    std::swap (cap, v.cap);
+    std::swap (bytes, v.bytes);
+    std::swap (fd, v.fd);
+  }
+
+  T *data () noexcept
+  {
+    return p;
+  }
+  const T *data () const noexcept
+  {
+    return p;
+  }
+  std::size_t size () const noexcept
+  {
+    return n;
+  }
+  std::size_t capacity () const noexcept
+  {
+    return cap;
+  }
+  bool empty () const noexcept
+  {
+    return n == 0;
+  }
+  T &operator[] (std::size_t j) noexcept
+  {
+    return p[j];
+  }
+  const T &operator[] (std::size_t j) const noexcept
+  {
+    return p[j];
+  }
+  iterator begin () noexcept
+  {
+    return p;
+  }
+  iterator end () noexcept
+  {
+    return p + n;
+  }
+  const_iterator begin () const noexcept
+  {
+    return p;
+  }
+  const_iterator end () const noexcept
+  {
+    return p + n;
+  }
+
+  /* Make room for at least c elements. */
+  void reserve (std::size_t c)
+  {
+    if (c <= cap)
+      return;
+    if (c > (std::size_t) -1 / sizeof (T))
+      throw std::bad_alloc ();
+    std::size_t b = detail::round_up (c * sizeof (T));
+    if (!p)
+      {
+        p = static_cast < T * >(detail::map (b, opt, &fd));
+      }
+    else
+      {
+        if (fd > -1 && ftruncate (fd, (off_t) b) < 0)
+          throw std::bad_alloc ();
+        void *q = mremap (p, bytes, b, MREMAP_MAYMOVE);
+        if (q == MAP_FAILED)
+          throw std::bad_alloc ();
+        p = static_cast < T * >(q);
+        detail::tune ((char *) q + bytes, b - bytes, opt);
+      }
+    bytes = b;
+    cap = b / sizeof (T);
+  }
+
+  /* Resize to c elements. New elements are zero (value-initialized for
+   * arithmetic types), as the mapping is: dropped elements are zeroed, see
+   * zero.
+   */
+  void resize (std::size_t c)
+  {
+    if (c > cap)
+      reserve (c);
+    if (c < n)
+      zero (c, n);
+    n = c;
+  }
+
+  void push_back (const T &x)
+  {
+    if (n == cap)
+      reserve (grow ());
+    p[n++] = x;
+  }
+
+  void pop_back () noexcept
+  {
+    --n;
+    std::memset ((void *) (p + n), 0, sizeof (T));
+  }
+
+  void clear () noexcept
+  {
+    resize (0);
+  }
+
+  /* Start reading elements [first, first + count) into memory. */
+  void prefetch (std::size_t first = 0, std::size_t count = (std::size_t) -1)
+  {
+    advise (MADV_WILLNEED, first, count);
+  }
+
+  /* madvise elements [first, first + count) with advice. */
+  void advise (int advice, std::size_t first = 0,
+               std::size_t count = (std::size_t) -1)
+  {
+    if (!p || first >= n)
+      return;
+    if (count > n - first)
+      count = n - first;
+    std::uintptr_t a = (std::uintptr_t) (p + first) & ~(detail::page () - 1);
+    std::uintptr_t e = (std::uintptr_t) (p + first + count);
+    madvise ((void *) a, e - a, advice);
+  }
+
+private:
+  options opt;
+  T *p = nullptr;
+  std::size_t n = 0, cap = 0, bytes = 0;
+  int fd = -1;
+
+  /* Zero elements [first, last). The whole pages among them are punched
+   * out of the file, or dropped from anonymous memory, which reads back as
+   * zeros without writing them; only the partial pages at the ends are
+   * cleared.
+   */
+  void zero (std::size_t first, std::size_t last) noexcept
+  {
+    std::uintptr_t pg = detail::page ();
+    char *a = (char *) (p + first), *e = (char *) (p + last);
+    char *x = (char *) (((std::uintptr_t) a + pg - 1) & ~(pg - 1));
+    char *y = (char *) ((std::uintptr_t) e & ~(pg - 1));
+    int j = -1;
+    if (x < y && fd > -1)
+      j = fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t) (x - (char *) p), (off_t) (y - x));
+    else if (x < y && opt.where == tier::ram)
+      j = madvise (x, y - x, MADV_DONTNEED);
+    if (j < 0)
+      x = y = e;
+    std::memset (a, 0, x - a);
+    std::memset (y, 0, e - y);
+  }
+
+  std::size_t grow () const
+  {
+    std::size_t c = cap + cap / 2;
+    std::size_t min = detail::page () / sizeof (T) + 1;
+    return c < min ? min : c;
+  }
+
+  void release () noexcept
+  {
+    if (p)
+      munmap (p, bytes);
+    if (fd > -1)
+      close (fd);
+    p = nullptr;
+    fd = -1;
+    n = cap = bytes = 0;
+  }
+};
+
+} /* namespace xmem */
+
+#endif
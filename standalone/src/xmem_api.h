@@ -0,0 +1,203 @@
+/*   ___    ___ _____ ______   _______   _____ ______
+ *  |\  \  /  /|\   _ \  _   \|\  ___ \ |\   _ \  _   \
+ *  \ \  \/  / | \  \\\__\ \  \ \   __/|\ \  \\\__\ \  \
+ *   \ \    / / \ \  \\|__| \  \ \  \_|/_\ \  \\|__| \  \
+ *    /     \/   \ \  \    \ \  \ \  \_|\ \ \  \    \ \  \
+ *   /  /\   \    \ \__\    \ \__\ \_______\ \__\    \ \__\
+ *  /__/ /\ __\    \|__|     \|__|\|_______|\|__|     \|__|
+ *  |__|/ \|__|
+ */
+#ifndef XMEM_API_H
+#define XMEM_API_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* NOTES
+ *
+ * The public xmem API. Programs that link against libxmem.so (or load it
+ * with LD_PRELOAD and resolve these functions with dlsym) include this
+ * header. Everything else in the library is internal, see xmem.h.
+ *
+ * malloc interposition with a process-wide threshold stays the default.
+ * xmem_malloc_ex lets a caller that knows better decide the placement of a
+ * single allocation with XMEM_F_* flags:
+ *
+ * XMEM_F_FILE        file-backed, whatever its size
+ * XMEM_F_RAM         on the heap, whatever its size
+ * XMEM_F_COMPRESSED  on the compressed tier (falls back to a file)
+ * XMEM_F_HUGE        transparent huge pages, where the backing supports them
+ * XMEM_F_POPULATE    faulted in before xmem_malloc_ex returns
+ * XMEM_F_LAZY        the backing file is only created on first touch
+ * XMEM_F_ADVICE(a)   madvise advice a instead of the xmem_madvise default
+ *
+ * Memory from xmem_malloc_ex is released with xmem_free_ex or free.
+ *
+ * xmem_map_named creates or attaches a named region, a backing file that
+ * survives free and exit (see named.c). XMEM_NAMED_CREATE creates it if it
+ * doesn't exist, XMEM_NAMED_EXCL fails if it does, and XMEM_NAMED_TAG(t)
+ * stores a type tag t (1 to 2047) with a new region and checks it on
+ * attach. XMEM_F_HUGE, XMEM_F_POPULATE and XMEM_F_ADVICE(a) apply as above.
+ * A size of 0 attaches an existing region of any size.
+ *
+ * xmem_export and xmem_export_fd hand a region to another process, which
+ * maps the same backing file with xmem_import or xmem_import_fd, read-only
+ * with XMEM_IMPORT_RDONLY (see share.c). The file is removed when the last
+ * process lets go of it.
+ *
+ * xmem_set_stripe spreads file-backed regions larger than a chunk size over
+ * chunk files in several directories, for the bandwidth of several devices
+ * (see stripe.c).
+ *
+ * xmem_set_quota limits the out-of-core and resident bytes of the process, or
+ * of the threads tagged with a name by xmem_set_tag, and says what malloc
+ * does at the out-of-core limit: fail, block until there is room, or spill
+ * to the compressed tier (see quota.c).
+ *
+ * Settings can also come from XMEM_* environment variables and a config
+ * file named by XMEM_CONFIG, applied before the first allocation;
+ * xmem_configure applies them again (see config.c).
+ *
+ * xmem_checkpoint writes the data of all live regions to a directory,
+ * incrementally where the kernel tracks dirty pages, and xmem_restore maps
+ * them back at the same addresses in a new process (see checkpoint.c).
+ */
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Placement flags for xmem_malloc_ex */
+#define XMEM_F_FILE 0x0001
+#define XMEM_F_RAM 0x0002
+#define XMEM_F_COMPRESSED 0x0004
+#define XMEM_F_HUGE 0x0008
+#define XMEM_F_POPULATE 0x0010
+#define XMEM_F_LAZY 0x0020
+#define XMEM_F_ADVICE(a) (((a) + 1) << 8)
+#define XMEM_F_ADVICE_MASK 0xff00
+
+/* Flags for xmem_map_named, next to XMEM_F_HUGE, POPULATE and ADVICE */
+#define XMEM_NAMED_CREATE 0x0040
+#define XMEM_NAMED_EXCL 0x0080
+#define XMEM_NAMED_TAG(t) (((t) & 0x7ff) << 20)
+#define XMEM_NAMED_TAG_OF(f) (((f) >> 20) & 0x7ff)
+
+/* Flags for xmem_import and xmem_import_fd, next to XMEM_F_HUGE and ADVICE */
+#define XMEM_IMPORT_RDONLY 0x0040
+
+/* Flags for xmem_checkpoint */
+#define XMEM_CHECKPOINT_FULL 0x0001   /* Copy everything, not just changes */
+
+/* Backing tiers, xmem_set_tier */
+#define XMEM_TIER_FILE 0
+#define XMEM_TIER_COMPRESSED 1
+
+/* Preallocation modes and out of space policies, xmem_set_prealloc and
+ * xmem_set_enospc
+ */
+#define XMEM_PREALLOC_SPARSE 0
+#define XMEM_PREALLOC_FULL 1
+#define XMEM_PREALLOC_CHUNK 2
+#define XMEM_ENOSPC_FAIL 0
+#define XMEM_ENOSPC_HEAP 1
+#define XMEM_ENOSPC_TIER 2
+
+/* Actions at an out-of-core quota, xmem_set_quota */
+#define XMEM_QUOTA_FAIL 0
+#define XMEM_QUOTA_BLOCK 1
+#define XMEM_QUOTA_SPILL 2
+
+/* Pre-faulting modes, xmem_set_populate */
+#define XMEM_POPULATE_OFF 0
+#define XMEM_POPULATE_SYNC 1
+#define XMEM_POPULATE_PARALLEL 2
+#define XMEM_POPULATE_ASYNC 3
+
+/* Call site profiling modes, xmem_profile */
+#define XMEM_PROFILE_OFF 0
+#define XMEM_PROFILE_RECORD 1
+#define XMEM_PROFILE_APPLY 2
+
+/* Lock statistics, xmem_lockstat. Holds are counted and timed from the
+ * outermost acquisition of the library lock to its release; hist[k] counts
+ * holds of 2^k to 2^(k+1) nanoseconds, the last bucket longer ones too.
+ */
+#define XMEM_LOCKSTAT_BUCKETS 32
+
+struct xmem_lockstat
+{
+  unsigned long long holds;
+  unsigned long long hold_ns;
+  unsigned long long max_hold_ns;
+  unsigned long long wait_ns;
+  unsigned long long max_wait_ns;
+  unsigned long long hist[XMEM_LOCKSTAT_BUCKETS];
+};
+
+/* Streams, see xmem_stream_read */
+#define XMEM_STREAM_ALIGN 4096      /* Buffer, length and offset alignment */
+#define XMEM_STREAM_BLOCK 1048576   /* xmem_stream_next block, a power of 2 */
+
+void *xmem_malloc_ex (size_t size, int flags);
+void xmem_free_ex (void *ptr);
+void *xmem_map_named (const char *name, size_t size, int flags);
+int xmem_named_info (const char *name, size_t *size, int *tag);
+int xmem_unlink_named (const char *name);
+char *xmem_export (void *addr);
+int xmem_export_fd (void *addr, int sock);
+void *xmem_import (const char *handle, int flags);
+void *xmem_import_fd (int sock, int flags);
+int xmem_checkpoint (const char *dir, int flags);
+int xmem_restore (const char *dir);
+int xmem_set_stripe (const char *dirs, size_t chunk);
+int xmem_configure (const char *path);
+int xmem_lockstat (struct xmem_lockstat *s, int reset);
+int xmem_set_tag (const char *name, int thread);
+int xmem_set_quota (const char *name, size_t disk, size_t resident,
+                    int action, int timeout);
+int xmem_quota_usage (const char *name, size_t *disk, size_t *resident);
+
+size_t xmem_set_threshold (size_t j);
+int xmem_set_template (char *name);
+int xmem_set_pattern (char *name);
+int xmem_set_path (char *p);
+char *xmem_get_template (void);
+char *xmem_lookup (void *addr);
+int xmem_madvise (int j);
+int xmem_memcpy_offset (int j);
+int xmem_set_unlink (int j);
+int xmem_set_fork_cow (int j);
+int xmem_set_prealloc (int j);
+int xmem_set_enospc (int j);
+int xmem_set_populate (int j, size_t max);
+int xmem_set_tier (int j);
+int xmem_tier_period (int ms);
+size_t xmem_tier_evict (void);
+int xmem_set_io_threads (int j);
+size_t xmem_set_budget (size_t j);
+size_t xmem_resident (void);
+size_t xmem_set_reaper (size_t j);
+size_t xmem_set_cache (size_t j);
+int xmem_set_reserve (int factor, size_t cap);
+ssize_t xmem_compact (void *addr, int async);
+size_t xmem_compacted (void);
+int xmem_prefetch (void *addr, size_t offset, size_t length);
+int xmem_flush (void *addr);
+int xmem_profile (int mode, char *path);
+size_t xmem_profile_floor (size_t j);
+
+struct xmem_stream;
+struct xmem_stream *xmem_stream_open (void *addr);
+off_t xmem_stream_seek (struct xmem_stream *s, off_t off);
+ssize_t xmem_stream_read (struct xmem_stream *s, void *buf, size_t n);
+ssize_t xmem_stream_write (struct xmem_stream *s, const void *buf, size_t n);
+const void *xmem_stream_next (struct xmem_stream *s, size_t *n);
+void xmem_stream_close (struct xmem_stream *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif